@@ -0,0 +1,84 @@
+#include "acpi.h"
+
+typedef struct {
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_address;
+  // ACPI 2.0+
+  uint32_t length;
+  uint64_t xsdt_address;
+  uint8_t ext_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed)) AcpiRsdp;
+
+static const AcpiSdtHeader *g_acpi_root = 0;
+static uint32_t g_acpi_entry_size = 0;
+
+static int acpi_checksum_ok(const void *p, uint32_t len) {
+  const uint8_t *b = (const uint8_t *)p;
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    sum = (uint8_t)(sum + b[i]);
+  }
+  return sum == 0;
+}
+
+static int acpi_sig_equal(const char *a, const char *b, uint32_t len) {
+  for (uint32_t i = 0; i < len; ++i) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int acpi_init(uint64_t rsdp) {
+  g_acpi_root = 0;
+  g_acpi_entry_size = 0;
+  if (rsdp == 0) {
+    return 0;
+  }
+  const AcpiRsdp *r = (const AcpiRsdp *)(uintptr_t)rsdp;
+  if (!acpi_sig_equal(r->signature, "RSD PTR ", 8) ||
+      !acpi_checksum_ok(r, 20)) {
+    return 0;
+  }
+  if (r->revision >= 2 && r->xsdt_address != 0 &&
+      acpi_checksum_ok(r, r->length)) {
+    g_acpi_root = (const AcpiSdtHeader *)(uintptr_t)r->xsdt_address;
+    g_acpi_entry_size = 8;
+  } else {
+    g_acpi_root = (const AcpiSdtHeader *)(uintptr_t)r->rsdt_address;
+    g_acpi_entry_size = 4;
+  }
+  if (!acpi_checksum_ok(g_acpi_root, g_acpi_root->length)) {
+    g_acpi_root = 0;
+    return 0;
+  }
+  return 1;
+}
+
+const AcpiSdtHeader *acpi_find_table(const char *signature) {
+  if (!g_acpi_root || !signature) {
+    return 0;
+  }
+  const uint8_t *entries = (const uint8_t *)g_acpi_root + sizeof(AcpiSdtHeader);
+  uint32_t count = (g_acpi_root->length - sizeof(AcpiSdtHeader)) /
+                   g_acpi_entry_size;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint64_t addr;
+    if (g_acpi_entry_size == 8) {
+      addr = *(const uint64_t *)(entries + i * 8);
+    } else {
+      addr = *(const uint32_t *)(entries + i * 4);
+    }
+    const AcpiSdtHeader *t = (const AcpiSdtHeader *)(uintptr_t)addr;
+    if (t && acpi_sig_equal(t->signature, signature, 4) &&
+        acpi_checksum_ok(t, t->length)) {
+      return t;
+    }
+  }
+  return 0;
+}
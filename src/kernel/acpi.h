@@ -0,0 +1,24 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+
+typedef struct {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed)) AcpiSdtHeader;
+
+// Validate the RSDP handed over by the loader and locate the RSDT/XSDT.
+int acpi_init(uint64_t rsdp);
+// First table with the given 4-character signature whose checksum is
+// valid, or 0.
+const AcpiSdtHeader *acpi_find_table(const char *signature);
+
+#endif
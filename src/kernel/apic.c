@@ -0,0 +1,290 @@
+#include "apic.h"
+#include "acpi.h"
+#include "console.h"
+#include "cpu.h"
+#include "idt.h"
+#include "time.h"
+
+#define IA32_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1u << 11)
+#define APIC_BASE_X2APIC (1u << 10)
+
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_LVT_MASKED (1u << 16)
+#define LAPIC_TIMER_PERIODIC (1u << 17)
+
+#define IOAPIC_MAX 4
+#define IOAPIC_MAX_OVERRIDES 16
+#define APIC_MAX_CPUS 64
+
+typedef struct {
+  AcpiSdtHeader header;
+  uint32_t lapic_address;
+  uint32_t flags;
+} __attribute__((packed)) AcpiMadt;
+
+typedef struct {
+  uint64_t base;
+  uint32_t gsi_base;
+  uint32_t count;
+} IoApic;
+
+typedef struct {
+  uint8_t source;
+  uint32_t gsi;
+  uint16_t flags;
+} IsaOverride;
+
+static uint64_t g_lapic_base = 0;
+static int g_x2apic = 0;
+
+static volatile uint64_t g_timer_ticks = 0;
+static uint32_t g_timer_hz = 0;
+
+static IoApic g_ioapics[IOAPIC_MAX];
+static uint32_t g_ioapic_count = 0;
+static IsaOverride g_isa_overrides[IOAPIC_MAX_OVERRIDES];
+static uint32_t g_isa_override_count = 0;
+static uint32_t g_cpu_ids[APIC_MAX_CPUS];
+static uint32_t g_cpu_count = 0;
+
+static inline void outb(uint16_t port, uint8_t val) {
+  __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+// In x2APIC mode the registers are MSRs 0x800 + (offset >> 4).
+static uint32_t lapic_read(uint32_t reg) {
+  if (g_x2apic) {
+    return (uint32_t)rdmsr(0x800 + (reg >> 4));
+  }
+  return *(volatile uint32_t *)(uintptr_t)(g_lapic_base + reg);
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+  if (g_x2apic) {
+    wrmsr(0x800 + (reg >> 4), value);
+    return;
+  }
+  *(volatile uint32_t *)(uintptr_t)(g_lapic_base + reg) = value;
+}
+
+void lapic_enable(void) {
+  uint64_t base = rdmsr(IA32_APIC_BASE);
+  if (!(base & APIC_BASE_ENABLE)) {
+    base |= APIC_BASE_ENABLE;
+    wrmsr(IA32_APIC_BASE, base);
+  }
+  // INIT leaves an AP in xAPIC mode; follow the BSP into x2APIC mode (only
+  // reachable from an enabled xAPIC) so every CPU uses the same accessors.
+  if (g_x2apic && !(base & APIC_BASE_X2APIC)) {
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_X2APIC);
+  }
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_SVR, 0x100 | IRQ_VECTOR_SPURIOUS);
+}
+
+int lapic_init(void) {
+  // Mask every line on both 8259s; nothing should arrive through them.
+  outb(0x21, 0xFF);
+  outb(0xA1, 0xFF);
+  uint64_t base = rdmsr(IA32_APIC_BASE);
+  g_x2apic = (base & APIC_BASE_X2APIC) != 0;
+  g_lapic_base = base & 0xFFFFFF000ull;
+  lapic_enable();
+  return 1;
+}
+
+uint32_t lapic_id(void) {
+  uint32_t id = lapic_read(LAPIC_ID);
+  return g_x2apic ? id : id >> 24;
+}
+
+void lapic_eoi(void) {
+  lapic_write(LAPIC_EOI, 0);
+}
+
+int lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+  if (g_x2apic) {
+    wrmsr(0x800 + (LAPIC_ICR_LOW >> 4), ((uint64_t)apic_id << 32) | command);
+    return 1;
+  }
+  lapic_write(LAPIC_ICR_HIGH, (apic_id & 0xFF) << 24);
+  lapic_write(LAPIC_ICR_LOW, command);
+  // Delivery status clears once the message has been accepted.
+  uint64_t deadline = ktime_deadline(10 * KTIME_MS);
+  while (lapic_read(LAPIC_ICR_LOW) & (1u << 12)) {
+    if (ktime_expired(deadline)) {
+      return 0;
+    }
+    cpu_relax();
+  }
+  return 1;
+}
+
+// The timer only runs on the BSP, which is where console output comes from.
+static void lapic_timer_irq(InterruptFrame *frame, void *ctx) {
+  g_timer_ticks++;
+  console_tick();
+}
+
+// LAPIC timer counts per second at divide-by-16, measured over 10 ms of
+// calibrated TSC time.
+static uint32_t lapic_timer_calibrate(void) {
+  lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFFu);
+  ktime_delay(10 * KTIME_MS);
+  uint32_t remaining = lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+  return (0xFFFFFFFFu - remaining) * 100u;
+}
+
+int lapic_timer_init(uint32_t hz) {
+  g_timer_ticks = 0;
+  g_timer_hz = 0;
+  if (hz == 0) {
+    return 0;
+  }
+  uint32_t rate = lapic_timer_calibrate();
+  if (rate < hz) {
+    return 0;
+  }
+  int vector = irq_alloc_vector(lapic_timer_irq, 0);
+  if (vector < 0) {
+    return 0;
+  }
+  g_timer_hz = hz;
+  lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | (uint32_t)vector);
+  lapic_write(LAPIC_TIMER_INIT, rate / hz);
+  return 1;
+}
+
+uint64_t lapic_timer_ticks(void) {
+  return g_timer_ticks;
+}
+
+uint32_t lapic_timer_hz(void) {
+  return g_timer_hz;
+}
+
+static uint32_t ioapic_read(const IoApic *io, uint32_t reg) {
+  *(volatile uint32_t *)(uintptr_t)io->base = reg;
+  return *(volatile uint32_t *)(uintptr_t)(io->base + 0x10);
+}
+
+static void ioapic_write(const IoApic *io, uint32_t reg, uint32_t value) {
+  *(volatile uint32_t *)(uintptr_t)io->base = reg;
+  *(volatile uint32_t *)(uintptr_t)(io->base + 0x10) = value;
+}
+
+int apic_madt_init(void) {
+  g_ioapic_count = 0;
+  g_isa_override_count = 0;
+  g_cpu_count = 0;
+  const AcpiSdtHeader *t = acpi_find_table("APIC");
+  if (!t || t->length < sizeof(AcpiMadt)) {
+    return 0;
+  }
+  const uint8_t *p = (const uint8_t *)t + sizeof(AcpiMadt);
+  const uint8_t *end = (const uint8_t *)t + t->length;
+  while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+    if (p[0] == 0 && p[1] >= 8 && g_cpu_count < APIC_MAX_CPUS) {
+      // Processor local APIC: flags bit 0 = enabled.
+      if (*(const uint32_t *)(p + 4) & 1u) {
+        g_cpu_ids[g_cpu_count++] = p[3];
+      }
+    } else if (p[0] == 9 && p[1] >= 16 && g_cpu_count < APIC_MAX_CPUS) {
+      // Processor local x2APIC.
+      if (*(const uint32_t *)(p + 8) & 1u) {
+        g_cpu_ids[g_cpu_count++] = *(const uint32_t *)(p + 4);
+      }
+    } else if (p[0] == 1 && p[1] >= 12 && g_ioapic_count < IOAPIC_MAX) {
+      IoApic *io = &g_ioapics[g_ioapic_count++];
+      io->base = *(const uint32_t *)(p + 4);
+      io->gsi_base = *(const uint32_t *)(p + 8);
+      io->count = ((ioapic_read(io, 0x01) >> 16) & 0xFF) + 1;
+      for (uint32_t i = 0; i < io->count; ++i) {
+        ioapic_write(io, 0x10 + 2 * i, LAPIC_LVT_MASKED);
+      }
+    } else if (p[0] == 2 && p[1] >= 10 &&
+               g_isa_override_count < IOAPIC_MAX_OVERRIDES) {
+      IsaOverride *o = &g_isa_overrides[g_isa_override_count++];
+      o->source = p[3];
+      o->gsi = *(const uint32_t *)(p + 4);
+      o->flags = *(const uint16_t *)(p + 8);
+    }
+    p += p[1];
+  }
+  return g_ioapic_count != 0;
+}
+
+uint32_t apic_cpu_count(void) {
+  return g_cpu_count;
+}
+
+uint32_t apic_cpu_id(uint32_t index) {
+  return index < g_cpu_count ? g_cpu_ids[index] : 0;
+}
+
+static const IoApic *ioapic_for_gsi(uint32_t gsi) {
+  for (uint32_t i = 0; i < g_ioapic_count; ++i) {
+    const IoApic *io = &g_ioapics[i];
+    if (gsi >= io->gsi_base && gsi < io->gsi_base + io->count) {
+      return io;
+    }
+  }
+  return 0;
+}
+
+// ISA IRQs are edge triggered, active high unless the MADT says otherwise.
+static uint32_t ioapic_isa_gsi(uint8_t irq, uint32_t *low_bits) {
+  *low_bits = 0;
+  for (uint32_t i = 0; i < g_isa_override_count; ++i) {
+    const IsaOverride *o = &g_isa_overrides[i];
+    if (o->source != irq) {
+      continue;
+    }
+    if ((o->flags & 0x3) == 0x3) {
+      *low_bits |= 1u << 13; // active low
+    }
+    if (((o->flags >> 2) & 0x3) == 0x3) {
+      *low_bits |= 1u << 15; // level triggered
+    }
+    return o->gsi;
+  }
+  return irq;
+}
+
+int ioapic_route_isa(uint8_t irq, uint8_t vector, uint32_t apic_id) {
+  uint32_t low = 0;
+  uint32_t gsi = ioapic_isa_gsi(irq, &low);
+  const IoApic *io = ioapic_for_gsi(gsi);
+  if (!io) {
+    return 0;
+  }
+  uint32_t reg = 0x10 + 2 * (gsi - io->gsi_base);
+  ioapic_write(io, reg, LAPIC_LVT_MASKED);
+  ioapic_write(io, reg + 1, (apic_id & 0xFF) << 24);
+  ioapic_write(io, reg, low | vector); // fixed, physical, unmasked
+  return 1;
+}
+
+void ioapic_mask_isa(uint8_t irq) {
+  uint32_t low = 0;
+  uint32_t gsi = ioapic_isa_gsi(irq, &low);
+  const IoApic *io = ioapic_for_gsi(gsi);
+  if (io) {
+    ioapic_write(io, 0x10 + 2 * (gsi - io->gsi_base), LAPIC_LVT_MASKED);
+  }
+}
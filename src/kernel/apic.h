@@ -0,0 +1,39 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+
+// Enable the local APIC of the calling CPU and mask the legacy 8259 PICs,
+// so that only APIC-delivered interrupts (MSI, IOAPIC) reach the CPU.
+int lapic_init(void);
+// Enable the local APIC of an application processor in the same xAPIC or
+// x2APIC mode that lapic_init() found on the BSP.
+void lapic_enable(void);
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+#define LAPIC_IPI_INIT 0x00004500u  // INIT, level assert
+#define LAPIC_IPI_STARTUP 0x00004600u // SIPI; OR in the start page number
+// Send an interrupt command to the local APIC `apic_id`: a fixed-delivery
+// vector, or one of the LAPIC_IPI_* messages.
+int lapic_send_ipi(uint32_t apic_id, uint32_t command);
+
+// Periodic LAPIC timer at `hz`, calibrated against the TSC clock (so after
+// time_init()). Its interrupt
+// bounds every halt so that a waiter rechecks its condition at least once
+// per tick even when the event it waits for raises no interrupt.
+int lapic_timer_init(uint32_t hz);
+uint64_t lapic_timer_ticks(void);
+uint32_t lapic_timer_hz(void);
+
+// Read the ACPI MADT: IOAPICs (all redirection entries start masked), ISA
+// interrupt overrides, and the APIC ids of the enabled processors.
+int apic_madt_init(void);
+uint32_t apic_cpu_count(void);
+uint32_t apic_cpu_id(uint32_t index);
+// Route legacy ISA IRQ `irq` (after MADT overrides) to `vector` on the
+// local APIC `apic_id`, and unmask it.
+int ioapic_route_isa(uint8_t irq, uint8_t vector, uint32_t apic_id);
+void ioapic_mask_isa(uint8_t irq);
+
+#endif
@@ -1,5 +1,28 @@
 #include "console.h"
+#include "cpu.h"
 #include "font.h"
+#include "pmm.h"
+#include "time.h"
+
+// Tallest framebuffer the console draws on; rows below it stay blank.
+#define CONSOLE_MAX_HEIGHT 2160
+#define CONSOLE_MAX_BANDS 16
+#define CONSOLE_MAX_COLS (3840 / 8)
+#define CONSOLE_MAX_ROWS (CONSOLE_MAX_HEIGHT / 16)
+// Cells of scrollback, shared out as whole lines of the screen's width.
+#define CONSOLE_HISTORY_CELLS (256 * 1024)
+// Text waiting to be put on screen, and how often a newline may force it
+// out (otherwise it waits for console_flush() or a full buffer).
+#define CONSOLE_OUT_BUFFER 4096
+#define CONSOLE_FLUSH_INTERVAL (16 * KTIME_MS)
+
+typedef struct {
+  uint8_t ch;
+  uint8_t attr;
+} ConsoleCell;
+
+// Eight pixels moved as two 64-bit words.
+typedef uint64_t __attribute__((may_alias)) PixelPair;
 
 static FrameBuffer *g_fb = NULL;
 static uint32_t g_fg = 0xFFFFFFFF;
@@ -7,10 +30,55 @@ static uint32_t g_bg = 0x00000000;
 static uint32_t g_cols = 0;
 static uint32_t g_rows = 0;
 static uint32_t g_cursor_x = 0;
-static uint32_t g_cursor_y = 0;
 static uint32_t g_top_margin_rows = 1;
 static const char *g_header_text = "TestOS";
 
+// Everything is drawn into a back buffer in RAM, one pointer per screen
+// row, and present_locked() copies the dirty rectangle out to the
+// framebuffer, so nothing is ever read back from it. The buffer is carved
+// from pmm blocks ("bands") of whole rows. Scrolling only rotates the row
+// pointers. If the buffer cannot be allocated, the rows point straight at
+// the framebuffer instead.
+static uint32_t *g_row_ptr[CONSOLE_MAX_HEIGHT];
+static uint32_t g_height = 0;
+static int g_shadowed = 0;
+static uint64_t g_bands[CONSOLE_MAX_BANDS];
+static uint32_t g_band_orders[CONSOLE_MAX_BANDS];
+static uint32_t g_band_count = 0;
+static uint32_t g_dirty_x0 = 0;
+static uint32_t g_dirty_y0 = 0;
+static uint32_t g_dirty_x1 = 0;
+static uint32_t g_dirty_y1 = 0;
+// Every font row byte expanded to its eight pixels in fg/bg, so a glyph row
+// is four 64-bit copies instead of eight bit tests.
+static uint32_t g_glyph_rows[256][8] __attribute__((aligned(32)));
+
+// The text is a ring of lines of cells. Lines are numbered from the last
+// clear; line n lives in slot n % g_history_lines, so starting a new line
+// only clears one slot (the oldest) and scrolling moves the view's top
+// line number. g_screen remembers which cell each text position shows,
+// and rendering redraws only the positions whose cell changed.
+static ConsoleCell g_history[CONSOLE_HISTORY_CELLS];
+static ConsoleCell g_screen[CONSOLE_MAX_ROWS * CONSOLE_MAX_COLS];
+static uint32_t g_history_lines = 0;
+static uint64_t g_cur_line = 0; // line holding the cursor
+static uint64_t g_view_back = 0; // lines the view is scrolled back
+// Lines written since the last render; everything is compared when the
+// view has moved.
+static uint64_t g_touched_lo = 0;
+static uint64_t g_touched_hi = 0;
+static int g_view_moved = 0;
+
+// While the framebuffer is lent out (console_suspend()), text still goes
+// into the cells but nothing is drawn on screen; a clear or header change
+// in that time is replayed as a full repaint on console_resume().
+static uint32_t g_suspended = 0;
+static int g_repaint = 0;
+
+static char g_out[CONSOLE_OUT_BUFFER];
+static uint32_t g_out_len = 0;
+static uint64_t g_last_drain = 0;
+
 static inline uint32_t make_pixel(uint8_t r, uint8_t g, uint8_t b,
                                   uint32_t format) {
   // 0: PixelRedGreenBlueReserved8BitPerColor
@@ -21,12 +89,114 @@ static inline uint32_t make_pixel(uint8_t r, uint8_t g, uint8_t b,
   return ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
 }
 
+static void free_bands(void) {
+  for (uint32_t i = 0; i < g_band_count; ++i) {
+    pmm_free_pages(g_bands[i], g_band_orders[i]);
+  }
+  g_band_count = 0;
+}
+
+static int alloc_back_buffer(void) {
+  uint64_t row_bytes = (uint64_t)g_fb->width * 4;
+  uint64_t band_bytes = (uint64_t)PMM_PAGE_SIZE << PMM_MAX_ORDER;
+  uint32_t rows_per_band = (uint32_t)(band_bytes / row_bytes);
+  if (rows_per_band == 0) {
+    return 0;
+  }
+  for (uint32_t y = 0; y < g_height; y += rows_per_band) {
+    uint32_t rows = g_height - y;
+    if (rows > rows_per_band) {
+      rows = rows_per_band;
+    }
+    uint32_t order = 0;
+    while (((uint64_t)PMM_PAGE_SIZE << order) < rows * row_bytes) {
+      order++;
+    }
+    uint64_t band = 0;
+    if (g_band_count < CONSOLE_MAX_BANDS) {
+      band = pmm_alloc_pages(order);
+    }
+    if (!band) {
+      free_bands();
+      return 0;
+    }
+    g_bands[g_band_count] = band;
+    g_band_orders[g_band_count] = order;
+    g_band_count++;
+    for (uint32_t i = 0; i < rows; ++i) {
+      g_row_ptr[y + i] = (uint32_t *)(uintptr_t)(band + i * row_bytes);
+    }
+  }
+  return 1;
+}
+
+static void mark_dirty(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+  if (g_dirty_x0 >= g_dirty_x1) {
+    g_dirty_x0 = x0;
+    g_dirty_y0 = y0;
+    g_dirty_x1 = x1;
+    g_dirty_y1 = y1;
+    return;
+  }
+  if (x0 < g_dirty_x0) {
+    g_dirty_x0 = x0;
+  }
+  if (y0 < g_dirty_y0) {
+    g_dirty_y0 = y0;
+  }
+  if (x1 > g_dirty_x1) {
+    g_dirty_x1 = x1;
+  }
+  if (y1 > g_dirty_y1) {
+    g_dirty_y1 = y1;
+  }
+}
+
+// Copy n pixels with 8-byte non-temporal stores, which the write-combining
+// framebuffer mapping turns into full-line bursts.
+static void stream_pixels(uint32_t *dst, const uint32_t *src, uint32_t n) {
+  if (((uintptr_t)dst & 4) && n > 0) {
+    *dst++ = *src++;
+    n--;
+  }
+  PixelPair *d = (PixelPair *)dst;
+  const PixelPair *s = (const PixelPair *)src;
+  for (uint32_t i = 0; i < n / 2; ++i) {
+    __asm__ __volatile__("movnti %1, %0" : "=m"(d[i]) : "r"(s[i]));
+  }
+  if (n & 1) {
+    dst[n - 1] = src[n - 1];
+  }
+}
+
+static void present_locked(void) {
+  if (g_suspended) {
+    return;
+  }
+  if (g_dirty_x0 >= g_dirty_x1 || g_dirty_y0 >= g_dirty_y1) {
+    g_dirty_x1 = g_dirty_x0;
+    return;
+  }
+  if (g_shadowed) {
+    uint32_t *pixels = (uint32_t *)g_fb->base;
+    uint32_t width = g_dirty_x1 - g_dirty_x0;
+    for (uint32_t y = g_dirty_y0; y < g_dirty_y1; ++y) {
+      stream_pixels(pixels + (uint64_t)y * g_fb->pixels_per_scanline +
+                        g_dirty_x0,
+                    g_row_ptr[y] + g_dirty_x0, width);
+    }
+    __asm__ __volatile__("sfence" : : : "memory");
+  }
+  g_dirty_x0 = 0;
+  g_dirty_x1 = 0;
+}
+
 static void fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h,
                       uint32_t color) {
   if (!g_fb || !g_fb->base) {
     return;
   }
-  if (x >= g_fb->width || y >= g_fb->height) {
+  if (x >= g_fb->width || y >= g_height) {
     return;
   }
   uint32_t max_x = x + w;
@@ -34,73 +204,215 @@ static void fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h,
   if (max_x > g_fb->width) {
     max_x = g_fb->width;
   }
-  if (max_y > g_fb->height) {
-    max_y = g_fb->height;
+  if (max_y > g_height) {
+    max_y = g_height;
   }
-  uint32_t *pixels = (uint32_t *)g_fb->base;
   for (uint32_t py = y; py < max_y; ++py) {
-    uint32_t row = py * g_fb->pixels_per_scanline;
+    uint32_t *row = g_row_ptr[py];
     for (uint32_t px = x; px < max_x; ++px) {
-      pixels[row + px] = color;
+      row[px] = color;
     }
   }
+  mark_dirty(x, y, max_x, max_y);
 }
 
-static void scroll_if_needed(void) {
-  if (g_cursor_y < g_rows) {
-    return;
+static void build_glyph_rows(void) {
+  for (uint32_t bits = 0; bits < 256; ++bits) {
+    for (uint32_t col = 0; col < 8; ++col) {
+      g_glyph_rows[bits][col] = (bits & (0x80u >> col)) ? g_fg : g_bg;
+    }
   }
-  uint32_t *pixels = (uint32_t *)g_fb->base;
-  uint32_t row_pixels = g_fb->pixels_per_scanline;
-  uint32_t char_h = 16;
-  uint32_t scroll_px = char_h;
-  uint32_t total_rows = g_fb->height;
-  uint32_t start_y = g_top_margin_rows * char_h;
+}
 
-  for (uint32_t y = start_y; y < total_rows - scroll_px; ++y) {
-    uint32_t src = (y + scroll_px) * row_pixels;
-    uint32_t dst = y * row_pixels;
-    for (uint32_t x = 0; x < g_fb->width; ++x) {
-      pixels[dst + x] = pixels[src + x];
+// Each font row covers two pixel rows. Clipping is decided once per glyph;
+// only a glyph cut off by the right edge copies pixel by pixel.
+static void draw_glyph(uint32_t px, uint32_t py, unsigned char c) {
+  if (px >= g_fb->width || py >= g_height) {
+    return;
+  }
+  const unsigned char *glyph = font8x8_basic[c & 0x7F];
+  uint32_t w = g_fb->width - px < 8 ? g_fb->width - px : 8;
+  uint32_t h = g_height - py < 16 ? g_height - py : 16;
+  if (w == 8) {
+    for (uint32_t row = 0; row < h; ++row) {
+      const PixelPair *src = (const PixelPair *)g_glyph_rows[glyph[row >> 1]];
+      PixelPair *dst = (PixelPair *)(g_row_ptr[py + row] + px);
+      dst[0] = src[0];
+      dst[1] = src[1];
+      dst[2] = src[2];
+      dst[3] = src[3];
+    }
+  } else {
+    for (uint32_t row = 0; row < h; ++row) {
+      const uint32_t *src = g_glyph_rows[glyph[row >> 1]];
+      uint32_t *dst = g_row_ptr[py + row] + px;
+      for (uint32_t col = 0; col < w; ++col) {
+        dst[col] = src[col];
+      }
     }
   }
-  fill_rect(0, total_rows - scroll_px, g_fb->width, scroll_px, g_bg);
-  if (g_cursor_y > 0) {
-    g_cursor_y--;
+  mark_dirty(px, py, px + w, py + h);
+}
+
+static ConsoleCell *history_line(uint64_t line) {
+  return &g_history[(line % g_history_lines) * g_cols];
+}
+
+static uint64_t oldest_line(void) {
+  return g_cur_line >= g_history_lines ? g_cur_line - g_history_lines + 1
+                                       : 0;
+}
+
+// Top line of the view when it follows the cursor.
+static uint64_t follow_top(void) {
+  return g_cur_line >= g_rows ? g_cur_line - g_rows + 1 : 0;
+}
+
+// How far back the view can go before reaching the oldest line kept.
+static uint64_t max_back(void) {
+  uint64_t top = follow_top();
+  uint64_t oldest = oldest_line();
+  return top > oldest ? top - oldest : 0;
+}
+
+static void touch_line(uint64_t line) {
+  if (g_touched_lo > g_touched_hi) {
+    g_touched_lo = line;
+    g_touched_hi = line;
+  } else if (line < g_touched_lo) {
+    g_touched_lo = line;
+  } else if (line > g_touched_hi) {
+    g_touched_hi = line;
   }
 }
 
-void console_init(FrameBuffer *fb) {
-  g_fb = fb;
-  g_fg = make_pixel(0xE0, 0xE0, 0xE0, fb->pixel_format);
-  g_bg = make_pixel(0x10, 0x10, 0x10, fb->pixel_format);
-  g_cols = fb->width / 8;
-  g_rows = (fb->height / 16) - g_top_margin_rows;
+static void new_line(void) {
   g_cursor_x = 0;
-  g_cursor_y = 0;
-  console_clear();
+  g_cur_line++;
+  ConsoleCell *cells = history_line(g_cur_line);
+  for (uint32_t i = 0; i < g_cols; ++i) {
+    cells[i].ch = ' ';
+    cells[i].attr = 0;
+  }
+  if (g_cur_line >= g_rows) {
+    g_view_moved = 1; // the view follows the cursor down
+  }
+  touch_line(g_cur_line);
 }
 
-void console_clear(void) {
-  if (!g_fb) {
+// Bring the pixels in line with the cells: every text position when the
+// view moved, otherwise only the lines written since the last pass.
+static void render_locked(void) {
+  uint64_t back = g_view_back;
+  if (back > max_back()) {
+    back = max_back();
+  }
+  uint64_t top = follow_top() - back;
+  uint32_t first = 0;
+  uint32_t last = g_rows;
+  if (!g_view_moved) {
+    if (g_touched_lo > g_touched_hi || g_touched_hi < top ||
+        g_touched_lo >= top + g_rows) {
+      g_touched_lo = 1;
+      g_touched_hi = 0;
+      return;
+    }
+    first = g_touched_lo > top ? (uint32_t)(g_touched_lo - top) : 0;
+    last = (uint32_t)(g_touched_hi - top + 1);
+    if (last > g_rows) {
+      last = g_rows;
+    }
+  }
+  static const ConsoleCell blank = {' ', 0};
+  for (uint32_t r = first; r < last; ++r) {
+    uint64_t line = top + r;
+    const ConsoleCell *cells = line <= g_cur_line ? history_line(line) : 0;
+    ConsoleCell *shown = &g_screen[r * g_cols];
+    for (uint32_t c = 0; c < g_cols; ++c) {
+      const ConsoleCell *want = cells ? &cells[c] : &blank;
+      if (shown[c].ch != want->ch || shown[c].attr != want->attr) {
+        shown[c] = *want;
+        draw_glyph(c * 8, (r + g_top_margin_rows) * 16, want->ch);
+      }
+    }
+  }
+  g_view_moved = 0;
+  g_touched_lo = 1;
+  g_touched_hi = 0;
+}
+
+static void update_locked(void) {
+  if (g_suspended) {
     return;
   }
-  fill_rect(0, 0, g_fb->width, g_fb->height, g_bg);
-  g_cursor_x = 0;
-  g_cursor_y = 0;
+  render_locked();
+  present_locked();
+}
+
+static void set_header_locked(const char *text) {
+  g_header_text = text;
+  if (!g_fb || !text) {
+    return;
+  }
+  if (g_suspended) {
+    g_repaint = 1;
+    return;
+  }
+  // Clear header band.
+  fill_rect(0, 0, g_fb->width, 16, g_bg);
+
+  // Compute centered position.
+  uint32_t len = 0;
+  while (text[len]) {
+    len++;
+  }
+  uint32_t total_cols = g_fb->width / 8;
+  uint32_t start_col = 0;
+  if (len < total_cols) {
+    start_col = (total_cols - len) / 2;
+  }
+
+  // Draw header text on the top row without top-margin offset.
+  for (uint32_t i = 0; i < len; ++i) {
+    unsigned char c = (unsigned char)text[i];
+    if (c > 127) {
+      c = '?';
+    }
+    draw_glyph((start_col + i) * 8, 0, c);
+  }
+}
+
+// Blank the whole screen, header included, and redraw the header.
+static void repaint_locked(void) {
+  fill_rect(0, 0, g_fb->width, g_height, g_bg);
+  for (uint32_t i = 0; i < g_rows * g_cols; ++i) {
+    g_screen[i].ch = ' ';
+    g_screen[i].attr = 0;
+  }
   if (g_header_text) {
-    console_set_header(g_header_text);
+    set_header_locked(g_header_text);
   }
 }
 
-void console_putc(char c) {
-  if (!g_fb) {
-    return;
+static void clear_locked(void) {
+  g_cur_line = (uint64_t)-1;
+  g_view_back = 0;
+  new_line();
+  g_view_moved = 0;
+  if (g_suspended) {
+    g_repaint = 1;
+  } else {
+    repaint_locked();
+  }
+}
+
+static void putc_locked(char c) {
+  if (g_view_back != 0) {
+    g_view_back = 0; // new output brings the view back to the cursor
+    g_view_moved = 1;
   }
   if (c == '\n') {
-    g_cursor_x = 0;
-    g_cursor_y++;
-    scroll_if_needed();
+    new_line();
     return;
   }
   if (c == '\r') {
@@ -115,90 +427,245 @@ void console_putc(char c) {
   }
   if (c == '\t') {
     g_cursor_x = (g_cursor_x + 4) & ~3u;
+    if (g_cursor_x >= g_cols) {
+      new_line();
+    }
     return;
   }
-  if (c < 0 || c > 127) {
+  if ((unsigned char)c > 127) {
     c = '?';
   }
 
-  uint32_t px = g_cursor_x * 8;
-  uint32_t py = (g_cursor_y + g_top_margin_rows) * 16;
+  ConsoleCell *cell = &history_line(g_cur_line)[g_cursor_x];
+  cell->ch = (uint8_t)c;
+  cell->attr = 0;
+  touch_line(g_cur_line);
 
-  for (uint32_t row = 0; row < 16; ++row) {
-    const unsigned char *glyph = font8x8_basic[(unsigned char)c];
-    unsigned char bits = glyph[row >> 1];
-    for (uint32_t col = 0; col < 8; ++col) {
-      uint32_t color = (bits & (1u << (7 - col))) ? g_fg : g_bg;
-      uint32_t x = px + col;
-      uint32_t y = py + row;
-      if (x < g_fb->width && y < g_fb->height) {
-        uint32_t *pixels = (uint32_t *)g_fb->base;
-        pixels[y * g_fb->pixels_per_scanline + x] = color;
-      }
+  g_cursor_x++;
+  if (g_cursor_x >= g_cols) {
+    new_line();
+  }
+}
+
+static int ready(void) {
+  return g_fb && g_fb->base && g_cols != 0 && g_rows != 0;
+}
+
+// Feed the buffered text into the cells, then render and present once:
+// however many newlines it held, the view moves once and every visible
+// cell is redrawn at most once.
+static void drain_locked(void) {
+  for (uint32_t i = 0; i < g_out_len; ++i) {
+    putc_locked(g_out[i]);
+  }
+  g_out_len = 0;
+  update_locked();
+  g_last_drain = ktime_now();
+}
+
+static void append_locked(char c) {
+  if (g_out_len == CONSOLE_OUT_BUFFER) {
+    drain_locked();
+  }
+  g_out[g_out_len++] = c;
+}
+
+// A newline shows the text at once unless the screen was updated less than
+// CONSOLE_FLUSH_INTERVAL ago, so bursts of lines are drawn together; the
+// timer tick (console_tick()) shows what is left once the interval is over.
+static void end_write_locked(int newline) {
+  if (newline && ktime_now() - g_last_drain >= CONSOLE_FLUSH_INTERVAL) {
+    drain_locked();
+  }
+}
+
+// Output comes from the BSP, where the threads run, so keeping interrupts
+// off is enough to stop a preempting thread from drawing into a
+// half-finished update.
+void console_init(FrameBuffer *fb) {
+  uint64_t flags = irq_save();
+  free_bands();
+  g_fb = fb;
+  g_fg = make_pixel(0xE0, 0xE0, 0xE0, fb->pixel_format);
+  g_bg = make_pixel(0x10, 0x10, 0x10, fb->pixel_format);
+  build_glyph_rows();
+  g_height = fb->height;
+  if (g_height > CONSOLE_MAX_HEIGHT) {
+    g_height = CONSOLE_MAX_HEIGHT;
+  }
+  g_cols = fb->width / 8;
+  if (g_cols > CONSOLE_MAX_COLS) {
+    g_cols = CONSOLE_MAX_COLS;
+  }
+  g_rows = (g_height / 16) - g_top_margin_rows;
+  g_history_lines = g_cols ? CONSOLE_HISTORY_CELLS / g_cols : 0;
+  g_cursor_x = 0;
+  g_touched_lo = 1;
+  g_touched_hi = 0;
+  g_dirty_x0 = 0;
+  g_dirty_x1 = 0;
+  g_out_len = 0;
+  g_last_drain = 0;
+  g_suspended = 0;
+  g_repaint = 0;
+  g_shadowed = fb->base && alloc_back_buffer();
+  if (!g_shadowed) {
+    for (uint32_t y = 0; y < g_height; ++y) {
+      g_row_ptr[y] =
+          (uint32_t *)fb->base + (uint64_t)y * fb->pixels_per_scanline;
     }
   }
+  if (fb->base && g_cols != 0 && g_rows != 0) {
+    clear_locked();
+    present_locked();
+  }
+  irq_restore(flags);
+}
 
-  g_cursor_x++;
-  if (g_cursor_x >= g_cols) {
-    g_cursor_x = 0;
-    g_cursor_y++;
-    scroll_if_needed();
+void console_clear(void) {
+  if (!ready()) {
+    return;
   }
+  uint64_t flags = irq_save();
+  g_out_len = 0;
+  clear_locked();
+  present_locked();
+  irq_restore(flags);
+}
+
+void console_flush(void) {
+  if (!ready() || g_out_len == 0) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  drain_locked();
+  irq_restore(flags);
+}
+
+void console_tick(void) {
+  if (!ready() || g_out_len == 0) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  if (g_out_len != 0 && ktime_now() - g_last_drain >= CONSOLE_FLUSH_INTERVAL) {
+    drain_locked();
+  }
+  irq_restore(flags);
+}
+
+void console_putc(char c) {
+  if (!ready()) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  append_locked(c);
+  end_write_locked(c == '\n');
+  irq_restore(flags);
 }
 
 void console_write(const char *s) {
-  if (!s) {
+  if (!s || !ready()) {
     return;
   }
+  uint64_t flags = irq_save();
+  int newline = 0;
   while (*s) {
-    console_putc(*s++);
+    newline |= *s == '\n';
+    append_locked(*s++);
   }
+  end_write_locked(newline);
+  irq_restore(flags);
 }
 
 void console_write_line(const char *s) {
-  console_write(s);
-  console_putc('\n');
+  if (!ready()) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  while (s && *s) {
+    append_locked(*s++);
+  }
+  append_locked('\n');
+  end_write_locked(1);
+  irq_restore(flags);
 }
 
-void console_set_header(const char *text) {
-  g_header_text = text;
-  if (!g_fb || !text) {
+void console_scroll_view(int32_t lines) {
+  if (!ready()) {
     return;
   }
-  // Clear header band.
-  fill_rect(0, 0, g_fb->width, 16, g_bg);
+  uint64_t flags = irq_save();
+  drain_locked();
+  uint64_t limit = max_back();
+  if (lines < 0 && (uint64_t)-(int64_t)lines >= g_view_back) {
+    g_view_back = 0;
+  } else if (lines < 0) {
+    g_view_back -= (uint64_t)-(int64_t)lines;
+  } else {
+    g_view_back += (uint64_t)lines;
+  }
+  if (g_view_back > limit) {
+    g_view_back = limit;
+  }
+  g_view_moved = 1;
+  update_locked();
+  irq_restore(flags);
+}
 
-  // Compute centered position.
-  uint32_t len = 0;
-  while (text[len]) {
-    len++;
+uint64_t console_glyph_bench(uint32_t count) {
+  if (!ready()) {
+    return 0;
   }
-  uint32_t total_cols = g_fb->width / 8;
-  uint32_t start_col = 0;
-  if (len < total_cols) {
-    start_col = (total_cols - len) / 2;
+  uint64_t flags = irq_save();
+  drain_locked();
+  uint32_t cells = g_rows * g_cols;
+  uint64_t start = ktime_now();
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t at = i % cells;
+    draw_glyph((at % g_cols) * 8, (at / g_cols + g_top_margin_rows) * 16,
+               (unsigned char)(32 + i % 95));
+  }
+  uint64_t ns = ktime_now() - start;
+  // Forget what the screen shows so the next pass repaints every cell.
+  for (uint32_t i = 0; i < cells; ++i) {
+    g_screen[i].ch = 0xFF;
   }
+  g_view_moved = 1;
+  update_locked();
+  irq_restore(flags);
+  return ns;
+}
 
-  // Draw header text on the top row without top-margin offset.
-  for (uint32_t i = 0; i < len; ++i) {
-    unsigned char c = (unsigned char)text[i];
-    if (c > 127) {
-      c = '?';
-    }
-    const unsigned char *glyph = font8x8_basic[c];
-    uint32_t px = (start_col + i) * 8;
-    uint32_t py = 0;
-    for (uint32_t row = 0; row < 16; ++row) {
-      unsigned char bits = glyph[row >> 1];
-      for (uint32_t col = 0; col < 8; ++col) {
-        uint32_t color = (bits & (1u << (7 - col))) ? g_fg : g_bg;
-        uint32_t x = px + col;
-        uint32_t y = py + row;
-        if (x < g_fb->width && y < g_fb->height) {
-          uint32_t *pixels = (uint32_t *)g_fb->base;
-          pixels[y * g_fb->pixels_per_scanline + x] = color;
-        }
-      }
+void console_set_header(const char *text) {
+  if (!ready()) {
+    g_header_text = text;
+    return;
+  }
+  uint64_t flags = irq_save();
+  drain_locked();
+  set_header_locked(text);
+  present_locked();
+  irq_restore(flags);
+}
+
+void console_suspend(void) {
+  uint64_t flags = irq_save();
+  if (ready()) {
+    drain_locked();
+  }
+  g_suspended++;
+  irq_restore(flags);
+}
+
+void console_resume(void) {
+  uint64_t flags = irq_save();
+  if (g_suspended != 0 && --g_suspended == 0 && ready()) {
+    if (g_repaint) {
+      g_repaint = 0;
+      repaint_locked();
+      g_view_moved = 1;
     }
+    drain_locked();
   }
+  irq_restore(flags);
 }
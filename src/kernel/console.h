@@ -10,5 +10,25 @@ void console_putc(char c);
 void console_write(const char *s);
 void console_write_line(const char *s);
 void console_set_header(const char *text);
+// Move the view `lines` back into the scrollback (negative: toward the
+// newest output). The next output returns it to the cursor.
+void console_scroll_view(int32_t lines);
+// Draw `count` glyphs over the text area of the back buffer, then repaint
+// it. Returns the nanoseconds the drawing took.
+uint64_t console_glyph_bench(uint32_t count);
+// Output is buffered: a newline puts it on screen unless the screen was
+// updated within the last few milliseconds, so a burst of lines scrolls
+// and renders once. console_flush() shows everything written so far; call
+// it before waiting for input or stopping.
+void console_flush(void);
+// Called from the LAPIC timer tick: shows buffered text once the flush
+// interval has passed, so a line written just after a drain still appears
+// while the writer blocks.
+void console_tick(void);
+// Lend the framebuffer to code that draws on it directly: after
+// console_suspend() returns, output (from background threads too) is kept
+// but not drawn until the matching console_resume().
+void console_suspend(void);
+void console_resume(void);
 
 #endif
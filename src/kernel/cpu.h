@@ -0,0 +1,65 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  __asm__ __volatile__("wrmsr"
+                       :
+                       : "c"(msr), "a"((uint32_t)value),
+                         "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *a,
+                         uint32_t *b, uint32_t *c, uint32_t *d) {
+  __asm__ __volatile__("cpuid"
+                       : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                       : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// Spin-wait hint for busy loops.
+static inline void cpu_relax(void) {
+  __asm__ __volatile__("pause" : : : "memory");
+}
+
+static inline void irq_enable(void) {
+  __asm__ __volatile__("sti" : : : "memory");
+}
+
+static inline void irq_disable(void) {
+  __asm__ __volatile__("cli" : : : "memory");
+}
+
+// Disable interrupts and return the previous RFLAGS for irq_restore().
+static inline uint64_t irq_save(void) {
+  uint64_t flags;
+  __asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+  if (flags & (1u << 9)) {
+    irq_enable();
+  }
+}
+
+// Enable interrupts and sleep until the next one. sti only takes effect
+// after the following instruction, so an interrupt that became pending
+// while they were off still wakes the hlt instead of being missed.
+static inline void irq_wait(void) {
+  __asm__ __volatile__("sti; hlt" : : : "memory");
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "dma.h"
+#include "pmm.h"
+#include "spinlock.h"
+
+// Blocks under a page are carved from shared pages in 64-byte units, one
+// bitmap bit per unit.
+#define DMA_UNIT 64
+#define DMA_UNITS_PER_PAGE (PMM_PAGE_SIZE / DMA_UNIT)
+#define DMA_MAX_PAGES 128
+#define DMA_LOW_LIMIT 0x100000000ull
+
+typedef struct {
+  uint64_t addr; // 0 when the descriptor is unused
+  uint64_t used;
+  uint8_t order[DMA_UNITS_PER_PAGE]; // log2(units) at each block start
+  int low;
+} DmaPage;
+
+static DmaPage g_dma_pages[DMA_MAX_PAGES];
+static Spinlock g_dma_lock;
+static volatile uint64_t g_dma_bytes = 0;
+
+static void *sub_page_alloc(uint32_t units, int low) {
+  uint32_t shift = 0;
+  while ((1u << shift) < units) {
+    shift++;
+  }
+  uint64_t mask = units == 64 ? ~0ull : ((1ull << units) - 1);
+  DmaPage *spare = 0;
+  for (uint32_t p = 0; p < DMA_MAX_PAGES; ++p) {
+    DmaPage *d = &g_dma_pages[p];
+    if (!d->addr) {
+      if (!spare) {
+        spare = d;
+      }
+      continue;
+    }
+    if (low && !d->low) {
+      continue;
+    }
+    for (uint32_t i = 0; i < DMA_UNITS_PER_PAGE; i += units) {
+      if (!(d->used & (mask << i))) {
+        d->used |= mask << i;
+        d->order[i] = (uint8_t)shift;
+        return (void *)(uintptr_t)(d->addr + i * DMA_UNIT);
+      }
+    }
+  }
+  if (!spare) {
+    return 0;
+  }
+  uint64_t page = pmm_alloc_pages_below(0, low ? DMA_LOW_LIMIT : ~0ull);
+  if (!page) {
+    return 0;
+  }
+  spare->addr = page;
+  spare->used = mask;
+  spare->order[0] = (uint8_t)shift;
+  spare->low = page + PMM_PAGE_SIZE <= DMA_LOW_LIMIT;
+  return (void *)(uintptr_t)page;
+}
+
+void *dma_alloc(size_t size, size_t align, size_t boundary, uint32_t flags) {
+  if (size == 0 || (align & (align - 1)) || (boundary & (boundary - 1))) {
+    return 0;
+  }
+  uint64_t bytes = DMA_UNIT;
+  while (bytes < size || bytes < align) {
+    bytes <<= 1;
+  }
+  if (boundary && bytes > boundary) {
+    return 0;
+  }
+  int low = (flags & DMA_32BIT) != 0;
+  void *p = 0;
+  if (bytes >= PMM_PAGE_SIZE) {
+    uint32_t order = 0;
+    while (((uint64_t)PMM_PAGE_SIZE << order) < bytes) {
+      order++;
+    }
+    p = (void *)(uintptr_t)pmm_alloc_pages_below(
+        order, low ? DMA_LOW_LIMIT : ~0ull);
+  } else {
+    uint64_t flags_irq = spin_lock_irqsave(&g_dma_lock);
+    p = sub_page_alloc((uint32_t)(bytes / DMA_UNIT), low);
+    spin_unlock_irqrestore(&g_dma_lock, flags_irq);
+  }
+  if (!p) {
+    return 0;
+  }
+  __atomic_fetch_add(&g_dma_bytes, bytes, __ATOMIC_RELAXED);
+  uint8_t *b = (uint8_t *)p;
+  for (uint64_t i = 0; i < bytes; ++i) {
+    b[i] = 0;
+  }
+  return p;
+}
+
+void dma_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  uint64_t addr = (uint64_t)(uintptr_t)ptr;
+  uint64_t page = addr & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+  uint64_t flags = spin_lock_irqsave(&g_dma_lock);
+  for (uint32_t p = 0; p < DMA_MAX_PAGES; ++p) {
+    DmaPage *d = &g_dma_pages[p];
+    if (d->addr != page) {
+      continue;
+    }
+    uint32_t unit = (uint32_t)((addr - page) / DMA_UNIT);
+    uint32_t units = 1u << d->order[unit];
+    uint64_t mask = units == 64 ? ~0ull : ((1ull << units) - 1);
+    d->used &= ~(mask << unit);
+    if (!d->used) {
+      d->addr = 0;
+      pmm_free_page(page);
+    }
+    spin_unlock_irqrestore(&g_dma_lock, flags);
+    __atomic_fetch_sub(&g_dma_bytes, (uint64_t)units * DMA_UNIT,
+                       __ATOMIC_RELAXED);
+    return;
+  }
+  spin_unlock_irqrestore(&g_dma_lock, flags);
+  int order = pmm_block_order(addr);
+  if (order >= 0) {
+    __atomic_fetch_sub(&g_dma_bytes, (uint64_t)PMM_PAGE_SIZE << order,
+                       __ATOMIC_RELAXED);
+    pmm_free_pages(addr, (uint32_t)order);
+  }
+}
+
+uint64_t dma_bytes_in_use(void) {
+  return g_dma_bytes;
+}
@@ -0,0 +1,25 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Place the whole block below 4 GiB, for devices with 32-bit addressing.
+#define DMA_32BIT 0x1
+
+// Zeroed, physically contiguous memory for device queues and tables. The
+// size is rounded up to a power of two (at least 64 bytes) no smaller than
+// `align`, and the block is aligned to that size, so it never crosses a
+// boundary of its own size or more. `boundary` (0 = none) is a power of two
+// the block must not cross; requests larger than it fail. Returns 0 when
+// out of memory.
+void *dma_alloc(size_t size, size_t align, size_t boundary, uint32_t flags);
+void dma_free(void *ptr);
+uint64_t dma_bytes_in_use(void);
+
+// Bus address of a DMA buffer; memory is identity mapped.
+static inline uint64_t dma_addr(const void *p) {
+  return (uint64_t)(uintptr_t)p;
+}
+
+#endif
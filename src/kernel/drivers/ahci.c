@@ -1,6 +1,12 @@
 #include "drivers/ahci.h"
 #include "console.h"
+#include "kprintf.h"
 #include "drivers/pci.h"
+#include "apic.h"
+#include "cpu.h"
+#include "dma.h"
+#include "idt.h"
+#include "time.h"
 #include <stdint.h>
 
 typedef struct {
@@ -54,16 +60,21 @@ typedef volatile struct {
   HbaPort  ports[32];
 } HbaMem;
 
+// PRD entries per command table; 56 keeps each table at 1 KiB.
+#define AHCI_PRDT_ENTRIES 56
+
+typedef struct {
+  uint32_t dba;
+  uint32_t dbau;
+  uint32_t rsv0;
+  uint32_t dbc_i;
+} HbaPrd;
+
 typedef struct {
   uint8_t  cfis[64];
   uint8_t  acmd[16];
   uint8_t  rsv[48];
-  struct {
-    uint32_t dba;
-    uint32_t dbau;
-    uint32_t rsv0;
-    uint32_t dbc_i;
-  } prdt[1];
+  HbaPrd   prdt[AHCI_PRDT_ENTRIES];
 } HbaCmdTable;
 
 typedef struct {
@@ -75,25 +86,72 @@ typedef struct {
   uint32_t rsv[4];
 } HbaCmdHeader;
 
+// One PRD entry covers at most 4 MiB; one command at most 0xFFFF sectors
+// (the 16-bit count, without relying on 0 meaning 65536).
+#define AHCI_PRD_MAX_BYTES (4u * 1024u * 1024u)
+#define AHCI_MAX_CMD_SECTORS 0xFFFFu
+#define AHCI_MAX_SLOTS 32
+
+static const PciDevice *g_ahci_pdev = 0;
 static HbaMem *g_hba = 0;
 static HbaPort *g_port = 0;
 
-static uint8_t g_cmd_list[1024] __attribute__((aligned(1024)));
-static uint8_t g_fis[256] __attribute__((aligned(256)));
-static uint8_t g_cmd_table[256] __attribute__((aligned(128)));
+// Per-port DMA structures: a 1 KiB command list (32 headers), the 256-byte
+// received-FIS area and one 128-byte-aligned command table per slot.
+#define AHCI_CMD_LIST_BYTES 1024
+#define AHCI_FIS_BYTES 256
+static uint8_t *g_cmd_list = 0;
+static uint8_t *g_fis = 0;
+static HbaCmdTable *g_cmd_tables[AHCI_MAX_SLOTS];
+static uint16_t *g_identify = 0;
+
+// Command slot bookkeeping. g_issued holds the slots handed to the HBA; a
+// slot is finished once its bit is clear in both PxCI and PxSACT.
+static BlockRequest *g_slot_req[AHCI_MAX_SLOTS];
+static uint32_t g_issued = 0;
+static uint32_t g_slot_count = 1;
+static int g_ncq = 0;
+
+// HBAs without CAP.S64A only see the low 4 GiB: their DMA structures are
+// placed there, and buffers above it go through g_bounce (allocated only
+// for such HBAs), one command at a time.
+#define AHCI_BOUNCE_BYTES (64u * 1024u)
+static uint8_t *g_bounce = 0;
+static int g_s64a = 0;
+static uint32_t g_bounce_count = 0;
+static uint32_t g_next_slot = 0;
+static uint32_t g_port_bit = 0;   // this port's bit in the HBA's IS register
+static int g_irq_vector = -1;     // MSI vector, -1 when polled
+static uint32_t g_irq_count = 0;
+
+#define AHCI_CMD_TIMEOUT (10 * KTIME_SEC)
 
 static inline uint32_t mmio_read32(uint64_t base, uint32_t offset) {
   volatile uint32_t *addr = (volatile uint32_t *)(uintptr_t)(base + offset);
   return *addr;
 }
 
-static void stop_port(HbaPort *port) {
+// Wait until (reg & mask) == 0. The spec allows 500 ms for PxCMD.CR and
+// PxCMD.FR to clear; command and BSY/DRQ waits use AHCI_CMD_TIMEOUT.
+static int ahci_wait_clear(volatile uint32_t *reg, uint32_t mask,
+                           uint64_t timeout_ns) {
+  uint64_t deadline = ktime_deadline(timeout_ns);
+  while (*reg & mask) {
+    if (ktime_expired(deadline)) {
+      return 0;
+    }
+    cpu_relax();
+  }
+  return 1;
+}
+
+static int stop_port(HbaPort *port) {
   port->cmd &= ~0x01u; // ST
-  while (port->cmd & 0x8000u) {
+  if (!ahci_wait_clear(&port->cmd, 0x8000u, 500 * KTIME_MS)) { // CR
+    return 0;
   }
   port->cmd &= ~0x10u; // FRE
-  while (port->cmd & 0x4000u) {
-  }
+  return ahci_wait_clear(&port->cmd, 0x4000u, 500 * KTIME_MS); // FR
 }
 
 static void start_port(HbaPort *port) {
@@ -101,115 +159,440 @@ static void start_port(HbaPort *port) {
   port->cmd |= 0x01u; // ST
 }
 
-static int ahci_read_lba(uint64_t lba, uint32_t count, void *out) {
-  if (!g_port || !out || count == 0) {
-    return 0;
-  }
-
-  // Wait until port is not busy.
-  while (g_port->tfd & (0x80u | 0x08u)) {
-  }
-
-  g_port->is = 0xFFFFFFFFu;
-
-  HbaCmdHeader *hdr = (HbaCmdHeader *)g_cmd_list;
+// Fill in command header `slot` and the FIS in its command table. The
+// caller has already written `prdtl` PRD entries.
+static void ahci_build_cmd(uint32_t slot, uint8_t command, uint64_t lba,
+                           uint32_t count, uint32_t prdtl, int write) {
+  HbaCmdHeader *hdr = (HbaCmdHeader *)g_cmd_list + slot;
   hdr->flags = 0;
   hdr->flags |= (5u << 0);     // CFL = 5 dwords
-  hdr->flags &= ~(1u << 6);    // W = 0 (read)
-  hdr->prdtl = 1;
+  if (write) {
+    hdr->flags |= (1u << 6);   // W = 1 (host to device)
+  }
+  hdr->prdtl = (uint16_t)prdtl;
   hdr->prdbc = 0;
-  hdr->ctba = (uint32_t)(uintptr_t)g_cmd_table;
-  hdr->ctbau = 0;
+  hdr->ctba = (uint32_t)dma_addr(g_cmd_tables[slot]);
+  hdr->ctbau = (uint32_t)(dma_addr(g_cmd_tables[slot]) >> 32);
 
-  HbaCmdTable *tbl = (HbaCmdTable *)g_cmd_table;
-  for (uint32_t i = 0; i < sizeof(HbaCmdTable); ++i) {
-    ((uint8_t *)tbl)[i] = 0;
+  HbaCmdTable *tbl = g_cmd_tables[slot];
+  for (uint32_t i = 0; i < sizeof(tbl->cfis); ++i) {
+    tbl->cfis[i] = 0;
   }
-  tbl->prdt[0].dba = (uint32_t)(uintptr_t)out;
-  tbl->prdt[0].dbau = 0;
-  tbl->prdt[0].dbc_i = (count * 512u) - 1u;
-
   uint8_t *cfis = tbl->cfis;
   cfis[0] = 0x27; // FIS type: Reg H2D
   cfis[1] = 1 << 7; // C
-  cfis[2] = 0x25; // READ DMA EXT
-  cfis[3] = 0;
+  cfis[2] = command;
   cfis[4] = (uint8_t)(lba & 0xFF);
   cfis[5] = (uint8_t)((lba >> 8) & 0xFF);
   cfis[6] = (uint8_t)((lba >> 16) & 0xFF);
-  cfis[7] = 1 << 6; // device, LBA
   cfis[8] = (uint8_t)((lba >> 24) & 0xFF);
   cfis[9] = (uint8_t)((lba >> 32) & 0xFF);
   cfis[10] = (uint8_t)((lba >> 40) & 0xFF);
-  cfis[11] = 0;
-  cfis[12] = (uint8_t)(count & 0xFF);
-  cfis[13] = (uint8_t)((count >> 8) & 0xFF);
-  cfis[14] = 0;
-  cfis[15] = 0;
+  if (command == 0x60 || command == 0x61) {
+    // FPDMA QUEUED: sector count in FEATURES, tag in COUNT[7:3].
+    cfis[3] = (uint8_t)(count & 0xFF);
+    cfis[11] = (uint8_t)((count >> 8) & 0xFF);
+    cfis[12] = (uint8_t)(slot << 3);
+    cfis[7] = 1 << 6; // LBA
+  } else if (command != 0xEC) {
+    cfis[12] = (uint8_t)(count & 0xFF);
+    cfis[13] = (uint8_t)((count >> 8) & 0xFF);
+    cfis[7] = 1 << 6; // device, LBA
+  }
+}
 
-  g_port->ci = 1u;
+static void ahci_set_prd(HbaPrd *prd, const void *buf, uint32_t bytes) {
+  prd->dba = (uint32_t)dma_addr(buf);
+  prd->dbau = (uint32_t)(dma_addr(buf) >> 32);
+  prd->rsv0 = 0;
+  prd->dbc_i = bytes - 1u;
+}
 
-  // Wait for completion.
-  uint32_t spins = 1000000;
-  while ((g_port->ci & 1u) && spins--) {
+// Task file error or a command that timed out: every outstanding command
+// is lost. Fail them and restart the port so new commands can be issued.
+// A port that will not stop may still be moving data, so the HBA is cut
+// off the bus instead and the port is no longer used.
+static void ahci_recover(void) {
+  uint32_t lost = g_issued;
+  g_issued = 0;
+  if (stop_port(g_port)) {
+    g_port->serr = 0xFFFFFFFFu;
+    g_port->is = 0xFFFFFFFFu;
+    start_port(g_port);
+  } else {
+    pci_set_bus_master(g_ahci_pdev, 0);
+    g_port = 0;
   }
-  if (g_port->is & (1u << 30)) {
+  for (uint32_t slot = 0; slot < g_slot_count; ++slot) {
+    if (lost & (1u << slot)) {
+      BlockRequest *req = g_slot_req[slot];
+      g_slot_req[slot] = 0;
+      if (req) {
+        block_end_io(req, 0);
+      }
+    }
+  }
+}
+
+static uint32_t ahci_poll(void) {
+  if (!g_port || g_issued == 0) {
+    return 0;
+  }
+  uint32_t is = g_port->is;
+  if (is & (1u << 30)) { // TFES
+    ahci_recover();
+    return 0;
+  }
+  // Acknowledge before sampling PxCI, so a command finishing after the
+  // sample raises a fresh interrupt.
+  if (is) {
+    g_port->is = is;
+    g_hba->is = g_port_bit;
+  }
+  uint32_t finished = g_issued & ~(g_port->ci | g_port->sact);
+  if (finished == 0) {
     return 0;
   }
-  return spins != 0;
+  g_issued &= ~finished;
+  uint32_t reaped = 0;
+  for (uint32_t slot = 0; slot < g_slot_count; ++slot) {
+    if (!(finished & (1u << slot))) {
+      continue;
+    }
+    BlockRequest *req = g_slot_req[slot];
+    g_slot_req[slot] = 0;
+    if (req) {
+      block_end_io(req, 1);
+    }
+    reaped++;
+  }
+  return reaped;
 }
 
-static int ahci_identify(uint16_t *out_words) {
-  if (!g_port || !out_words) {
+// AHCI cannot abort a single command: if any of req's are still issued,
+// the port is restarted, which fails every command on it.
+static void ahci_cancel(BlockRequest *req) {
+  ahci_poll();
+  for (uint32_t slot = 0; slot < g_slot_count; ++slot) {
+    if ((g_issued & (1u << slot)) && g_slot_req[slot] == req) {
+      ahci_recover();
+      return;
+    }
+  }
+}
+
+// Poll once while waiting for a command of our own. If nothing finished
+// and the HBA raises interrupts, sleep until the next one.
+static uint32_t ahci_poll_idle(void) {
+  if (g_irq_vector < 0) {
+    uint32_t reaped = ahci_poll();
+    if (reaped == 0) {
+      cpu_relax();
+    }
+    return reaped;
+  }
+  irq_disable();
+  uint32_t reaped = ahci_poll();
+  if (reaped == 0) {
+    irq_wait();
+  } else {
+    irq_enable();
+  }
+  return reaped;
+}
+
+// Claim a free command slot, reaping finished ones while none is free.
+// Without NCQ the drive runs one command at a time, so only one slot is
+// handed out.
+static int ahci_alloc_slot(void) {
+  uint32_t limit = g_ncq ? g_slot_count : 1;
+  uint64_t deadline = ktime_deadline(AHCI_CMD_TIMEOUT);
+  while (!ktime_expired(deadline)) {
+    for (uint32_t n = 0; n < limit; ++n) {
+      uint32_t slot = (g_next_slot + n) % limit;
+      if (!(g_issued & (1u << slot))) {
+        g_next_slot = (slot + 1) % limit;
+        return (int)slot;
+      }
+    }
+    ahci_poll_idle();
+  }
+  return -1;
+}
+
+static void ahci_issue(uint32_t slot, BlockRequest *req) {
+  g_slot_req[slot] = req;
+  g_issued |= 1u << slot;
+  if (g_ncq) {
+    g_port->sact = 1u << slot;
+  }
+  g_port->ci = 1u << slot;
+}
+
+// Slow path for 32-bit-only HBAs: stage the request through g_bounce one
+// command at a time, copying in before writes and out after reads. This is
+// synchronous: submit returns only after every command has finished, and
+// nothing else overlaps with it.
+static int ahci_submit_bounced(BlockRequest *req, const BlockSegment *segs,
+                               uint8_t command, int write) {
+  uint32_t si = 0;
+  uint32_t soff = 0;
+  uint32_t done = 0;
+  while (done < req->count) {
+    uint32_t sectors = req->count - done;
+    if (sectors > AHCI_BOUNCE_BYTES / 512u) {
+      sectors = AHCI_BOUNCE_BYTES / 512u;
+    }
+    uint32_t bytes = sectors * 512u;
+    int slot = ahci_alloc_slot();
+    if (slot < 0) {
+      return 0;
+    }
+    uint32_t csi = si;
+    uint32_t csoff = soff;
+    for (uint32_t n = 0; n < bytes;) {
+      uint32_t len = segs[si].len - soff;
+      if (len > bytes - n) {
+        len = bytes - n;
+      }
+      if (write) {
+        const uint8_t *src = (const uint8_t *)segs[si].buf + soff;
+        for (uint32_t i = 0; i < len; ++i) {
+          g_bounce[n + i] = src[i];
+        }
+      }
+      n += len;
+      soff += len;
+      if (soff == segs[si].len) {
+        si++;
+        soff = 0;
+      }
+    }
+    ahci_set_prd(&g_cmd_tables[slot]->prdt[0], g_bounce, bytes);
+    ahci_build_cmd((uint32_t)slot, command, req->lba + done, sectors, 1,
+                   write);
+    block_start_io(req);
+    ahci_issue((uint32_t)slot, req);
+    g_bounce_count++;
+
+    uint64_t deadline = ktime_deadline(AHCI_CMD_TIMEOUT);
+    while ((g_issued & (1u << slot)) && !ktime_expired(deadline)) {
+      ahci_poll_idle();
+    }
+    if (g_issued & (1u << slot)) {
+      return 0;
+    }
+    if (!write) {
+      si = csi;
+      soff = csoff;
+      for (uint32_t n = 0; n < bytes;) {
+        uint32_t len = segs[si].len - soff;
+        if (len > bytes - n) {
+          len = bytes - n;
+        }
+        uint8_t *dst = (uint8_t *)segs[si].buf + soff;
+        for (uint32_t i = 0; i < len; ++i) {
+          dst[i] = g_bounce[n + i];
+        }
+        n += len;
+        soff += len;
+        if (soff == segs[si].len) {
+          si++;
+          soff = 0;
+        }
+      }
+    }
+    done += sectors;
+  }
+  return 1;
+}
+
+// Queue the request as one or more commands, each in its own slot, with
+// one PRD entry per (piece of a) segment. A command ends when it reaches
+// AHCI_MAX_CMD_SECTORS or runs out of PRD entries; in the latter case a
+// trailing partial sector is handed back to the next command. Completions
+// are picked up by ahci_poll().
+static int ahci_submit(BlockRequest *req) {
+  if (!g_port) {
     return 0;
   }
-  while (g_port->tfd & (0x80u | 0x08u)) {
+  BlockSegment single;
+  const BlockSegment *segs = req->segs;
+  uint32_t seg_count = req->seg_count;
+  if (seg_count == 0) {
+    single.buf = req->buf;
+    single.len = req->count * 512u;
+    segs = &single;
+    seg_count = 1;
+  }
+  uint64_t total = 0;
+  int high = 0;
+  for (uint32_t i = 0; i < seg_count; ++i) {
+    if (((uintptr_t)segs[i].buf & 1u) || (segs[i].len & 1u)) {
+      return 0; // PRDs need word-aligned addresses and even byte counts
+    }
+    if (dma_addr(segs[i].buf) + segs[i].len > 0x100000000ull) {
+      high = 1;
+    }
+    total += segs[i].len;
+  }
+  if (total != (uint64_t)req->count * 512u) {
+    return 0;
   }
-  g_port->is = 0xFFFFFFFFu;
 
-  HbaCmdHeader *hdr = (HbaCmdHeader *)g_cmd_list;
-  hdr->flags = 0;
-  hdr->flags |= (5u << 0);
-  hdr->flags &= ~(1u << 6);
-  hdr->prdtl = 1;
-  hdr->prdbc = 0;
-  hdr->ctba = (uint32_t)(uintptr_t)g_cmd_table;
-  hdr->ctbau = 0;
+  int write = (req->op == BLOCK_OP_WRITE);
+  uint8_t command;
+  if (g_ncq) {
+    command = write ? 0x61 : 0x60; // WRITE/READ FPDMA QUEUED
+  } else {
+    command = write ? 0x35 : 0x25; // WRITE/READ DMA EXT
+  }
+  if (high && !g_s64a) {
+    return ahci_submit_bounced(req, segs, command, write);
+  }
+  uint32_t si = 0;   // segment cursor
+  uint32_t soff = 0; // byte offset within segs[si]
+  uint32_t done = 0;
+  while (done < req->count) {
+    uint32_t want = req->count - done;
+    if (want > AHCI_MAX_CMD_SECTORS) {
+      want = AHCI_MAX_CMD_SECTORS;
+    }
+    uint64_t want_bytes = (uint64_t)want * 512u;
+    int slot = ahci_alloc_slot();
+    if (slot < 0) {
+      return 0;
+    }
+    HbaPrd *prdt = g_cmd_tables[slot]->prdt;
+    uint32_t nprd = 0;
+    uint64_t bytes = 0;
+    while (bytes < want_bytes && nprd < AHCI_PRDT_ENTRIES) {
+      uint64_t len = segs[si].len - soff;
+      if (len > want_bytes - bytes) {
+        len = want_bytes - bytes;
+      }
+      if (len > AHCI_PRD_MAX_BYTES) {
+        len = AHCI_PRD_MAX_BYTES;
+      }
+      ahci_set_prd(&prdt[nprd++], (const uint8_t *)segs[si].buf + soff,
+                   (uint32_t)len);
+      bytes += len;
+      soff += (uint32_t)len;
+      if (soff == segs[si].len) {
+        si++;
+        soff = 0;
+      }
+    }
+    uint32_t excess = (uint32_t)(bytes % 512u);
+    while (excess > 0) {
+      HbaPrd *last = &prdt[nprd - 1];
+      uint32_t len = last->dbc_i + 1u;
+      uint32_t back = len < excess ? len : excess;
+      if (soff == 0) {
+        si--;
+        soff = segs[si].len;
+      }
+      soff -= back;
+      if (back == len) {
+        nprd--;
+      } else {
+        last->dbc_i -= back;
+      }
+      bytes -= back;
+      excess -= back;
+    }
+    uint32_t sectors = (uint32_t)(bytes / 512u);
+    if (sectors == 0) {
+      return 0; // segments too small to fill a sector within one PRDT
+    }
+    ahci_build_cmd((uint32_t)slot, command, req->lba + done, sectors, nprd,
+                   write);
+    block_start_io(req);
+    ahci_issue((uint32_t)slot, req);
+    done += sectors;
+  }
+  return 1;
+}
 
-  HbaCmdTable *tbl = (HbaCmdTable *)g_cmd_table;
-  for (uint32_t i = 0; i < sizeof(HbaCmdTable); ++i) {
-    ((uint8_t *)tbl)[i] = 0;
+// The waiter reaps completions in ahci_poll(); the interrupt only wakes it.
+static void ahci_irq(InterruptFrame *frame, void *ctx) {
+  g_irq_count++;
+}
+
+// Single MSI message for the HBA, with completion and error interrupts
+// enabled on the active port.
+static int ahci_enable_irq(const PciDevice *pdev) {
+  if (g_irq_vector < 0) {
+    g_irq_vector = irq_alloc_vector(ahci_irq, 0);
+    if (g_irq_vector < 0) {
+      return 0;
+    }
+  }
+  if (!pci_msi_enable(pdev, (uint8_t)g_irq_vector, lapic_id())) {
+    irq_free_vector(g_irq_vector);
+    g_irq_vector = -1;
+    return 0;
   }
-  tbl->prdt[0].dba = (uint32_t)(uintptr_t)out_words;
-  tbl->prdt[0].dbau = 0;
-  tbl->prdt[0].dbc_i = (512u) - 1u;
+  g_port->is = 0xFFFFFFFFu;
+  g_hba->is = g_port_bit;
+  // DHRS, PSS, SDBS, DPS, TFES
+  g_port->ie = (1u << 0) | (1u << 1) | (1u << 3) | (1u << 5) | (1u << 30);
+  g_hba->ghc |= 1u << 1; // GHC.IE
+  return 1;
+}
 
-  uint8_t *cfis = tbl->cfis;
-  cfis[0] = 0x27;
-  cfis[1] = 1 << 7;
-  cfis[2] = 0xEC; // IDENTIFY DEVICE
-  cfis[3] = 0;
-  cfis[4] = 0;
-  cfis[5] = 0;
-  cfis[6] = 0;
-  cfis[7] = 0;
-  cfis[8] = 0;
-  cfis[9] = 0;
-  cfis[10] = 0;
-  cfis[11] = 0;
-  cfis[12] = 0;
-  cfis[13] = 0;
-  cfis[14] = 0;
-  cfis[15] = 0;
+static int ahci_identify(uint16_t *out_words) {
+  if (!g_port || !out_words) {
+    return 0;
+  }
+  if (!ahci_wait_clear(&g_port->tfd, 0x80u | 0x08u, AHCI_CMD_TIMEOUT)) {
+    return 0; // BSY/DRQ stuck
+  }
+  g_port->is = 0xFFFFFFFFu;
 
+  ahci_set_prd(&g_cmd_tables[0]->prdt[0], out_words, 512u);
+  ahci_build_cmd(0, 0xEC, 0, 0, 1, 0); // IDENTIFY DEVICE
   g_port->ci = 1u;
-  uint32_t spins = 1000000;
-  while ((g_port->ci & 1u) && spins--) {
-  }
+  int done = ahci_wait_clear(&g_port->ci, 1u, AHCI_CMD_TIMEOUT);
   if (g_port->is & (1u << 30)) {
     return 0;
   }
-  return spins != 0;
+  return done;
+}
+
+// Allocated on first use and kept across re-initialisation. `flags` is
+// DMA_32BIT for HBAs without 64-bit addressing.
+static int ahci_alloc_port_memory(uint32_t flags) {
+  if (!g_cmd_list) {
+    g_cmd_list = (uint8_t *)dma_alloc(AHCI_CMD_LIST_BYTES, 1024, 0, flags);
+  }
+  if (!g_fis) {
+    g_fis = (uint8_t *)dma_alloc(AHCI_FIS_BYTES, 256, 0, flags);
+  }
+  if (!g_identify) {
+    g_identify = (uint16_t *)dma_alloc(512, 2, 0, flags);
+  }
+  if (!g_cmd_list || !g_fis || !g_identify) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < AHCI_MAX_SLOTS; ++i) {
+    if (!g_cmd_tables[i]) {
+      g_cmd_tables[i] =
+          (HbaCmdTable *)dma_alloc(sizeof(HbaCmdTable), 128, 0, flags);
+      if (!g_cmd_tables[i]) {
+        return 0;
+      }
+    }
+  }
+  if (flags & DMA_32BIT) {
+    if (!g_bounce) {
+      g_bounce = (uint8_t *)dma_alloc(AHCI_BOUNCE_BYTES, 4096, 0, flags);
+    }
+    if (!g_bounce) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 int ahci_init(BlockDevice *out_dev) {
@@ -219,87 +602,95 @@ int ahci_init(BlockDevice *out_dev) {
   }
 
   // AHCI: class 0x01, subclass 0x06, progIF 0x01
-  for (uint16_t bus = 0; bus < 256; ++bus) {
-    for (uint8_t dev = 0; dev < 32; ++dev) {
-      for (uint8_t func = 0; func < 8; ++func) {
-        uint32_t vendor_device = pci_read32(bus, dev, func, 0x00);
-        if (vendor_device == 0xFFFFFFFFu) {
-          if (func == 0) {
-            break;
-          }
-          continue;
-        }
-        uint32_t class_reg = pci_read32(bus, dev, func, 0x08);
-        uint8_t class_code = (class_reg >> 24) & 0xFF;
-        uint8_t subclass = (class_reg >> 16) & 0xFF;
-        uint8_t prog_if = (class_reg >> 8) & 0xFF;
-        if (class_code == 0x01 && subclass == 0x06 && prog_if == 0x01) {
-          uint32_t bar5 = pci_read32(bus, dev, func, 0x24);
-          uint64_t abar = (uint64_t)(bar5 & ~0xFu);
-          g_ahci.present = 1;
-          g_ahci.bus = (uint8_t)bus;
-          g_ahci.dev = dev;
-          g_ahci.func = func;
-          g_ahci.abar = abar;
-          g_ahci.hba_cap = mmio_read32(abar, 0x00);
-          g_ahci.hba_ghc = mmio_read32(abar, 0x04);
-          g_ahci.hba_pi = mmio_read32(abar, 0x0C);
-
-          g_hba = (HbaMem *)(uintptr_t)abar;
-
-          uint32_t pi = g_hba->pi;
-          for (int port = 0; port < 32; ++port) {
-            if (!(pi & (1u << port))) {
-              continue;
-            }
-            HbaPort *p = &g_hba->ports[port];
-            uint32_t ssts = p->ssts;
-            uint8_t det = ssts & 0x0F;
-            uint8_t ipm = (ssts >> 8) & 0x0F;
-            if (det != 3 || ipm != 1) {
-              continue;
-            }
-            if (p->sig != 0x00000101) {
-              continue;
-            }
-            stop_port(p);
-            p->clb = (uint32_t)(uintptr_t)g_cmd_list;
-            p->clbu = 0;
-            p->fb = (uint32_t)(uintptr_t)g_fis;
-            p->fbu = 0;
-            for (uint32_t i = 0; i < sizeof(g_cmd_list); ++i) {
-              g_cmd_list[i] = 0;
-            }
-            for (uint32_t i = 0; i < sizeof(g_fis); ++i) {
-              g_fis[i] = 0;
-            }
-            for (uint32_t i = 0; i < sizeof(g_cmd_table); ++i) {
-              g_cmd_table[i] = 0;
-            }
-            start_port(p);
-            g_port = p;
-
-            out_dev->name = "ahci";
-            out_dev->block_size = 512;
-            out_dev->block_count = 0;
-            out_dev->read = ahci_read_lba;
-
-            uint16_t identify[256];
-            if (ahci_identify(identify)) {
-              uint64_t lba_count = ((uint64_t)identify[100]) |
-                                   ((uint64_t)identify[101] << 16) |
-                                   ((uint64_t)identify[102] << 32) |
-                                   ((uint64_t)identify[103] << 48);
-              if (lba_count != 0) {
-                out_dev->block_count = lba_count;
-              }
-            }
-            return 1;
-          }
-          return 0;
+  const PciDevice *pdev = pci_find_class(0x01, 0x06, 0x01, 0);
+  if (!pdev) {
+    return 0;
+  }
+  uint64_t abar = pdev->bar[5];
+  g_ahci.present = 1;
+  g_ahci.bus = pdev->bus;
+  g_ahci.dev = pdev->dev;
+  g_ahci.func = pdev->func;
+  g_ahci.abar = abar;
+  g_ahci.hba_cap = mmio_read32(abar, 0x00);
+  g_ahci.hba_ghc = mmio_read32(abar, 0x04);
+  g_ahci.hba_pi = mmio_read32(abar, 0x0C);
+
+  g_ahci_pdev = pdev;
+  g_hba = (HbaMem *)(uintptr_t)abar;
+  pci_set_bus_master(pdev, 1);
+
+  uint32_t pi = g_hba->pi;
+  for (int port = 0; port < 32; ++port) {
+    if (!(pi & (1u << port))) {
+      continue;
+    }
+    HbaPort *p = &g_hba->ports[port];
+    uint32_t ssts = p->ssts;
+    uint8_t det = ssts & 0x0F;
+    uint8_t ipm = (ssts >> 8) & 0x0F;
+    if (det != 3 || ipm != 1) {
+      continue;
+    }
+    if (p->sig != 0x00000101) {
+      continue;
+    }
+    if (!stop_port(p)) {
+      continue;
+    }
+    g_s64a = (g_ahci.hba_cap >> 31) & 1u;
+    if (!ahci_alloc_port_memory(g_s64a ? 0 : DMA_32BIT)) {
+      return 0;
+    }
+    p->clb = (uint32_t)dma_addr(g_cmd_list);
+    p->clbu = (uint32_t)(dma_addr(g_cmd_list) >> 32);
+    p->fb = (uint32_t)dma_addr(g_fis);
+    p->fbu = (uint32_t)(dma_addr(g_fis) >> 32);
+    for (uint32_t i = 0; i < AHCI_CMD_LIST_BYTES; ++i) {
+      g_cmd_list[i] = 0;
+    }
+    for (uint32_t i = 0; i < AHCI_FIS_BYTES; ++i) {
+      g_fis[i] = 0;
+    }
+    start_port(p);
+    g_port = p;
+    g_port_bit = 1u << port;
+    g_issued = 0;
+    g_next_slot = 0;
+    g_ncq = 0;
+    g_bounce_count = 0;
+    g_slot_count = ((g_ahci.hba_cap >> 8) & 0x1Fu) + 1; // CAP.NCS
+
+    out_dev->name = "ahci";
+    out_dev->block_size = 512;
+    out_dev->block_count = 0;
+    out_dev->max_sectors = AHCI_MAX_CMD_SECTORS;
+    out_dev->submit = ahci_submit;
+    out_dev->poll = ahci_poll;
+    out_dev->cancel = ahci_cancel;
+    out_dev->irq = 0;
+
+    uint16_t *identify = g_identify;
+    if (ahci_identify(identify)) {
+      uint64_t lba_count = ((uint64_t)identify[100]) |
+                           ((uint64_t)identify[101] << 16) |
+                           ((uint64_t)identify[102] << 32) |
+                           ((uint64_t)identify[103] << 48);
+      if (lba_count != 0) {
+        out_dev->block_count = lba_count;
+      }
+      // NCQ needs CAP.SNCQ on the HBA and word 76 bit 8 on the
+      // drive; word 75 holds the drive's queue depth minus one.
+      if ((g_ahci.hba_cap & (1u << 30)) && (identify[76] & (1u << 8))) {
+        uint32_t depth = (identify[75] & 0x1Fu) + 1;
+        if (depth < g_slot_count) {
+          g_slot_count = depth;
         }
+        g_ncq = 1;
       }
     }
+    out_dev->irq = ahci_enable_irq(pdev);
+    return 1;
   }
   return 0;
 }
@@ -309,39 +700,22 @@ void ahci_print_info(void) {
     console_write_line("AHCI: not found");
     return;
   }
-  console_write("AHCI: bus ");
-  console_putc('0' + (g_ahci.bus / 100));
-  console_putc('0' + ((g_ahci.bus / 10) % 10));
-  console_putc('0' + (g_ahci.bus % 10));
-  console_write(" dev ");
-  console_putc('0' + (g_ahci.dev / 10));
-  console_putc('0' + (g_ahci.dev % 10));
-  console_write(" func ");
-  console_putc('0' + (g_ahci.func % 10));
-  console_putc('\n');
-
-  console_write("ABAR=0x");
-  // Print low 32 bits only for now.
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_ahci.abar >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
-  }
-  console_putc('\n');
-
-  console_write("CAP=0x");
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_ahci.hba_cap >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
-  }
-  console_write(" GHC=0x");
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_ahci.hba_ghc >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
-  }
-  console_write(" PI=0x");
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_ahci.hba_pi >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
-  }
-  console_putc('\n');
+  kprintf("AHCI: bus %03u dev %02u func %u\n", g_ahci.bus, g_ahci.dev,
+          g_ahci.func);
+  kprintf("ABAR=0x%08lX\n", g_ahci.abar);
+  kprintf("CAP=0x%08X GHC=0x%08X PI=0x%08X\n", g_ahci.hba_cap,
+          g_ahci.hba_ghc, g_ahci.hba_pi);
+  if (g_s64a) {
+    kprintf("%sslots=%u 64-bit DMA\n", g_ncq ? "NCQ " : "",
+            g_ncq ? g_slot_count : 1);
+  } else {
+    kprintf("%sslots=%u 32-bit DMA, bounced=%u\n", g_ncq ? "NCQ " : "",
+            g_ncq ? g_slot_count : 1, g_bounce_count);
+  }
+
+  if (g_irq_vector < 0) {
+    console_write_line("MSI: off (polled)");
+    return;
+  }
+  kprintf("MSI: v%03d irqs=%u\n", g_irq_vector, g_irq_count);
 }
@@ -1,12 +1,243 @@
 #include "drivers/block.h"
 #include "drivers/ahci.h"
 #include "drivers/nvme.h"
+#include "cpu.h"
+#include "heap.h"
+#include "thread.h"
+#include "time.h"
+
+// How long block_wait() gives a request before cancelling it.
+#define BLOCK_TIMEOUT (10 * KTIME_SEC)
 
 static BlockDevice g_block;
 static int g_has_block = 0;
 
+// Sector buffer cache: entries are hashed by LBA and kept on an LRU list
+// (head = most recently used). Pinned entries are skipped by eviction. The
+// entries, their sector data and the hash buckets (one per two entries)
+// come from the heap and are reallocated by block_cache_set_size().
+// g_cache_lock covers all of it, including across the reads that fill it.
+#define BLOCK_CACHE_NONE (-1)
+
+typedef struct {
+  uint64_t lba;
+  int32_t hash_next;
+  int32_t lru_prev;
+  int32_t lru_next;
+  uint16_t pins;
+  uint8_t valid;
+} BlockCacheEntry;
+
+static BlockCacheEntry *g_cache = 0;
+static uint8_t *g_cache_data = 0;
+static int32_t *g_cache_hash = 0;
+static uint32_t g_cache_buckets = 0; // power of two
+static int32_t g_lru_head = BLOCK_CACHE_NONE;
+static int32_t g_lru_tail = BLOCK_CACHE_NONE;
+static uint32_t g_cache_size = 0;
+static BlockCacheStats g_cache_stats;
+static Mutex g_cache_lock;
+
+static inline uint32_t cache_bucket(uint64_t lba) {
+  return (uint32_t)((lba * 0x9E3779B97F4A7C15ull) >> 32) &
+         (g_cache_buckets - 1);
+}
+
+static inline uint8_t *cache_data(int32_t e) {
+  return g_cache_data + (uint64_t)e * BLOCK_SECTOR_SIZE;
+}
+
+static void copy_sector(void *dst, const void *src) {
+  uint64_t *d = (uint64_t *)dst;
+  const uint64_t *s = (const uint64_t *)src;
+  for (uint32_t i = 0; i < BLOCK_SECTOR_SIZE / 8; ++i) {
+    d[i] = s[i];
+  }
+}
+
+static void lru_unlink(int32_t e) {
+  BlockCacheEntry *ent = &g_cache[e];
+  if (ent->lru_prev != BLOCK_CACHE_NONE) {
+    g_cache[ent->lru_prev].lru_next = ent->lru_next;
+  } else {
+    g_lru_head = ent->lru_next;
+  }
+  if (ent->lru_next != BLOCK_CACHE_NONE) {
+    g_cache[ent->lru_next].lru_prev = ent->lru_prev;
+  } else {
+    g_lru_tail = ent->lru_prev;
+  }
+  ent->lru_prev = BLOCK_CACHE_NONE;
+  ent->lru_next = BLOCK_CACHE_NONE;
+}
+
+static void lru_push_head(int32_t e) {
+  BlockCacheEntry *ent = &g_cache[e];
+  ent->lru_prev = BLOCK_CACHE_NONE;
+  ent->lru_next = g_lru_head;
+  if (g_lru_head != BLOCK_CACHE_NONE) {
+    g_cache[g_lru_head].lru_prev = e;
+  }
+  g_lru_head = e;
+  if (g_lru_tail == BLOCK_CACHE_NONE) {
+    g_lru_tail = e;
+  }
+}
+
+static void lru_touch(int32_t e) {
+  if (g_lru_head == e) {
+    return;
+  }
+  lru_unlink(e);
+  lru_push_head(e);
+}
+
+static void hash_remove(int32_t e) {
+  int32_t *link = &g_cache_hash[cache_bucket(g_cache[e].lba)];
+  while (*link != BLOCK_CACHE_NONE) {
+    if (*link == e) {
+      *link = g_cache[e].hash_next;
+      break;
+    }
+    link = &g_cache[*link].hash_next;
+  }
+  g_cache[e].hash_next = BLOCK_CACHE_NONE;
+}
+
+static void hash_insert(int32_t e) {
+  uint32_t b = cache_bucket(g_cache[e].lba);
+  g_cache[e].hash_next = g_cache_hash[b];
+  g_cache_hash[b] = e;
+}
+
+static int32_t cache_lookup(uint64_t lba) {
+  int32_t e = g_cache_hash[cache_bucket(lba)];
+  while (e != BLOCK_CACHE_NONE) {
+    if (g_cache[e].lba == lba) {
+      return e;
+    }
+    e = g_cache[e].hash_next;
+  }
+  return BLOCK_CACHE_NONE;
+}
+
+// Pick the least recently used unpinned entry and detach it from its old LBA.
+static int32_t cache_victim(void) {
+  int32_t e = g_lru_tail;
+  while (e != BLOCK_CACHE_NONE && g_cache[e].pins != 0) {
+    e = g_cache[e].lru_prev;
+  }
+  if (e == BLOCK_CACHE_NONE) {
+    return BLOCK_CACHE_NONE;
+  }
+  if (g_cache[e].valid) {
+    hash_remove(e);
+    g_cache[e].valid = 0;
+    g_cache_stats.evictions++;
+    g_cache_stats.used--;
+  }
+  return e;
+}
+
+static void cache_fill(int32_t e, uint64_t lba) {
+  g_cache[e].lba = lba;
+  g_cache[e].valid = 1;
+  hash_insert(e);
+  lru_touch(e);
+  g_cache_stats.used++;
+}
+
+// Forget any cached copy of a sector that is about to be overwritten. A
+// pinned copy stays readable by its borrower but is no longer found by
+// lookups and gets recycled once unpinned.
+static void cache_drop(uint64_t lba) {
+  int32_t e = cache_lookup(lba);
+  if (e == BLOCK_CACHE_NONE) {
+    return;
+  }
+  hash_remove(e);
+  g_cache[e].valid = 0;
+  g_cache_stats.used--;
+}
+
+static void cache_reset(void) {
+  g_lru_head = BLOCK_CACHE_NONE;
+  g_lru_tail = BLOCK_CACHE_NONE;
+  for (uint32_t b = 0; b < g_cache_buckets; ++b) {
+    g_cache_hash[b] = BLOCK_CACHE_NONE;
+  }
+  for (uint32_t i = 0; i < g_cache_size; ++i) {
+    g_cache[i].valid = 0;
+    g_cache[i].pins = 0;
+    g_cache[i].hash_next = BLOCK_CACHE_NONE;
+    lru_push_head((int32_t)i);
+  }
+  g_cache_stats.capacity = g_cache_size;
+  g_cache_stats.used = 0;
+  g_cache_stats.pinned = 0;
+}
+
+void block_cache_invalidate(void) {
+  mutex_lock(&g_cache_lock);
+  cache_reset();
+  mutex_unlock(&g_cache_lock);
+}
+
+int block_cache_set_size(uint32_t entries) {
+  if (entries == 0 || entries > BLOCK_CACHE_MAX_ENTRIES) {
+    return 0;
+  }
+  uint32_t buckets = 16;
+  while (buckets < entries / 2) {
+    buckets *= 2;
+  }
+  BlockCacheEntry *cache =
+      (BlockCacheEntry *)kmalloc(entries * sizeof(BlockCacheEntry));
+  uint8_t *data = (uint8_t *)kmalloc((uint64_t)entries * BLOCK_SECTOR_SIZE);
+  int32_t *hash = (int32_t *)kmalloc(buckets * sizeof(int32_t));
+  if (!cache || !data || !hash) {
+    kfree(cache);
+    kfree(data);
+    kfree(hash);
+    return 0;
+  }
+  mutex_lock(&g_cache_lock);
+  if (g_cache_stats.pinned != 0) {
+    mutex_unlock(&g_cache_lock);
+    kfree(cache);
+    kfree(data);
+    kfree(hash);
+    return 0;
+  }
+  kfree(g_cache);
+  kfree(g_cache_data);
+  kfree(g_cache_hash);
+  g_cache = cache;
+  g_cache_data = data;
+  g_cache_hash = hash;
+  g_cache_buckets = buckets;
+  g_cache_size = entries;
+  cache_reset();
+  mutex_unlock(&g_cache_lock);
+  return 1;
+}
+
+void block_cache_get_stats(BlockCacheStats *out) {
+  if (out) {
+    mutex_lock(&g_cache_lock);
+    *out = g_cache_stats;
+    mutex_unlock(&g_cache_lock);
+  }
+}
+
 int block_init(void) {
   g_has_block = 0;
+  mutex_init(&g_cache_lock);
+  if (!g_cache) {
+    block_cache_set_size(BLOCK_CACHE_ENTRIES);
+  } else {
+    block_cache_invalidate();
+  }
   if (nvme_init(&g_block)) {
     g_has_block = 1;
     return 1;
@@ -22,9 +253,226 @@ const BlockDevice *block_get(void) {
   return g_has_block ? &g_block : 0;
 }
 
+static inline uint32_t req_status(const BlockRequest *req) {
+  return __atomic_load_n(&req->status, __ATOMIC_ACQUIRE);
+}
+
+void block_end_io(BlockRequest *req, int ok) {
+  if (!ok) {
+    __atomic_store_n(&req->error, 1, __ATOMIC_RELAXED);
+  }
+  // Drop one reference; a stray extra completion must not wrap the count.
+  uint32_t left = __atomic_load_n(&req->pending, __ATOMIC_RELAXED);
+  do {
+    if (left == 0) {
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&req->pending, &left, left - 1, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  if (left != 1) {
+    return;
+  }
+  uint32_t status = __atomic_load_n(&req->error, __ATOMIC_RELAXED)
+                        ? BLOCK_REQ_ERROR
+                        : BLOCK_REQ_OK;
+  __atomic_store_n(&req->status, status, __ATOMIC_RELEASE);
+  if (req->done) {
+    req->done(req);
+  }
+}
+
+uint32_t block_submit(BlockRequest *reqs, uint32_t n) {
+  uint32_t submitted = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    BlockRequest *req = &reqs[i];
+    req->status = BLOCK_REQ_PENDING;
+    req->error = 0;
+    // Hold one reference of our own so the request cannot complete while
+    // the driver is still splitting it into device commands.
+    req->pending = 1;
+    if (!g_has_block || !g_block.submit || req->count == 0 ||
+        (!req->buf && req->seg_count == 0) || req->op > BLOCK_OP_WRITE) {
+      block_end_io(req, 0);
+      continue;
+    }
+    if (req->op == BLOCK_OP_WRITE) {
+      mutex_lock(&g_cache_lock);
+      for (uint32_t k = 0; k < req->count; ++k) {
+        cache_drop(req->lba + k);
+      }
+      mutex_unlock(&g_cache_lock);
+    }
+    int ok = g_block.submit(req);
+    block_end_io(req, ok);
+    if (ok) {
+      submitted++;
+    }
+  }
+  return submitted;
+}
+
+uint32_t block_poll(void) {
+  if (!g_has_block || !g_block.poll) {
+    return 0;
+  }
+  return g_block.poll();
+}
+
+// Timed out: pull req's commands back from the driver, which ends them
+// with an error. Whatever the driver could not account for is failed here
+// so the request never stays pending.
+static void block_cancel(BlockRequest *req) {
+  if (g_has_block && g_block.cancel) {
+    g_block.cancel(req);
+  }
+  if (req_status(req) == BLOCK_REQ_PENDING) {
+    __atomic_store_n(&req->pending, 1, __ATOMIC_RELAXED);
+    block_end_io(req, 0);
+  }
+}
+
+int block_wait(BlockRequest *req) {
+  uint64_t deadline = ktime_deadline(BLOCK_TIMEOUT);
+  while (req_status(req) == BLOCK_REQ_PENDING && !ktime_expired(deadline)) {
+    if (!g_has_block || !g_block.irq) {
+      if (block_poll() == 0) {
+        cpu_relax();
+      }
+      continue;
+    }
+    // Check for completions with interrupts off so that one arriving
+    // after the check still wakes the halt below.
+    irq_disable();
+    if (block_poll() == 0 && req_status(req) == BLOCK_REQ_PENDING) {
+      irq_wait();
+    } else {
+      irq_enable();
+    }
+  }
+  if (req_status(req) == BLOCK_REQ_PENDING) {
+    block_cancel(req);
+  }
+  return req_status(req) == BLOCK_REQ_OK;
+}
+
+int block_wait_all(BlockRequest *reqs, uint32_t n) {
+  int ok = 1;
+  for (uint32_t i = 0; i < n; ++i) {
+    ok &= block_wait(&reqs[i]);
+  }
+  return ok;
+}
+
+static int block_rw_sync(uint32_t op, uint64_t lba, uint32_t count,
+                         void *buf) {
+  BlockRequest req;
+  req.op = op;
+  req.lba = lba;
+  req.count = count;
+  req.buf = buf;
+  req.segs = 0;
+  req.seg_count = 0;
+  req.done = 0;
+  req.ctx = 0;
+  block_submit(&req, 1);
+  return block_wait(&req);
+}
+
+static int cache_read_locked(uint64_t lba, uint32_t count, uint8_t *dst) {
+  uint32_t max_run = g_block.max_sectors ? g_block.max_sectors : 1;
+  uint32_t i = 0;
+  while (i < count) {
+    int32_t e = cache_lookup(lba + i);
+    if (e != BLOCK_CACHE_NONE) {
+      g_cache_stats.hits++;
+      lru_touch(e);
+      copy_sector(dst + (uint64_t)i * BLOCK_SECTOR_SIZE, cache_data(e));
+      i++;
+      continue;
+    }
+
+    // Read the whole run of uncached sectors straight into the caller's
+    // buffer, then keep a copy of each one.
+    uint32_t run = 1;
+    while (i + run < count && run < max_run &&
+           cache_lookup(lba + i + run) == BLOCK_CACHE_NONE) {
+      run++;
+    }
+    uint8_t *run_dst = dst + (uint64_t)i * BLOCK_SECTOR_SIZE;
+    if (!block_rw_sync(BLOCK_OP_READ, lba + i, run, run_dst)) {
+      return 0;
+    }
+    for (uint32_t k = 0; k < run; ++k) {
+      g_cache_stats.misses++;
+      e = cache_victim();
+      if (e == BLOCK_CACHE_NONE) {
+        continue; // everything pinned
+      }
+      copy_sector(cache_data(e), run_dst + (uint64_t)k * BLOCK_SECTOR_SIZE);
+      cache_fill(e, lba + i + k);
+    }
+    i += run;
+  }
+  return 1;
+}
+
 int block_read(uint64_t lba, uint32_t count, void *out) {
-  if (!g_has_block || !g_block.read) {
+  if (!g_has_block || !out) {
+    return 0;
+  }
+  mutex_lock(&g_cache_lock);
+  int ok = cache_read_locked(lba, count, (uint8_t *)out);
+  mutex_unlock(&g_cache_lock);
+  return ok;
+}
+
+int block_write(uint64_t lba, uint32_t count, const void *in) {
+  if (!g_has_block || !in) {
     return 0;
   }
-  return g_block.read(lba, count, out);
+  return block_rw_sync(BLOCK_OP_WRITE, lba, count, (void *)in);
+}
+
+static const uint8_t *cache_pin_locked(uint64_t lba) {
+  int32_t e = cache_lookup(lba);
+  if (e != BLOCK_CACHE_NONE) {
+    g_cache_stats.hits++;
+    lru_touch(e);
+  } else {
+    g_cache_stats.misses++;
+    e = cache_victim();
+    if (e == BLOCK_CACHE_NONE) {
+      return 0;
+    }
+    if (!block_rw_sync(BLOCK_OP_READ, lba, 1, cache_data(e))) {
+      return 0;
+    }
+    cache_fill(e, lba);
+  }
+  if (g_cache[e].pins++ == 0) {
+    g_cache_stats.pinned++;
+  }
+  return cache_data(e);
+}
+
+const uint8_t *block_pin(uint64_t lba) {
+  if (!g_has_block) {
+    return 0;
+  }
+  mutex_lock(&g_cache_lock);
+  const uint8_t *data = cache_pin_locked(lba);
+  mutex_unlock(&g_cache_lock);
+  return data;
+}
+
+void block_unpin(const uint8_t *data) {
+  mutex_lock(&g_cache_lock);
+  uint64_t end = (uint64_t)g_cache_size * BLOCK_SECTOR_SIZE;
+  if (data && data >= g_cache_data && data < g_cache_data + end) {
+    uint32_t e = (uint32_t)((data - g_cache_data) / BLOCK_SECTOR_SIZE);
+    if (g_cache[e].pins != 0 && --g_cache[e].pins == 0) {
+      g_cache_stats.pinned--;
+    }
+  }
+  mutex_unlock(&g_cache_lock);
 }
@@ -3,15 +3,116 @@
 
 #include <stdint.h>
 
+#define BLOCK_SECTOR_SIZE 512
+
+// Sectors the buffer cache holds after block_init(), and the most
+// block_cache_set_size() accepts (32 MiB of sector data).
+#ifndef BLOCK_CACHE_ENTRIES
+#define BLOCK_CACHE_ENTRIES 256
+#endif
+#define BLOCK_CACHE_MAX_ENTRIES 65536
+
+#define BLOCK_OP_READ 0
+#define BLOCK_OP_WRITE 1
+
+#define BLOCK_REQ_PENDING 0
+#define BLOCK_REQ_OK 1
+#define BLOCK_REQ_ERROR 2
+
+typedef struct BlockRequest BlockRequest;
+typedef void (*BlockCallback)(BlockRequest *req);
+
+// One piece of a scatter-gather buffer.
+typedef struct {
+  void *buf;
+  uint32_t len;
+} BlockSegment;
+
+// One read or write of `count` sectors. The caller fills op/lba/count and
+// either buf or a segment list whose lengths add up to count sectors
+// (seg_count = 0 means buf is used), and optionally done/ctx. status moves
+// from BLOCK_REQ_PENDING to OK or ERROR when the last device command for
+// it finishes, and done (if set) is called at that point. Completions may
+// be reaped on any CPU or in an interrupt, so pending and error change
+// atomically and status is published with release ordering: once a waiter
+// sees it leave PENDING, the data in the buffer is visible too.
+struct BlockRequest {
+  uint32_t op;
+  uint32_t count;
+  uint64_t lba;
+  void *buf;
+  const BlockSegment *segs;
+  uint32_t seg_count;
+  volatile uint32_t status;
+  BlockCallback done;
+  void *ctx;
+  // Owned by the block layer and drivers while the request is in flight.
+  uint32_t pending;
+  uint32_t error;
+};
+
 typedef struct BlockDevice {
   const char *name;
   uint64_t block_size;
   uint64_t block_count;
-  int (*read)(uint64_t lba, uint32_t count, void *out);
+  uint32_t max_sectors; // largest run the cache asks for at once
+  // Start every device command for req, calling block_end_io() once per
+  // command as each finishes (possibly before submit returns). Returns 0
+  // if the request could not be issued at all. Some paths are synchronous
+  // and finish the whole request inside submit: AHCI without 64-bit DMA
+  // bounces buffers above 4 GiB one command at a time.
+  int (*submit)(BlockRequest *req);
+  // Reap finished device commands. Returns how many were reaped.
+  uint32_t (*poll)(void);
+  // Take back every device command still outstanding for req, aborting
+  // them or resetting the controller as needed, and end each one through
+  // block_end_io(). On return the device holds no reference to req and
+  // will not touch its buffers again.
+  void (*cancel)(BlockRequest *req);
+  // Nonzero if every command completion raises an interrupt, so a waiter
+  // can halt between polls instead of spinning.
+  int irq;
 } BlockDevice;
 
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint32_t capacity;
+  uint32_t used;
+  uint32_t pinned;
+} BlockCacheStats;
+
 int block_init(void);
 const BlockDevice *block_get(void);
 int block_read(uint64_t lba, uint32_t count, void *out);
+int block_write(uint64_t lba, uint32_t count, const void *in);
+
+// Asynchronous interface: submit a batch, then poll or wait. Reads issued
+// this way bypass the cache; writes drop any cached copy of their sectors.
+// A request that does not finish in time is cancelled by block_wait(), so
+// once it returns the request and its buffers are the caller's again.
+uint32_t block_submit(BlockRequest *reqs, uint32_t n);
+uint32_t block_poll(void);
+int block_wait(BlockRequest *req);
+int block_wait_all(BlockRequest *reqs, uint32_t n);
+
+// Driver side: account one device command for req (call before issuing it)
+// and report that it finished.
+static inline void block_start_io(BlockRequest *req) {
+  __atomic_add_fetch(&req->pending, 1, __ATOMIC_RELAXED);
+}
+void block_end_io(BlockRequest *req, int ok);
+
+// Borrow the cached copy of one sector without copying it. The buffer stays
+// valid (and is never evicted) until it is handed back with block_unpin().
+const uint8_t *block_pin(uint64_t lba);
+void block_unpin(const uint8_t *data);
+
+// Reallocate the cache for `entries` sectors, dropping what it held. Fails,
+// keeping the old cache, when memory runs out or a sector is pinned.
+int block_cache_set_size(uint32_t entries);
+void block_cache_invalidate(void);
+void block_cache_get_stats(BlockCacheStats *out);
 
 #endif
@@ -1,6 +1,12 @@
 #include "drivers/nvme.h"
 #include "console.h"
+#include "kprintf.h"
 #include "drivers/pci.h"
+#include "apic.h"
+#include "cpu.h"
+#include "dma.h"
+#include "idt.h"
+#include "time.h"
 #include <stdint.h>
 
 typedef struct {
@@ -26,12 +32,32 @@ static inline void mmio_write32(uint64_t base, uint32_t offset, uint32_t v) {
   *addr = v;
 }
 
-static uint8_t g_nvme_admin_queue[4096 * 2] __attribute__((aligned(4096)));
-static uint8_t g_nvme_cq[4096] __attribute__((aligned(4096)));
-static uint8_t g_nvme_sq[4096] __attribute__((aligned(4096)));
-static uint32_t g_nvme_sq_tail = 0;
-static uint32_t g_nvme_cq_head = 0;
-static uint16_t g_nvme_cq_phase = 1;
+// Admin queue: 64 entries, used only for management commands.
+#define NVME_ADMIN_DEPTH 64
+// I/O queue pairs: at most NVME_MAX_IO_QUEUES, each up to one page of SQEs.
+#define NVME_MAX_IO_QUEUES 16
+#define NVME_IO_QUEUE_DEPTH 64
+#define NVME_MAX_CIDS (NVME_MAX_IO_QUEUES * NVME_IO_QUEUE_DEPTH)
+// Admin commands run during init and to abort timed-out I/O; I/O waits for
+// a free slot or PRP page are bounded by how long the controller may take
+// to return one.
+#define NVME_ADMIN_TIMEOUT (2 * KTIME_SEC)
+#define NVME_IO_TIMEOUT (10 * KTIME_SEC)
+// Largest transfer we describe with one command (further capped by MDTS),
+// and the PRP list pages that takes: 511 entries per page plus a chain link.
+#define NVME_MAX_TRANSFER (4u * 1024u * 1024u)
+#define NVME_PRP_LISTS_PER_CMD ((NVME_MAX_TRANSFER / 4096 + 510) / 511)
+#define NVME_PRP_POOL_PAGES 32
+
+// Queues, the identify buffer and PRP list pages are one DMA page each,
+// allocated on first use and kept across re-initialisation.
+static uint8_t *g_nvme_id_buf = 0;
+static uint8_t *g_nvme_cq = 0;
+static uint8_t *g_nvme_sq = 0;
+static uint8_t *g_nvme_io_cq[NVME_MAX_IO_QUEUES];
+static uint8_t *g_nvme_io_sq[NVME_MAX_IO_QUEUES];
+static uint8_t *g_nvme_prp_pool[NVME_PRP_POOL_PAGES];
+static uint32_t g_nvme_prp_used = 0; // bitmap over g_nvme_prp_pool
 
 typedef struct {
   uint32_t cdw0;
@@ -57,222 +83,685 @@ typedef struct {
   uint16_t status;
 } NvmeCpl;
 
+typedef struct {
+  volatile NvmeCmd *sq;
+  volatile NvmeCpl *cq;
+  uint16_t qid;
+  uint16_t depth;
+  uint16_t sq_tail;
+  uint16_t sq_head;
+  uint16_t cq_head;
+  uint16_t cq_phase;
+  uint16_t cid_base; // first CID owned by this queue in g_nvme_cids
+  int vector;        // IDT vector of its MSI-X message, -1 when polled
+  uint32_t irqs;
+} NvmeQueue;
+
+// Per-CID completion table. A CID is busy from submission until its CQE is
+// reaped, at which point its PRP pages are released and the block request
+// it belongs to is told that one more piece finished.
+typedef struct {
+  uint8_t busy;
+  uint8_t prp_count;
+  uint8_t prp_pages[NVME_PRP_LISTS_PER_CMD];
+  BlockRequest *req;
+} NvmeCmdSlot;
+
+static NvmeQueue g_nvme_admin;
+static NvmeQueue g_nvme_io[NVME_MAX_IO_QUEUES];
+static NvmeCmdSlot g_nvme_cids[NVME_MAX_CIDS];
+static uint32_t g_nvme_io_count = 0;
+static uint32_t g_nvme_io_depth = 0;
+static uint32_t g_nvme_io_next = 0;
+
+static const PciDevice *g_nvme_pdev = 0;
+static uint32_t g_nvme_msix = 0; // MSI-X table size, 0 if not in use
 static uint64_t g_nvme_bar = 0;
+static uint32_t g_nvme_dstrd = 4;
 static uint32_t g_nvme_ns = 1;
 static uint64_t g_nvme_blocks = 0;
 static uint16_t g_nvme_cid = 10;
+static uint32_t g_nvme_max_sectors = 4096 / 512;
 
-static int nvme_wait_cq(uint16_t cid) {
-  volatile NvmeCpl *cq = (volatile NvmeCpl *)g_nvme_cq;
-  uint32_t spins = 1000000;
-  while (spins--) {
-    NvmeCpl cpl = cq[g_nvme_cq_head];
-    uint16_t phase = (cpl.status >> 15) & 1;
-    if (phase == g_nvme_cq_phase) {
-      if (cpl.cid == cid) {
-        g_nvme_cq_head = (g_nvme_cq_head + 1) & 0x3F;
-        if (g_nvme_cq_head == 0) {
-          g_nvme_cq_phase ^= 1;
-        }
-        mmio_write32(g_nvme_bar, 0x1000 + 0x04, g_nvme_cq_head);
-        return (cpl.status & 0x1) == 0;
-      }
-      g_nvme_cq_head = (g_nvme_cq_head + 1) & 0x3F;
-      if (g_nvme_cq_head == 0) {
-        g_nvme_cq_phase ^= 1;
-      }
+// Allocate *page on first use, otherwise clear it (CQ phase tags must
+// start at zero).
+static uint8_t *nvme_dma_page(uint8_t **page) {
+  if (!*page) {
+    *page = (uint8_t *)dma_alloc(4096, 4096, 0, 0);
+  } else {
+    for (uint32_t i = 0; i < 4096; ++i) {
+      (*page)[i] = 0;
     }
   }
-  return 0;
+  return *page;
+}
+
+static void nvme_cmd_clear(NvmeCmd *cmd) {
+  for (uint32_t i = 0; i < sizeof(NvmeCmd); ++i) {
+    ((uint8_t *)cmd)[i] = 0;
+  }
+}
+
+static void nvme_queue_setup(NvmeQueue *q, uint16_t qid, void *sq, void *cq,
+                             uint16_t depth, uint16_t cid_base) {
+  q->sq = (volatile NvmeCmd *)sq;
+  q->cq = (volatile NvmeCpl *)cq;
+  q->qid = qid;
+  q->depth = depth;
+  q->sq_tail = 0;
+  q->sq_head = 0;
+  q->cq_head = 0;
+  q->cq_phase = 1;
+  q->cid_base = cid_base;
+  q->vector = -1;
+  q->irqs = 0;
+  for (uint32_t i = 0; i < 4096; ++i) {
+    ((uint8_t *)cq)[i] = 0;
+  }
+}
+
+static inline uint32_t nvme_sq_doorbell(const NvmeQueue *q) {
+  return 0x1000 + (2u * q->qid) * g_nvme_dstrd;
+}
+
+static inline uint32_t nvme_cq_doorbell(const NvmeQueue *q) {
+  return 0x1000 + (2u * q->qid + 1u) * g_nvme_dstrd;
+}
+
+static int nvme_queue_full(const NvmeQueue *q) {
+  return (uint16_t)((q->sq_tail + 1) % q->depth) == q->sq_head;
 }
 
-static int nvme_submit_cmd(NvmeCmd *cmd, uint16_t cid) {
-  volatile NvmeCmd *sq = (volatile NvmeCmd *)g_nvme_sq;
+static void nvme_queue_push(NvmeQueue *q, NvmeCmd *cmd, uint16_t cid) {
   cmd->cdw0 = (cmd->cdw0 & 0xFFFF0000u) | cid;
-  sq[g_nvme_sq_tail] = *cmd;
-  g_nvme_sq_tail = (g_nvme_sq_tail + 1) & 0x3F;
-  mmio_write32(g_nvme_bar, 0x1000 + 0x00, g_nvme_sq_tail);
-  return nvme_wait_cq(cid);
+  q->sq[q->sq_tail] = *cmd;
+  q->sq_tail = (uint16_t)((q->sq_tail + 1) % q->depth);
+  mmio_write32(g_nvme_bar, nvme_sq_doorbell(q), q->sq_tail);
 }
 
-static int nvme_read_lba(uint64_t lba, uint32_t count, void *out) {
-  if (!out || count == 0) {
+static uint64_t *nvme_prp_alloc(NvmeCmdSlot *slot) {
+  if (slot->prp_count >= NVME_PRP_LISTS_PER_CMD) {
     return 0;
   }
-  uint64_t bytes = (uint64_t)count * 512u;
-  if (bytes > 4096) {
-    return 0; // single-PRP only
+  for (uint32_t i = 0; i < NVME_PRP_POOL_PAGES; ++i) {
+    if (g_nvme_prp_pool[i] && !(g_nvme_prp_used & (1u << i))) {
+      g_nvme_prp_used |= 1u << i;
+      slot->prp_pages[slot->prp_count++] = (uint8_t)i;
+      return (uint64_t *)g_nvme_prp_pool[i];
+    }
   }
+  return 0;
+}
 
-  NvmeCmd cmd;
-  for (uint32_t i = 0; i < sizeof(NvmeCmd); ++i) {
-    ((uint8_t *)&cmd)[i] = 0;
+static void nvme_prp_release(NvmeCmdSlot *slot) {
+  for (uint32_t i = 0; i < slot->prp_count; ++i) {
+    g_nvme_prp_used &= ~(1u << slot->prp_pages[i]);
   }
-  cmd.cdw0 = 0x02; // Read
-  cmd.nsid = g_nvme_ns;
-  cmd.prp1 = (uint64_t)(uintptr_t)out;
-  cmd.cdw10 = (uint32_t)(lba & 0xFFFFFFFFu);
-  cmd.cdw11 = (uint32_t)(lba >> 32);
-  cmd.cdw12 = (count - 1) & 0xFFFFu;
+  slot->prp_count = 0;
+}
+
+// Consume every completion the controller has posted on an I/O queue,
+// retiring the matching CIDs. Returns the number of entries reaped.
+static uint32_t nvme_queue_reap(NvmeQueue *q) {
+  uint32_t reaped = 0;
+  for (;;) {
+    NvmeCpl cpl = q->cq[q->cq_head];
+    if (((cpl.status >> 15) & 1) != q->cq_phase) {
+      break;
+    }
+    q->sq_head = cpl.sq_head;
+    q->cq_head = (uint16_t)((q->cq_head + 1) % q->depth);
+    if (q->cq_head == 0) {
+      q->cq_phase ^= 1;
+    }
+    reaped++;
+    if (cpl.cid < NVME_MAX_CIDS && g_nvme_cids[cpl.cid].busy) {
+      NvmeCmdSlot *slot = &g_nvme_cids[cpl.cid];
+      BlockRequest *req = slot->req;
+      nvme_prp_release(slot);
+      slot->req = 0;
+      slot->busy = 0;
+      if (req) {
+        block_end_io(req, ((cpl.status >> 1) & 0x7FFF) == 0);
+      }
+    }
+  }
+  if (reaped) {
+    mmio_write32(g_nvme_bar, nvme_cq_doorbell(q), q->cq_head);
+  }
+  return reaped;
+}
+
+static uint32_t nvme_poll(void) {
+  uint32_t reaped = 0;
+  for (uint32_t i = 0; i < g_nvme_io_count; ++i) {
+    reaped += nvme_queue_reap(&g_nvme_io[i]);
+  }
+  return reaped;
+}
+
+// Poll once while waiting for the controller to hand back a slot or PRP
+// page. If nothing finished and the queues raise interrupts, sleep until
+// the next one.
+static uint32_t nvme_poll_idle(void) {
+  if (g_nvme_io_count == 0 || g_nvme_io[0].vector < 0) {
+    uint32_t reaped = nvme_poll();
+    if (reaped == 0) {
+      cpu_relax();
+    }
+    return reaped;
+  }
+  irq_disable();
+  uint32_t reaped = nvme_poll();
+  if (reaped == 0) {
+    irq_wait();
+  } else {
+    irq_enable();
+  }
+  return reaped;
+}
 
+static int nvme_admin_cmd(NvmeCmd *cmd, uint32_t *result) {
+  NvmeQueue *q = &g_nvme_admin;
   uint16_t cid = g_nvme_cid++;
   if (g_nvme_cid >= 0xFF) {
     g_nvme_cid = 10;
   }
-  return nvme_submit_cmd(&cmd, cid);
+  nvme_queue_push(q, cmd, cid);
+
+  uint64_t deadline = ktime_deadline(NVME_ADMIN_TIMEOUT);
+  while (!ktime_expired(deadline)) {
+    NvmeCpl cpl = q->cq[q->cq_head];
+    if (((cpl.status >> 15) & 1) != q->cq_phase) {
+      cpu_relax();
+      continue;
+    }
+    q->sq_head = cpl.sq_head;
+    q->cq_head = (uint16_t)((q->cq_head + 1) % q->depth);
+    if (q->cq_head == 0) {
+      q->cq_phase ^= 1;
+    }
+    mmio_write32(g_nvme_bar, nvme_cq_doorbell(q), q->cq_head);
+    if (cpl.cid == cid) {
+      if (result) {
+        *result = cpl.cdw0;
+      }
+      return ((cpl.status >> 1) & 0x7FFF) == 0;
+    }
+  }
+  return 0;
 }
 
-int nvme_init(BlockDevice *out_dev) {
-  g_nvme.present = 0;
-  if (!out_dev) {
+// Describe [addr, addr + bytes) for the controller. PRP1 may start anywhere
+// in a page; a second page goes in PRP2 and anything longer needs a PRP
+// list, chained through the last entry of each full list page.
+static int nvme_build_prp(NvmeCmd *cmd, NvmeCmdSlot *slot, uint64_t addr,
+                          uint32_t bytes) {
+  cmd->prp1 = addr;
+  cmd->prp2 = 0;
+  uint32_t first = 4096 - (uint32_t)(addr & 0xFFF);
+  if (bytes <= first) {
+    return 1;
+  }
+  uint64_t page = addr + first;
+  uint32_t pages = (bytes - first + 4095) / 4096;
+  if (pages == 1) {
+    cmd->prp2 = page;
+    return 1;
+  }
+  uint64_t *list = nvme_prp_alloc(slot);
+  if (!list) {
     return 0;
   }
+  cmd->prp2 = dma_addr(list);
+  uint32_t idx = 0;
+  for (uint32_t i = 0; i < pages; ++i) {
+    if (idx == 511 && pages - i > 1) {
+      uint64_t *next = nvme_prp_alloc(slot);
+      if (!next) {
+        nvme_prp_release(slot);
+        return 0;
+      }
+      list[511] = dma_addr(next);
+      list = next;
+      idx = 0;
+    }
+    list[idx++] = page + (uint64_t)i * 4096;
+  }
+  return 1;
+}
 
-  // NVMe: class 0x01, subclass 0x08, progIF 0x02
-  for (uint16_t bus = 0; bus < 256; ++bus) {
-    for (uint8_t dev = 0; dev < 32; ++dev) {
-      for (uint8_t func = 0; func < 8; ++func) {
-        uint32_t vendor_device = pci_read32(bus, dev, func, 0x00);
-        if (vendor_device == 0xFFFFFFFFu) {
-          if (func == 0) {
-            break;
-          }
+// Queue an I/O command for the buffer [buf, buf + bytes) on the next queue
+// with a free slot. Returns the CID it went out on, -1 if no slot became
+// free, or -2 if the PRP pool is exhausted.
+static int nvme_io_submit(NvmeCmd *cmd, uint64_t buf, uint32_t bytes,
+                          BlockRequest *req) {
+  if (g_nvme_io_count == 0) {
+    return -1;
+  }
+  uint64_t deadline = ktime_deadline(NVME_IO_TIMEOUT);
+  while (!ktime_expired(deadline)) {
+    for (uint32_t n = 0; n < g_nvme_io_count; ++n) {
+      NvmeQueue *q = &g_nvme_io[g_nvme_io_next];
+      g_nvme_io_next = (g_nvme_io_next + 1) % g_nvme_io_count;
+      if (nvme_queue_full(q)) {
+        nvme_queue_reap(q);
+        if (nvme_queue_full(q)) {
           continue;
         }
-        uint32_t class_reg = pci_read32(bus, dev, func, 0x08);
-        uint8_t class_code = (class_reg >> 24) & 0xFF;
-        uint8_t subclass = (class_reg >> 16) & 0xFF;
-        uint8_t prog_if = (class_reg >> 8) & 0xFF;
-        if (class_code == 0x01 && subclass == 0x08 && prog_if == 0x02) {
-          uint32_t bar0 = pci_read32(bus, dev, func, 0x10);
-          uint32_t bar1 = pci_read32(bus, dev, func, 0x14);
-          uint64_t base = (uint64_t)(bar0 & ~0xFu);
-          if ((bar0 & 0x06u) == 0x04u) {
-            base |= ((uint64_t)bar1) << 32;
-          }
-          g_nvme.present = 1;
-          g_nvme.bus = (uint8_t)bus;
-          g_nvme.dev = dev;
-          g_nvme.func = func;
-          g_nvme.bar0 = base;
-          g_nvme.cap_lo = mmio_read32(base, 0x00);
-          g_nvme.cap_hi = mmio_read32(base, 0x04);
-          g_nvme.vs = mmio_read32(base, 0x08);
-
-          g_nvme_bar = base;
-
-          // Disable controller
-          uint32_t cc = mmio_read32(base, 0x14);
-          cc &= ~1u;
-          mmio_write32(base, 0x14, cc);
-
-          // Wait for CSTS.RDY=0
-          uint32_t spins = 1000000;
-          while ((mmio_read32(base, 0x1C) & 1u) && spins--) {
-          }
-
-          // Setup admin queues (64 entries)
-          mmio_write32(base, 0x24, (uint32_t)((64 - 1) << 16) | (64 - 1));
-          uint64_t asq = (uint64_t)(uintptr_t)g_nvme_sq;
-          uint64_t acq = (uint64_t)(uintptr_t)g_nvme_cq;
-          mmio_write32(base, 0x28, (uint32_t)asq);
-          mmio_write32(base, 0x2C, (uint32_t)(asq >> 32));
-          mmio_write32(base, 0x30, (uint32_t)acq);
-          mmio_write32(base, 0x34, (uint32_t)(acq >> 32));
-
-          g_nvme_sq_tail = 0;
-          g_nvme_cq_head = 0;
-          g_nvme_cq_phase = 1;
-
-          // Enable controller (CC.EN=1)
-          cc = mmio_read32(base, 0x14);
-          cc |= 1u;
-          mmio_write32(base, 0x14, cc);
-          spins = 1000000;
-          while (!(mmio_read32(base, 0x1C) & 1u) && spins--) {
-          }
-          if (spins == 0) {
-            return 0;
-          }
-
-          // Identify controller (optional)
-          uint8_t *id_buf = g_nvme_admin_queue;
-          NvmeCmd cmd;
-          for (uint32_t i = 0; i < sizeof(NvmeCmd); ++i) {
-            ((uint8_t *)&cmd)[i] = 0;
-          }
-          cmd.cdw0 = 0x06; // Identify
-          cmd.nsid = 0;
-          cmd.prp1 = (uint64_t)(uintptr_t)id_buf;
-          cmd.cdw10 = 1; // CNS=1 (controller)
-          nvme_submit_cmd(&cmd, 1);
-
-          // Identify namespace 1 to get size.
-          for (uint32_t i = 0; i < 4096; ++i) {
-            id_buf[i] = 0;
-          }
-          for (uint32_t i = 0; i < sizeof(NvmeCmd); ++i) {
-            ((uint8_t *)&cmd)[i] = 0;
-          }
-          cmd.cdw0 = 0x06;
-          cmd.nsid = 1;
-          cmd.prp1 = (uint64_t)(uintptr_t)id_buf;
-          cmd.cdw10 = 0; // CNS=0 (namespace)
-          if (nvme_submit_cmd(&cmd, 2)) {
-            uint64_t nsze = ((uint64_t *)id_buf)[0];
-            g_nvme_blocks = nsze;
-          }
-
-          out_dev->name = "nvme";
-          out_dev->block_size = 512;
-          out_dev->block_count = g_nvme_blocks;
-          out_dev->read = nvme_read_lba;
-          return 1;
+      }
+      for (uint16_t i = 0; i < q->depth; ++i) {
+        uint16_t cid = (uint16_t)(q->cid_base + i);
+        NvmeCmdSlot *slot = &g_nvme_cids[cid];
+        if (slot->busy) {
+          continue;
+        }
+        slot->prp_count = 0;
+        if (!nvme_build_prp(cmd, slot, buf, bytes)) {
+          return -2;
         }
+        slot->busy = 1;
+        slot->req = req;
+        block_start_io(req);
+        nvme_queue_push(q, cmd, cid);
+        return cid;
+      }
+    }
+    nvme_poll_idle();
+  }
+  return -1;
+}
+
+// Queue `count` sectors at `lba` to or from one contiguous buffer, split at
+// the transfer limit. The pieces complete independently through
+// nvme_poll().
+static int nvme_submit_range(BlockRequest *req, uint64_t lba, uint8_t *buf,
+                             uint32_t count) {
+  if ((uintptr_t)buf & 3u) {
+    return 0;
+  }
+  uint32_t done = 0;
+  while (done < count) {
+    uint32_t n = count - done;
+    if (n > g_nvme_max_sectors) {
+      n = g_nvme_max_sectors;
+    }
+    NvmeCmd cmd;
+    nvme_cmd_clear(&cmd);
+    cmd.cdw0 = (req->op == BLOCK_OP_WRITE) ? 0x01 : 0x02; // Write / Read
+    cmd.nsid = g_nvme_ns;
+    cmd.cdw10 = (uint32_t)((lba + done) & 0xFFFFFFFFu);
+    cmd.cdw11 = (uint32_t)((lba + done) >> 32);
+    cmd.cdw12 = (n - 1) & 0xFFFFu;
+
+    uint64_t addr = (uint64_t)(uintptr_t)buf + (uint64_t)done * 512u;
+    int cid = nvme_io_submit(&cmd, addr, n * 512u, req);
+    uint64_t deadline = ktime_deadline(NVME_IO_TIMEOUT);
+    while (cid == -2 && !ktime_expired(deadline)) {
+      // Out of PRP list pages: wait for in-flight commands to return some.
+      nvme_poll_idle();
+      cid = nvme_io_submit(&cmd, addr, n * 512u, req);
+    }
+    if (cid < 0) {
+      return 0; // pieces already queued still finish, the request fails
+    }
+    done += n;
+  }
+  return 1;
+}
+
+// A PRP list can only describe page-aligned middle pieces, so segments of
+// a scatter-gather request go out as separate commands instead.
+static int nvme_submit(BlockRequest *req) {
+  if (req->op > BLOCK_OP_WRITE) {
+    return 0;
+  }
+  if (req->seg_count == 0) {
+    return nvme_submit_range(req, req->lba, (uint8_t *)req->buf, req->count);
+  }
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < req->seg_count; ++i) {
+    if (req->segs[i].len % 512u) {
+      return 0;
+    }
+    total += req->segs[i].len;
+  }
+  if (total != (uint64_t)req->count * 512u) {
+    return 0;
+  }
+  uint64_t lba = req->lba;
+  for (uint32_t i = 0; i < req->seg_count; ++i) {
+    uint32_t n = req->segs[i].len / 512u;
+    if (!nvme_submit_range(req, lba, (uint8_t *)req->segs[i].buf, n)) {
+      return 0;
+    }
+    lba += n;
+  }
+  return 1;
+}
+
+// Wait for CSTS.RDY to reach `ready`, for at most CAP.TO (500 ms units).
+static int nvme_wait_ready(uint64_t base, uint32_t ready) {
+  uint64_t timeout = ((g_nvme.cap_lo >> 24) & 0xFF) * 500 * KTIME_MS;
+  if (timeout == 0) {
+    timeout = 500 * KTIME_MS;
+  }
+  uint64_t deadline = ktime_deadline(timeout);
+  while ((mmio_read32(base, 0x1C) & 1u) != ready) {
+    if (ktime_expired(deadline)) {
+      return 0;
+    }
+    cpu_relax();
+  }
+  return 1;
+}
+
+static int nvme_req_busy(const BlockRequest *req) {
+  for (uint32_t i = 0; i < g_nvme_io_count; ++i) {
+    const NvmeQueue *q = &g_nvme_io[i];
+    for (uint16_t k = 0; k < q->depth; ++k) {
+      const NvmeCmdSlot *slot = &g_nvme_cids[q->cid_base + k];
+      if (slot->busy && slot->req == req) {
+        return 1;
       }
     }
   }
   return 0;
 }
 
-void nvme_print_info(void) {
-  if (!g_nvme.present) {
-    console_write_line("NVMe: not found");
-    return;
+// Last resort when the controller will not hand a command back: disable
+// it, which stops all of its DMA (or cut it off the bus if it will not
+// even do that), and fail everything still outstanding. The I/O queues
+// are gone until the next nvme_init().
+static void nvme_disable(void) {
+  uint32_t cc = mmio_read32(g_nvme_bar, 0x14);
+  mmio_write32(g_nvme_bar, 0x14, cc & ~1u);
+  if (!nvme_wait_ready(g_nvme_bar, 0)) {
+    pci_set_bus_master(g_nvme_pdev, 0);
   }
-  console_write("NVMe: bus ");
-  console_putc('0' + (g_nvme.bus / 100));
-  console_putc('0' + ((g_nvme.bus / 10) % 10));
-  console_putc('0' + (g_nvme.bus % 10));
-  console_write(" dev ");
-  console_putc('0' + (g_nvme.dev / 10));
-  console_putc('0' + (g_nvme.dev % 10));
-  console_write(" func ");
-  console_putc('0' + (g_nvme.func % 10));
-  console_putc('\n');
+  g_nvme_io_count = 0;
+  for (uint32_t i = 0; i < NVME_MAX_CIDS; ++i) {
+    NvmeCmdSlot *slot = &g_nvme_cids[i];
+    if (!slot->busy) {
+      continue;
+    }
+    BlockRequest *req = slot->req;
+    nvme_prp_release(slot);
+    slot->req = 0;
+    slot->busy = 0;
+    if (req) {
+      block_end_io(req, 0);
+    }
+  }
+}
 
-  console_write("BAR0=0x");
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_nvme.bar0 >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
+// Abort every command still outstanding for req and reap the aborted
+// completions. A command that is still not back after that means the
+// controller is stuck, and it gets disabled.
+static void nvme_cancel(BlockRequest *req) {
+  for (uint32_t i = 0; i < g_nvme_io_count; ++i) {
+    const NvmeQueue *q = &g_nvme_io[i];
+    for (uint16_t k = 0; k < q->depth; ++k) {
+      uint16_t cid = (uint16_t)(q->cid_base + k);
+      if (!g_nvme_cids[cid].busy || g_nvme_cids[cid].req != req) {
+        continue;
+      }
+      NvmeCmd cmd;
+      nvme_cmd_clear(&cmd);
+      cmd.cdw0 = 0x08; // Abort
+      cmd.cdw10 = ((uint32_t)cid << 16) | q->qid;
+      nvme_admin_cmd(&cmd, 0);
+    }
   }
-  console_putc('\n');
+  uint64_t deadline = ktime_deadline(NVME_ADMIN_TIMEOUT);
+  while (nvme_req_busy(req) && !ktime_expired(deadline)) {
+    if (nvme_poll() == 0) {
+      cpu_relax();
+    }
+  }
+  if (nvme_req_busy(req)) {
+    nvme_disable();
+  }
+}
+
+// Completions are reaped by whoever waits for them; the interrupt only
+// has to wake a CPU halted in block_wait().
+static void nvme_irq(InterruptFrame *frame, void *ctx) {
+  NvmeQueue *q = (NvmeQueue *)ctx;
+  q->irqs++;
+}
 
-  console_write("CAP=0x");
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_nvme.cap_hi >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
+// Give queue q its own MSI-X message, table entry qid (entry 0 belongs to
+// the admin queue). Returns the CDW11 interrupt bits for Create I/O CQ.
+static uint32_t nvme_queue_irq(NvmeQueue *q) {
+  if (q->qid >= g_nvme_msix) {
+    return 0;
+  }
+  int vector = irq_alloc_vector(nvme_irq, q);
+  if (vector < 0) {
+    return 0;
   }
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_nvme.cap_lo >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
+  if (!pci_msix_set(g_nvme_pdev, q->qid, (uint8_t)vector, lapic_id())) {
+    irq_free_vector(vector);
+    return 0;
+  }
+  q->vector = vector;
+  return ((uint32_t)q->qid << 16) | 2; // IV, IEN
+}
+
+// Ask for NVME_MAX_IO_QUEUES queue pairs, then create as many as the
+// controller granted.
+static uint32_t nvme_create_io_queues(uint16_t depth) {
+  NvmeCmd cmd;
+  nvme_cmd_clear(&cmd);
+  cmd.cdw0 = 0x09; // Set Features
+  cmd.cdw10 = 0x07; // Number of Queues
+  cmd.cdw11 = ((uint32_t)(NVME_MAX_IO_QUEUES - 1) << 16) |
+              (NVME_MAX_IO_QUEUES - 1);
+  uint32_t result = 0;
+  if (!nvme_admin_cmd(&cmd, &result)) {
+    return 0;
+  }
+  uint32_t nsq = (result & 0xFFFFu) + 1;
+  uint32_t ncq = (result >> 16) + 1;
+  uint32_t count = nsq < ncq ? nsq : ncq;
+  if (count > NVME_MAX_IO_QUEUES) {
+    count = NVME_MAX_IO_QUEUES;
   }
-  console_putc('\n');
 
-  console_write("VS=0x");
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (g_nvme.vs >> (28 - 4 * i)) & 0xF;
-    console_putc((nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10)));
+  uint32_t created = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint16_t qid = (uint16_t)(i + 1);
+    NvmeQueue *q = &g_nvme_io[i];
+    if (!nvme_dma_page(&g_nvme_io_sq[i]) || !nvme_dma_page(&g_nvme_io_cq[i])) {
+      break;
+    }
+    nvme_queue_setup(q, qid, g_nvme_io_sq[i], g_nvme_io_cq[i], depth,
+                     (uint16_t)(i * NVME_IO_QUEUE_DEPTH));
+
+    nvme_cmd_clear(&cmd);
+    cmd.cdw0 = 0x05; // Create I/O Completion Queue
+    cmd.prp1 = dma_addr(g_nvme_io_cq[i]);
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+    cmd.cdw11 = nvme_queue_irq(q) | 1; // PC
+    if (!nvme_admin_cmd(&cmd, 0)) {
+      break;
+    }
+
+    nvme_cmd_clear(&cmd);
+    cmd.cdw0 = 0x01; // Create I/O Submission Queue
+    cmd.prp1 = dma_addr(g_nvme_io_sq[i]);
+    cmd.cdw10 = ((uint32_t)(depth - 1) << 16) | qid;
+    cmd.cdw11 = ((uint32_t)qid << 16) | 1; // CQID, PC
+    if (!nvme_admin_cmd(&cmd, 0)) {
+      break;
+    }
+    created++;
+  }
+  return created;
+}
+
+int nvme_init(BlockDevice *out_dev) {
+  g_nvme.present = 0;
+  if (!out_dev) {
+    return 0;
+  }
+
+  // NVMe: class 0x01, subclass 0x08, progIF 0x02
+  const PciDevice *pdev = pci_find_class(0x01, 0x08, 0x02, 0);
+  if (!pdev) {
+    return 0;
+  }
+  uint64_t base = pdev->bar[0];
+  g_nvme.present = 1;
+  g_nvme.bus = pdev->bus;
+  g_nvme.dev = pdev->dev;
+  g_nvme.func = pdev->func;
+  g_nvme.bar0 = base;
+  g_nvme.cap_lo = mmio_read32(base, 0x00);
+  g_nvme.cap_hi = mmio_read32(base, 0x04);
+  g_nvme.vs = mmio_read32(base, 0x08);
+
+  g_nvme_pdev = pdev;
+  g_nvme_bar = base;
+  pci_set_bus_master(pdev, 1);
+  g_nvme_dstrd = 4u << (g_nvme.cap_hi & 0xF);
+  g_nvme_io_count = 0;
+  g_nvme_io_next = 0;
+  for (uint32_t i = 0; i < NVME_MAX_CIDS; ++i) {
+    g_nvme_cids[i].busy = 0;
+  }
+
+  // Disable controller
+  uint32_t cc = mmio_read32(base, 0x14);
+  cc &= ~1u;
+  mmio_write32(base, 0x14, cc);
+  if (!nvme_wait_ready(base, 0)) {
+    return 0;
+  }
+
+  // Setup admin queues
+  if (!nvme_dma_page(&g_nvme_sq) || !nvme_dma_page(&g_nvme_cq) ||
+      !nvme_dma_page(&g_nvme_id_buf)) {
+    return 0;
+  }
+  mmio_write32(base, 0x24, (uint32_t)((NVME_ADMIN_DEPTH - 1) << 16) |
+                               (NVME_ADMIN_DEPTH - 1));
+  uint64_t asq = dma_addr(g_nvme_sq);
+  uint64_t acq = dma_addr(g_nvme_cq);
+  mmio_write32(base, 0x28, (uint32_t)asq);
+  mmio_write32(base, 0x2C, (uint32_t)(asq >> 32));
+  mmio_write32(base, 0x30, (uint32_t)acq);
+  mmio_write32(base, 0x34, (uint32_t)(acq >> 32));
+  nvme_queue_setup(&g_nvme_admin, 0, g_nvme_sq, g_nvme_cq,
+                   NVME_ADMIN_DEPTH, 0);
+
+  // Enable controller: IOCQES=16 bytes, IOSQES=64 bytes, 4 KiB pages.
+  cc = mmio_read32(base, 0x14);
+  cc &= ~((0xFu << 20) | (0xFu << 16) | (0xFu << 7));
+  cc |= (4u << 20) | (6u << 16) | 1u;
+  mmio_write32(base, 0x14, cc);
+  if (!nvme_wait_ready(base, 1)) {
+    return 0;
+  }
+
+  // Identify controller for MDTS (in units of CAP.MPSMIN pages,
+  // 0 = no limit).
+  uint8_t *id_buf = g_nvme_id_buf;
+  NvmeCmd cmd;
+  nvme_cmd_clear(&cmd);
+  cmd.cdw0 = 0x06; // Identify
+  cmd.nsid = 0;
+  cmd.prp1 = dma_addr(id_buf);
+  cmd.cdw10 = 1; // CNS=1 (controller)
+  uint64_t max_bytes = NVME_MAX_TRANSFER;
+  if (nvme_admin_cmd(&cmd, 0)) {
+    uint8_t mdts = id_buf[77];
+    uint32_t mpsmin = 4096u << ((g_nvme.cap_hi >> 16) & 0xF);
+    if (mdts != 0 && mdts < 32 &&
+        ((uint64_t)mpsmin << mdts) < max_bytes) {
+      max_bytes = (uint64_t)mpsmin << mdts;
+    }
+  }
+  g_nvme_max_sectors = (uint32_t)(max_bytes / 512);
+  g_nvme_prp_used = 0;
+  for (uint32_t i = 0; i < NVME_PRP_POOL_PAGES; ++i) {
+    if (!g_nvme_prp_pool[i]) {
+      g_nvme_prp_pool[i] = (uint8_t *)dma_alloc(4096, 4096, 0, 0);
+    }
+  }
+
+  // Identify namespace 1 to get size.
+  for (uint32_t i = 0; i < 4096; ++i) {
+    id_buf[i] = 0;
+  }
+  nvme_cmd_clear(&cmd);
+  cmd.cdw0 = 0x06;
+  cmd.nsid = 1;
+  cmd.prp1 = dma_addr(id_buf);
+  cmd.cdw10 = 0; // CNS=0 (namespace)
+  if (nvme_admin_cmd(&cmd, 0)) {
+    uint64_t nsze = ((uint64_t *)id_buf)[0];
+    g_nvme_blocks = nsze;
+  }
+
+  // I/O queue depth is bounded by CAP.MQES (zero-based).
+  uint32_t depth = (g_nvme.cap_lo & 0xFFFFu) + 1;
+  if (depth > NVME_IO_QUEUE_DEPTH) {
+    depth = NVME_IO_QUEUE_DEPTH;
+  }
+  g_nvme_io_depth = depth;
+  g_nvme_msix = 0;
+  if (pci_msix_count(pdev) > 1 && pci_msix_enable(pdev)) {
+    g_nvme_msix = pci_msix_count(pdev);
+  }
+  g_nvme_io_count = nvme_create_io_queues((uint16_t)depth);
+  if (g_nvme_io_count == 0) {
+    return 0;
+  }
+  int irq = 1;
+  for (uint32_t i = 0; i < g_nvme_io_count; ++i) {
+    if (g_nvme_io[i].vector < 0) {
+      irq = 0;
+    }
+  }
+
+  out_dev->name = "nvme";
+  out_dev->block_size = 512;
+  out_dev->block_count = g_nvme_blocks;
+  out_dev->max_sectors = g_nvme_max_sectors;
+  out_dev->submit = nvme_submit;
+  out_dev->poll = nvme_poll;
+  out_dev->cancel = nvme_cancel;
+  out_dev->irq = irq;
+  return 1;
+}
+
+void nvme_print_info(void) {
+  if (!g_nvme.present) {
+    console_write_line("NVMe: not found");
+    return;
+  }
+  kprintf("NVMe: bus %03u dev %02u func %u\n", g_nvme.bus, g_nvme.dev,
+          g_nvme.func);
+  kprintf("BAR0=0x%08lX\n", g_nvme.bar0);
+  kprintf("CAP=0x%08X%08X\n", g_nvme.cap_hi, g_nvme.cap_lo);
+  kprintf("VS=0x%08X\n", g_nvme.vs);
+  kprintf("I/O queues=%u depth=%u max xfer=%uK\n", g_nvme_io_count,
+          g_nvme_io_depth, g_nvme_max_sectors / 2);
+
+  console_write("MSI-X: ");
+  if (g_nvme_msix == 0) {
+    console_write_line("off (polled)");
+    return;
+  }
+  for (uint32_t i = 0; i < g_nvme_io_count; ++i) {
+    const NvmeQueue *q = &g_nvme_io[i];
+    if (q->vector < 0) {
+      kprintf("q%u=poll ", q->qid);
+    } else {
+      kprintf("q%u=v%03d irqs %u ", q->qid, q->vector, q->irqs);
+    }
   }
   console_putc('\n');
 }
@@ -1,4 +1,28 @@
 #include "pci.h"
+#include "acpi.h"
+#include "paging.h"
+
+typedef struct {
+  AcpiSdtHeader header;
+  uint64_t reserved;
+} __attribute__((packed)) AcpiMcfg;
+
+typedef struct {
+  uint64_t base;
+  uint16_t segment;
+  uint8_t start_bus;
+  uint8_t end_bus;
+  uint32_t reserved;
+} __attribute__((packed)) AcpiMcfgEntry;
+
+static PciDevice g_pci_devices[PCI_MAX_DEVICES];
+static uint32_t g_pci_count = 0;
+static uint8_t g_pci_bus_seen[256 / 8];
+
+// ECAM window for segment 0 from the MCFG table (0 = use port I/O).
+static uint64_t g_pci_ecam = 0;
+static uint8_t g_pci_ecam_start = 0;
+static uint8_t g_pci_ecam_end = 0;
 
 static inline void outl(uint16_t port, uint32_t val) {
   __asm__ __volatile__("outl %0, %1" : : "a"(val), "Nd"(port));
@@ -10,49 +34,375 @@ static inline uint32_t inl(uint16_t port) {
   return ret;
 }
 
-uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
-  uint32_t address = (1u << 31) |
-                     ((uint32_t)bus << 16) |
-                     ((uint32_t)dev << 11) |
-                     ((uint32_t)func << 8) |
-                     (offset & 0xFC);
-  outl(0xCF8, address);
+static volatile uint32_t *pci_ecam_reg(uint8_t bus, uint8_t dev, uint8_t func,
+                                       uint16_t offset) {
+  if (g_pci_ecam == 0 || bus < g_pci_ecam_start || bus > g_pci_ecam_end) {
+    return 0;
+  }
+  // The MCFG base is where bus 0 would be, even when decoding starts later.
+  uint64_t addr = g_pci_ecam + ((uint64_t)bus << 20) +
+                  ((uint64_t)(dev & 0x1F) << 15) +
+                  ((uint64_t)(func & 0x07) << 12) + (offset & 0xFFC);
+  return (volatile uint32_t *)(uintptr_t)addr;
+}
+
+static uint32_t pci_legacy_address(uint8_t bus, uint8_t dev, uint8_t func,
+                                   uint16_t offset) {
+  return (1u << 31) |
+         ((uint32_t)bus << 16) |
+         ((uint32_t)dev << 11) |
+         ((uint32_t)func << 8) |
+         (offset & 0xFC);
+}
+
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t func, uint16_t offset) {
+  volatile uint32_t *reg = pci_ecam_reg(bus, dev, func, offset);
+  if (reg) {
+    return *reg;
+  }
+  if (offset >= 0x100) {
+    return 0xFFFFFFFFu;
+  }
+  outl(0xCF8, pci_legacy_address(bus, dev, func, offset));
   return inl(0xCFC);
 }
 
-int pci_find_xhci(PciXhciDevice *out_dev) {
-  if (!out_dev) {
-    return 0;
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t func, uint16_t offset,
+                 uint32_t value) {
+  volatile uint32_t *reg = pci_ecam_reg(bus, dev, func, offset);
+  if (reg) {
+    *reg = value;
+    return;
+  }
+  if (offset >= 0x100) {
+    return;
+  }
+  outl(0xCF8, pci_legacy_address(bus, dev, func, offset));
+  outl(0xCFC, value);
+}
+
+static void pci_init_ecam(void) {
+  g_pci_ecam = 0;
+  const AcpiSdtHeader *t = acpi_find_table("MCFG");
+  if (!t || t->length < sizeof(AcpiMcfg)) {
+    return;
+  }
+  uint32_t count = (t->length - sizeof(AcpiMcfg)) / sizeof(AcpiMcfgEntry);
+  const AcpiMcfgEntry *e =
+      (const AcpiMcfgEntry *)((const uint8_t *)t + sizeof(AcpiMcfg));
+  for (uint32_t i = 0; i < count; ++i) {
+    // Only segment group 0 is addressable through the bus/dev/func API.
+    if (e[i].segment == 0 && e[i].base != 0) {
+      g_pci_ecam = e[i].base;
+      g_pci_ecam_start = e[i].start_bus;
+      g_pci_ecam_end = e[i].end_bus;
+      paging_map_mmio(g_pci_ecam + ((uint64_t)g_pci_ecam_start << 20),
+                      (uint64_t)(g_pci_ecam_end - g_pci_ecam_start + 1) << 20);
+      return;
+    }
+  }
+}
+
+int pci_ecam_enabled(void) {
+  return g_pci_ecam != 0;
+}
+
+// Size a BAR by writing all ones and reading back which address bits stick.
+// Decoding is off meanwhile so the device never answers at the probe value.
+static uint32_t pci_probe_bar(const PciDevice *d, uint16_t offset) {
+  uint32_t orig = pci_read32(d->bus, d->dev, d->func, offset);
+  pci_write32(d->bus, d->dev, d->func, offset, 0xFFFFFFFFu);
+  uint32_t mask = pci_read32(d->bus, d->dev, d->func, offset);
+  pci_write32(d->bus, d->dev, d->func, offset, orig);
+  return mask;
+}
+
+// Map a memory BAR uncached, except for the part the framebuffer lives in,
+// which kernel_main() has already mapped write-combining.
+static void pci_map_bar(uint64_t base, uint64_t size) {
+  uint64_t end = base + size;
+  uint64_t fb = (uint64_t)(uintptr_t)g_boot_info.fb.base & ~0xFFFull;
+  uint64_t fb_end = ((uint64_t)(uintptr_t)g_boot_info.fb.base +
+                     g_boot_info.fb.size + 0xFFF) & ~0xFFFull;
+  if (fb == 0 || fb >= end || fb_end <= base) {
+    paging_map_mmio(base, size);
+    return;
+  }
+  if (fb > base) {
+    paging_map_mmio(base, fb - base);
+  }
+  if (fb_end < end) {
+    paging_map_mmio(fb_end, end - fb_end);
+  }
+}
+
+static void pci_read_bars(PciDevice *d) {
+  uint32_t bar_count = ((d->header_type & 0x7F) == 0x01) ? 2 : 6;
+  if ((d->header_type & 0x7F) > 0x01) {
+    bar_count = 0;
+  }
+  // Write back only the Command half: Status bits are write-one-to-clear.
+  uint32_t cmd = pci_read32(d->bus, d->dev, d->func, 0x04) & 0xFFFF;
+  pci_write32(d->bus, d->dev, d->func, 0x04, cmd & ~0x3u);
+  for (uint32_t i = 0; i < bar_count; ++i) {
+    uint16_t offset = (uint16_t)(0x10 + i * 4);
+    uint32_t bar = pci_read32(d->bus, d->dev, d->func, offset);
+    if (bar & 0x01u) {
+      d->bar[i] = bar & ~0x3u;
+      d->bar_flags[i] = PCI_BAR_IO;
+      d->bar_size[i] = (~(pci_probe_bar(d, offset) & ~0x3u) + 1) & 0xFFFFu;
+      continue;
+    }
+    d->bar[i] = bar & ~0xFu;
+    uint64_t mask = pci_probe_bar(d, offset) & ~0xFu;
+    if (bar & 0x08u) {
+      d->bar_flags[i] |= PCI_BAR_PREFETCH;
+    }
+    uint32_t slot = i;
+    if ((bar & 0x06u) == 0x04u && i + 1 < bar_count) {
+      uint32_t hi = pci_read32(d->bus, d->dev, d->func, (uint16_t)(offset + 4));
+      d->bar[i] |= (uint64_t)hi << 32;
+      d->bar_flags[i] |= PCI_BAR_64;
+      mask |= (uint64_t)pci_probe_bar(d, (uint16_t)(offset + 4)) << 32;
+      i++;
+    } else if (mask != 0) {
+      mask |= 0xFFFFFFFF00000000ull;
+    }
+    d->bar_size[slot] = mask ? ~mask + 1 : 0;
+  }
+  pci_write32(d->bus, d->dev, d->func, 0x04, cmd);
+  // Device windows must not be cached, wherever firmware placed them.
+  for (uint32_t i = 0; i < bar_count; ++i) {
+    if ((d->bar_flags[i] & PCI_BAR_IO) || d->bar[i] == 0 ||
+        d->bar_size[i] == 0) {
+      continue;
+    }
+    pci_map_bar(d->bar[i], d->bar_size[i]);
+  }
+}
+
+static void pci_read_caps(PciDevice *d) {
+  uint32_t status = pci_read32(d->bus, d->dev, d->func, 0x04) >> 16;
+  if (!(status & 0x10u)) {
+    return;
+  }
+  uint8_t ptr = (uint8_t)(pci_read32(d->bus, d->dev, d->func, 0x34) & 0xFC);
+  // The list lives in the first 256 bytes; the bound stops malformed loops.
+  for (uint32_t guard = 0; ptr >= 0x40 && guard < 48; ++guard) {
+    uint32_t hdr = pci_read32(d->bus, d->dev, d->func, ptr);
+    if (d->cap_count < PCI_MAX_CAPS) {
+      d->cap_id[d->cap_count] = (uint8_t)(hdr & 0xFF);
+      d->cap_offset[d->cap_count] = ptr;
+      d->cap_count++;
+    }
+    ptr = (uint8_t)((hdr >> 8) & 0xFC);
+  }
+}
+
+static void pci_scan_bus(uint8_t bus);
+
+static void pci_scan_function(uint8_t bus, uint8_t dev, uint8_t func,
+                              uint32_t vendor_device) {
+  uint32_t class_reg = pci_read32(bus, dev, func, 0x08);
+  uint8_t header_type = (uint8_t)(pci_read32(bus, dev, func, 0x0C) >> 16);
+  if (g_pci_count < PCI_MAX_DEVICES) {
+    PciDevice *d = &g_pci_devices[g_pci_count++];
+    for (uint32_t i = 0; i < sizeof(*d); ++i) {
+      ((uint8_t *)d)[i] = 0;
+    }
+    d->bus = bus;
+    d->dev = dev;
+    d->func = func;
+    d->header_type = header_type;
+    d->vendor_id = (uint16_t)(vendor_device & 0xFFFF);
+    d->device_id = (uint16_t)(vendor_device >> 16);
+    d->class_code = (class_reg >> 24) & 0xFF;
+    d->subclass = (class_reg >> 16) & 0xFF;
+    d->prog_if = (class_reg >> 8) & 0xFF;
+    d->revision = class_reg & 0xFF;
+    pci_read_bars(d);
+    pci_read_caps(d);
+  }
+
+  // PCI-to-PCI bridge: continue on its secondary bus.
+  if ((header_type & 0x7F) == 0x01) {
+    uint8_t secondary = (uint8_t)(pci_read32(bus, dev, func, 0x18) >> 8);
+    if (secondary != 0) {
+      pci_scan_bus(secondary);
+    }
+  }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+  if (g_pci_bus_seen[bus / 8] & (1u << (bus % 8))) {
+    return;
   }
-  for (uint16_t bus = 0; bus < 256; ++bus) {
-    for (uint8_t dev = 0; dev < 32; ++dev) {
-      for (uint8_t func = 0; func < 8; ++func) {
-        uint32_t vendor_device = pci_read32(bus, dev, func, 0x00);
-        if (vendor_device == 0xFFFFFFFFu) {
-          if (func == 0) {
-            break;
-          }
-          continue;
-        }
-        uint32_t class_reg = pci_read32(bus, dev, func, 0x08);
-        uint8_t class_code = (class_reg >> 24) & 0xFF;
-        uint8_t subclass = (class_reg >> 16) & 0xFF;
-        uint8_t prog_if = (class_reg >> 8) & 0xFF;
-        if (class_code == 0x0C && subclass == 0x03 && prog_if == 0x30) {
-          uint32_t bar0 = pci_read32(bus, dev, func, 0x10);
-          uint32_t bar1 = pci_read32(bus, dev, func, 0x14);
-          uint64_t base = (uint64_t)(bar0 & ~0xFu);
-          if ((bar0 & 0x06u) == 0x04u) {
-            base |= ((uint64_t)bar1) << 32;
-          }
-          out_dev->bus = (uint8_t)bus;
-          out_dev->dev = dev;
-          out_dev->func = func;
-          out_dev->bar0 = base;
-          return 1;
-        }
+  g_pci_bus_seen[bus / 8] |= (uint8_t)(1u << (bus % 8));
+  for (uint8_t dev = 0; dev < 32; ++dev) {
+    uint32_t vendor_device = pci_read32(bus, dev, 0, 0x00);
+    if ((vendor_device & 0xFFFF) == 0xFFFF) {
+      continue;
+    }
+    pci_scan_function(bus, dev, 0, vendor_device);
+    uint8_t header_type = (uint8_t)(pci_read32(bus, dev, 0, 0x0C) >> 16);
+    if (!(header_type & 0x80)) {
+      continue;
+    }
+    for (uint8_t func = 1; func < 8; ++func) {
+      vendor_device = pci_read32(bus, dev, func, 0x00);
+      if ((vendor_device & 0xFFFF) != 0xFFFF) {
+        pci_scan_function(bus, dev, func, vendor_device);
+      }
+    }
+  }
+}
+
+int pci_enumerate(void) {
+  pci_init_ecam();
+  g_pci_count = 0;
+  for (uint32_t i = 0; i < sizeof(g_pci_bus_seen); ++i) {
+    g_pci_bus_seen[i] = 0;
+  }
+  // A multi-function host bridge at 00:00.x means one root bus per function.
+  uint8_t header_type = (uint8_t)(pci_read32(0, 0, 0, 0x0C) >> 16);
+  if (header_type & 0x80) {
+    for (uint8_t func = 0; func < 8; ++func) {
+      if ((pci_read32(0, 0, func, 0x00) & 0xFFFF) != 0xFFFF) {
+        pci_scan_bus(func);
+      }
+    }
+  } else {
+    pci_scan_bus(0);
+  }
+  return (int)g_pci_count;
+}
+
+uint32_t pci_device_count(void) {
+  return g_pci_count;
+}
+
+const PciDevice *pci_device_at(uint32_t index) {
+  return index < g_pci_count ? &g_pci_devices[index] : 0;
+}
+
+const PciDevice *pci_find_class(uint8_t class_code, uint8_t subclass,
+                                uint8_t prog_if, uint32_t index) {
+  for (uint32_t i = 0; i < g_pci_count; ++i) {
+    const PciDevice *d = &g_pci_devices[i];
+    if (d->class_code == class_code && d->subclass == subclass &&
+        d->prog_if == prog_if) {
+      if (index == 0) {
+        return d;
       }
+      index--;
     }
   }
   return 0;
 }
+
+uint8_t pci_find_cap(const PciDevice *d, uint8_t cap_id) {
+  if (!d) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < d->cap_count; ++i) {
+    if (d->cap_id[i] == cap_id) {
+      return d->cap_offset[i];
+    }
+  }
+  return 0;
+}
+
+void pci_set_bus_master(const PciDevice *d, int on) {
+  uint32_t cmd = pci_read32(d->bus, d->dev, d->func, 0x04) & 0xFFFF;
+  if (on) {
+    cmd |= 1u << 2;
+  } else {
+    cmd &= ~(1u << 2);
+  }
+  pci_write32(d->bus, d->dev, d->func, 0x04, cmd);
+}
+
+static uint32_t pci_msi_address(uint32_t apic_id) {
+  return 0xFEE00000u | ((apic_id & 0xFF) << 12);
+}
+
+// Bus mastering on (MSI writes are DMA), legacy INTx off.
+static void pci_use_msi(const PciDevice *d) {
+  uint32_t cmd = pci_read32(d->bus, d->dev, d->func, 0x04) & 0xFFFF;
+  cmd |= (1u << 2) | (1u << 10);
+  pci_write32(d->bus, d->dev, d->func, 0x04, cmd);
+}
+
+uint32_t pci_msix_count(const PciDevice *d) {
+  uint8_t cap = pci_find_cap(d, PCI_CAP_MSIX);
+  if (!cap) {
+    return 0;
+  }
+  uint32_t ctrl = pci_read32(d->bus, d->dev, d->func, cap) >> 16;
+  return (ctrl & 0x7FF) + 1;
+}
+
+int pci_msix_enable(const PciDevice *d) {
+  uint8_t cap = pci_find_cap(d, PCI_CAP_MSIX);
+  if (!cap) {
+    return 0;
+  }
+  uint8_t msi = pci_find_cap(d, PCI_CAP_MSI);
+  if (msi) {
+    uint32_t reg = pci_read32(d->bus, d->dev, d->func, msi);
+    pci_write32(d->bus, d->dev, d->func, msi, reg & ~(1u << 16));
+  }
+  pci_use_msi(d);
+  // Table entries come out of reset masked; clear the function mask and
+  // let pci_msix_set() unmask them one at a time.
+  uint32_t reg = pci_read32(d->bus, d->dev, d->func, cap);
+  reg &= ~(1u << 30);
+  reg |= 1u << 31;
+  pci_write32(d->bus, d->dev, d->func, cap, reg);
+  return 1;
+}
+
+int pci_msix_set(const PciDevice *d, uint32_t entry, uint8_t vector,
+                 uint32_t apic_id) {
+  uint8_t cap = pci_find_cap(d, PCI_CAP_MSIX);
+  if (!cap || entry >= pci_msix_count(d)) {
+    return 0;
+  }
+  uint32_t table = pci_read32(d->bus, d->dev, d->func, (uint16_t)(cap + 4));
+  uint32_t bir = table & 0x7;
+  if (bir > 5 || d->bar[bir] == 0 || (d->bar_flags[bir] & PCI_BAR_IO)) {
+    return 0;
+  }
+  volatile uint32_t *e = (volatile uint32_t *)(uintptr_t)(
+      d->bar[bir] + (table & ~0x7u) + entry * 16u);
+  e[3] = 1; // mask while the entry is rewritten
+  e[0] = pci_msi_address(apic_id);
+  e[1] = 0;
+  e[2] = vector; // fixed delivery, edge triggered
+  e[3] = 0;
+  return 1;
+}
+
+int pci_msi_enable(const PciDevice *d, uint8_t vector, uint32_t apic_id) {
+  uint8_t cap = pci_find_cap(d, PCI_CAP_MSI);
+  if (!cap) {
+    return 0;
+  }
+  pci_use_msi(d);
+  uint32_t reg = pci_read32(d->bus, d->dev, d->func, cap);
+  uint32_t ctrl = reg >> 16;
+  pci_write32(d->bus, d->dev, d->func, (uint16_t)(cap + 4),
+              pci_msi_address(apic_id));
+  if (ctrl & (1u << 7)) {
+    // 64-bit capable: upper address dword, then data at +0x0C.
+    pci_write32(d->bus, d->dev, d->func, (uint16_t)(cap + 8), 0);
+    pci_write32(d->bus, d->dev, d->func, (uint16_t)(cap + 12), vector);
+  } else {
+    pci_write32(d->bus, d->dev, d->func, (uint16_t)(cap + 8), vector);
+  }
+  // One message (MME = 0), enabled.
+  ctrl &= ~(7u << 4);
+  ctrl |= 1u;
+  pci_write32(d->bus, d->dev, d->func, cap, (reg & 0xFFFF) | (ctrl << 16));
+  return 1;
+}
@@ -3,15 +3,69 @@
 
 #include <stdint.h>
 
-uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset);
+#define PCI_MAX_DEVICES 64
+#define PCI_MAX_CAPS 8
+
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+
+#define PCI_BAR_IO 0x01
+#define PCI_BAR_64 0x02
+#define PCI_BAR_PREFETCH 0x04
 
 typedef struct {
   uint8_t bus;
   uint8_t dev;
   uint8_t func;
-  uint64_t bar0;
-} PciXhciDevice;
+  uint8_t header_type;
+  uint16_t vendor_id;
+  uint16_t device_id;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t prog_if;
+  uint8_t revision;
+  // Decoded BAR base addresses. A 64-bit BAR fills bar[i] and leaves the
+  // next slot zero.
+  uint64_t bar[6];
+  // Decoded window sizes in bytes (0 for an unimplemented BAR).
+  uint64_t bar_size[6];
+  uint8_t bar_flags[6];
+  uint8_t cap_count;
+  uint8_t cap_id[PCI_MAX_CAPS];
+  uint8_t cap_offset[PCI_MAX_CAPS];
+} PciDevice;
+
+// Config space access. Goes through the MCFG's ECAM window when there is
+// one (which also reaches the extended space above 0xFF) and through ports
+// 0xCF8/0xCFC otherwise.
+uint32_t pci_read32(uint8_t bus, uint8_t dev, uint8_t func, uint16_t offset);
+void pci_write32(uint8_t bus, uint8_t dev, uint8_t func, uint16_t offset,
+                 uint32_t value);
+int pci_ecam_enabled(void);
+
+// Walk the hierarchy once, following bridges to the buses that exist, and
+// cache every function found. Lookups below only read that table.
+int pci_enumerate(void);
+uint32_t pci_device_count(void);
+const PciDevice *pci_device_at(uint32_t index);
+// index selects among several matches (0 = first).
+const PciDevice *pci_find_class(uint8_t class_code, uint8_t subclass,
+                                uint8_t prog_if, uint32_t index);
+// Config space offset of capability cap_id, or 0 if absent.
+uint8_t pci_find_cap(const PciDevice *d, uint8_t cap_id);
+
+// Turn the device's DMA (bus mastering) on or off. Turning it off is how a
+// driver makes sure a controller it has given up on no longer touches
+// memory.
+void pci_set_bus_master(const PciDevice *d, int on);
 
-int pci_find_xhci(PciXhciDevice *out_dev);
+// Message-signalled interrupts. Each message is delivered as `vector` to the
+// local APIC `apic_id`. Enabling either mode also turns off INTx.
+uint32_t pci_msix_count(const PciDevice *d);
+int pci_msix_enable(const PciDevice *d);
+// Program and unmask MSI-X table entry `entry` (requires pci_msix_enable).
+int pci_msix_set(const PciDevice *d, uint32_t entry, uint8_t vector,
+                 uint32_t apic_id);
+int pci_msi_enable(const PciDevice *d, uint8_t vector, uint32_t apic_id);
 
 #endif
@@ -1,6 +1,9 @@
 #include "drivers/xhci.h"
 #include "drivers/pci.h"
 #include "console.h"
+#include "kprintf.h"
+#include "cpu.h"
+#include "time.h"
 #include <stdint.h>
 
 static inline uint32_t mmio_read32(uint64_t base, uint32_t offset) {
@@ -13,25 +16,19 @@ static inline void mmio_write32(uint64_t base, uint32_t offset, uint32_t v) {
   *addr = v;
 }
 
-static void console_write_hex32(uint32_t v) {
-  char hex[9];
-  for (int i = 0; i < 8; ++i) {
-    uint8_t nibble = (v >> (28 - 4 * i)) & 0xF;
-    hex[i] = (nibble < 10) ? (char)('0' + nibble) : (char)('A' + (nibble - 10));
-  }
-  hex[8] = 0;
-  console_write(hex);
-}
-
 static int wait_for_mask(uint64_t base, uint32_t offset, uint32_t mask,
-                         uint32_t expected, uint32_t spins) {
-  while (spins--) {
+                         uint32_t expected, uint64_t timeout_ns) {
+  uint64_t deadline = ktime_deadline(timeout_ns);
+  for (;;) {
     uint32_t v = mmio_read32(base, offset);
     if ((v & mask) == expected) {
       return 1;
     }
+    if (ktime_expired(deadline)) {
+      return 0;
+    }
+    cpu_relax();
   }
-  return 0;
 }
 
 typedef struct {
@@ -54,16 +51,17 @@ static XhciInfo g_xhci;
 
 int xhci_init(void) {
   g_xhci.present = 0;
-  PciXhciDevice dev;
-  if (!pci_find_xhci(&dev)) {
+  // xHCI: class 0x0C, subclass 0x03, progIF 0x30
+  const PciDevice *dev = pci_find_class(0x0C, 0x03, 0x30, 0);
+  if (!dev) {
     return 0;
   }
   g_xhci.present = 1;
-  g_xhci.bus = dev.bus;
-  g_xhci.dev = dev.dev;
-  g_xhci.func = dev.func;
+  g_xhci.bus = dev->bus;
+  g_xhci.dev = dev->dev;
+  g_xhci.func = dev->func;
 
-  uint64_t base = dev.bar0;
+  uint64_t base = dev->bar[0];
   g_xhci.mmio_base = base;
 
   uint32_t caplength_hciversion = mmio_read32(base, 0x00);
@@ -89,13 +87,13 @@ int xhci_init(void) {
   uint32_t cmd = mmio_read32(op_base, USBCMD);
   cmd &= ~1u;
   mmio_write32(op_base, USBCMD, cmd);
-  wait_for_mask(op_base, USBSTS, 1u, 1u, 1000000);
+  wait_for_mask(op_base, USBSTS, 1u, 1u, 20 * KTIME_MS); // HCHalted
 
   // Reset controller.
   cmd = mmio_read32(op_base, USBCMD);
   cmd |= (1u << 1);
   mmio_write32(op_base, USBCMD, cmd);
-  if (!wait_for_mask(op_base, USBCMD, (1u << 1), 0u, 1000000)) {
+  if (!wait_for_mask(op_base, USBCMD, (1u << 1), 0u, 1000 * KTIME_MS)) {
     return 0;
   }
 
@@ -117,49 +115,17 @@ void xhci_print_info(void) {
     return;
   }
 
-  console_write("xHCI: bus ");
-  console_putc('0' + (g_xhci.bus / 100));
-  console_putc('0' + ((g_xhci.bus / 10) % 10));
-  console_putc('0' + (g_xhci.bus % 10));
-  console_write(" dev ");
-  console_putc('0' + (g_xhci.dev / 10));
-  console_putc('0' + (g_xhci.dev % 10));
-  console_write(" func ");
-  console_putc('0' + (g_xhci.func % 10));
-  console_putc('\n');
-
-  console_write("xHCI MMIO base 0x");
-  console_write_hex32((uint32_t)(g_xhci.mmio_base >> 32));
-  console_write_hex32((uint32_t)g_xhci.mmio_base);
-  console_putc('\n');
-
-  console_write("caplength=0x");
-  console_write_hex32(g_xhci.caplength);
-  console_write(" hci=0x");
-  console_write_hex32(g_xhci.hci_version);
-  console_putc('\n');
-
-  console_write("hcsparams1=0x");
-  console_write_hex32(g_xhci.hcsparams1);
-  console_write(" hccparams1=0x");
-  console_write_hex32(g_xhci.hccparams1);
-  console_putc('\n');
-
-  console_write("dboff=0x");
-  console_write_hex32(g_xhci.dboff);
-  console_write(" rtsoff=0x");
-  console_write_hex32(g_xhci.rtsoff);
-  console_putc('\n');
-
-  console_write("ports=");
-  console_write_hex32(g_xhci.max_ports);
-  console_putc('\n');
+  kprintf("xHCI: bus %03u dev %02u func %u\n", g_xhci.bus, g_xhci.dev,
+          g_xhci.func);
+  kprintf("xHCI MMIO base 0x%016lX\n", g_xhci.mmio_base);
+  kprintf("caplength=0x%08X hci=0x%08X\n", g_xhci.caplength,
+          g_xhci.hci_version);
+  kprintf("hcsparams1=0x%08X hccparams1=0x%08X\n", g_xhci.hcsparams1,
+          g_xhci.hccparams1);
+  kprintf("dboff=0x%08X rtsoff=0x%08X\n", g_xhci.dboff, g_xhci.rtsoff);
+  kprintf("ports=%08X\n", g_xhci.max_ports);
 
   for (uint32_t p = 0; p < g_xhci.max_ports && p < 8; ++p) {
-    console_write("port");
-    console_putc('0' + (p + 1));
-    console_write("=0x");
-    console_write_hex32(g_xhci.portsc[p]);
-    console_putc('\n');
+    kprintf("port%u=0x%08X\n", p + 1, g_xhci.portsc[p]);
   }
 }
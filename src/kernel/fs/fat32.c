@@ -1,6 +1,7 @@
 #include "fs/fat32.h"
 #include "drivers/block.h"
 #include "console.h"
+#include "kprintf.h"
 #include <stdint.h>
 
 typedef struct {
@@ -72,35 +73,41 @@ static uint32_t cluster_to_lba(uint32_t cluster) {
   return g_part_lba + g_data_start_lba + (cluster - 2) * g_bpb.sectors_per_cluster;
 }
 
+// Whole-sector file reads kept in flight at once.
+#define FAT32_READ_BATCH 8
+
 static int read_sector(uint32_t lba, void *out) {
   return block_read(lba, 1, out);
 }
 
 static int gpt_find_esp(uint32_t *out_lba) {
-  uint8_t hdr[512];
-  if (!read_sector(1, hdr)) {
+  const uint8_t *hdr = block_pin(1);
+  if (!hdr) {
     return 0;
   }
   if (!(hdr[0] == 'E' && hdr[1] == 'F' && hdr[2] == 'I' && hdr[3] == ' ' &&
         hdr[4] == 'P' && hdr[5] == 'A' && hdr[6] == 'R' && hdr[7] == 'T')) {
+    block_unpin(hdr);
     return 0;
   }
-  uint64_t entries_lba = *(uint64_t *)(hdr + 0x48);
-  uint32_t num_entries = *(uint32_t *)(hdr + 0x50);
-  uint32_t entry_size = *(uint32_t *)(hdr + 0x54);
+  uint64_t entries_lba = *(const uint64_t *)(hdr + 0x48);
+  uint32_t num_entries = *(const uint32_t *)(hdr + 0x50);
+  uint32_t entry_size = *(const uint32_t *)(hdr + 0x54);
+  block_unpin(hdr);
   if (entry_size < sizeof(GptEntry)) {
     return 0;
   }
-  uint8_t sec[512];
   uint32_t entries_per_sector = 512 / entry_size;
   for (uint32_t i = 0; i < num_entries; ++i) {
     uint32_t lba = (uint32_t)(entries_lba + (i / entries_per_sector));
-    if (!read_sector(lba, sec)) {
+    const uint8_t *sec = block_pin(lba);
+    if (!sec) {
       return 0;
     }
     uint32_t offset = (i % entries_per_sector) * entry_size;
-    GptEntry *ent = (GptEntry *)(sec + offset);
+    const GptEntry *ent = (const GptEntry *)(sec + offset);
     if (ent->type[0] == 0 && ent->type[1] == 0) {
+      block_unpin(sec);
       continue;
     }
     int match = 1;
@@ -110,8 +117,10 @@ static int gpt_find_esp(uint32_t *out_lba) {
         break;
       }
     }
+    uint64_t first_lba = ent->first_lba;
+    block_unpin(sec);
     if (match) {
-      *out_lba = (uint32_t)ent->first_lba;
+      *out_lba = (uint32_t)first_lba;
       return 1;
     }
   }
@@ -149,54 +158,116 @@ void fat32_print_info(void) {
     console_write_line("FAT32: not mounted");
     return;
   }
-  console_write("FAT32: root=");
-  char num[12];
-  uint32_t v = g_bpb.root_cluster;
-  int i = 0;
-  if (v == 0) {
-    num[i++] = '0';
-  } else {
-    char buf[12];
-    int j = 0;
-    while (v > 0) {
-      buf[j++] = (char)('0' + (v % 10));
-      v /= 10;
-    }
-    while (j > 0) {
-      num[i++] = buf[--j];
-    }
-  }
-  num[i] = 0;
-  console_write_line(num);
+  kprintf("FAT32: root=%u\n", g_bpb.root_cluster);
 }
 
 static uint32_t fat_next_cluster(uint32_t cluster) {
   uint32_t fat_offset = cluster * 4;
   uint32_t fat_sector = g_fat_start_lba + (fat_offset / 512);
   uint32_t ent_offset = fat_offset % 512;
-  uint8_t sec[512];
-  if (!read_sector(fat_sector, sec)) {
+  const uint8_t *sec = block_pin(g_part_lba + fat_sector);
+  if (!sec) {
     return 0x0FFFFFFF;
   }
-  uint32_t val = *(uint32_t *)(sec + ent_offset);
+  uint32_t val = *(const uint32_t *)(sec + ent_offset);
+  block_unpin(sec);
   return val & 0x0FFFFFFF;
 }
 
+// Read `bytes` of a cluster chain into dst. Whole sectors go straight into
+// dst through asynchronous requests, one per run of contiguous clusters, so
+// the device works on them while we keep walking the FAT. A trailing partial
+// sector is copied out of the cache.
+static int read_chain(uint32_t cluster, uint8_t *dst, uint32_t bytes) {
+  BlockRequest reqs[FAT32_READ_BATCH];
+  uint32_t nreq = 0;
+  int building = 0;
+  int ok = 1;
+  uint32_t spc = g_bpb.sectors_per_cluster;
+  uint32_t tail_lba = 0;
+
+  while (bytes > 0 && cluster >= 2) {
+    uint32_t lba = cluster_to_lba(cluster);
+    uint32_t n = bytes / 512;
+    if (n > spc) {
+      n = spc;
+    }
+    if (n > 0) {
+      BlockRequest *cur = building ? &reqs[nreq - 1] : 0;
+      if (cur && cur->lba + cur->count == lba) {
+        cur->count += n;
+      } else {
+        if (building) {
+          block_submit(cur, 1);
+        }
+        if (nreq == FAT32_READ_BATCH) {
+          ok &= block_wait_all(reqs, nreq);
+          nreq = 0;
+        }
+        cur = &reqs[nreq++];
+        cur->op = BLOCK_OP_READ;
+        cur->lba = lba;
+        cur->count = n;
+        cur->buf = dst;
+        cur->segs = 0;
+        cur->seg_count = 0;
+        cur->done = 0;
+        cur->ctx = 0;
+        building = 1;
+      }
+      dst += n * 512;
+      bytes -= n * 512;
+    }
+    if (n < spc) {
+      if (bytes > 0) {
+        tail_lba = lba + n;
+      }
+      break;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    uint32_t next = fat_next_cluster(cluster);
+    if (next >= 0x0FFFFFF8) {
+      break;
+    }
+    cluster = next;
+  }
+  if (building) {
+    block_submit(&reqs[nreq - 1], 1);
+  }
+
+  if (tail_lba != 0) {
+    const uint8_t *data = block_pin(tail_lba);
+    if (!data) {
+      ok = 0;
+    } else {
+      for (uint32_t n = 0; n < bytes; ++n) {
+        dst[n] = data[n];
+      }
+      block_unpin(data);
+    }
+  }
+  ok &= block_wait_all(reqs, nreq);
+  return ok;
+}
+
 int fat32_list_root(void) {
   if (!g_mounted) {
     return 0;
   }
   uint32_t cluster = g_bpb.root_cluster;
-  uint8_t sec[512];
   for (;;) {
     uint32_t lba = cluster_to_lba(cluster);
     for (uint32_t s = 0; s < g_bpb.sectors_per_cluster; ++s) {
-      if (!read_sector(lba + s, sec)) {
+      const uint8_t *sec = block_pin(lba + s);
+      if (!sec) {
         return 0;
       }
       for (uint32_t off = 0; off < 512; off += sizeof(FatDirEnt)) {
-        FatDirEnt *ent = (FatDirEnt *)(sec + off);
+        const FatDirEnt *ent = (const FatDirEnt *)(sec + off);
         if (ent->name[0] == 0x00) {
+          block_unpin(sec);
           return 1;
         }
         if (ent->name[0] == 0xE5 || ent->attr == 0x0F) {
@@ -222,6 +293,7 @@ int fat32_list_root(void) {
         name[idx] = 0;
         console_write_line(name);
       }
+      block_unpin(sec);
     }
     uint32_t next = fat_next_cluster(cluster);
     if (next >= 0x0FFFFFF8) {
@@ -237,7 +309,6 @@ int fat32_read_file(const char *name, void *out, uint32_t max_bytes, uint32_t *o
     return 0;
   }
   uint32_t cluster = g_bpb.root_cluster;
-  uint8_t sec[512];
   char target[11];
   for (int i = 0; i < 11; ++i) {
     target[i] = ' ';
@@ -262,12 +333,14 @@ int fat32_read_file(const char *name, void *out, uint32_t max_bytes, uint32_t *o
   for (;;) {
     uint32_t lba = cluster_to_lba(cluster);
     for (uint32_t s = 0; s < g_bpb.sectors_per_cluster; ++s) {
-      if (!read_sector(lba + s, sec)) {
+      const uint8_t *sec = block_pin(lba + s);
+      if (!sec) {
         return 0;
       }
       for (uint32_t off = 0; off < 512; off += sizeof(FatDirEnt)) {
-        FatDirEnt *ent = (FatDirEnt *)(sec + off);
+        const FatDirEnt *ent = (const FatDirEnt *)(sec + off);
         if (ent->name[0] == 0x00) {
+          block_unpin(sec);
           return 0;
         }
         if (ent->name[0] == 0xE5 || ent->attr == 0x0F) {
@@ -284,35 +357,21 @@ int fat32_read_file(const char *name, void *out, uint32_t max_bytes, uint32_t *o
           continue;
         }
         uint32_t file_cluster = ((uint32_t)ent->fst_clus_hi << 16) | ent->fst_clus_lo;
-        uint32_t remaining = ent->file_size;
+        uint32_t file_size = ent->file_size;
+        block_unpin(sec);
+        uint32_t remaining = file_size;
         if (remaining > max_bytes) {
           remaining = max_bytes;
         }
-        uint8_t *dst = (uint8_t *)out;
-        while (remaining > 0 && file_cluster >= 2) {
-          uint32_t file_lba = cluster_to_lba(file_cluster);
-          for (uint32_t ss = 0; ss < g_bpb.sectors_per_cluster && remaining > 0; ++ss) {
-            if (!read_sector(file_lba + ss, sec)) {
-              return 0;
-            }
-            uint32_t copy = remaining < 512 ? remaining : 512;
-            for (uint32_t n = 0; n < copy; ++n) {
-              dst[n] = sec[n];
-            }
-            dst += copy;
-            remaining -= copy;
-          }
-          uint32_t next = fat_next_cluster(file_cluster);
-          if (next >= 0x0FFFFFF8) {
-            break;
-          }
-          file_cluster = next;
+        if (!read_chain(file_cluster, (uint8_t *)out, remaining)) {
+          return 0;
         }
         if (out_size) {
-          *out_size = ent->file_size;
+          *out_size = file_size;
         }
         return 1;
       }
+      block_unpin(sec);
     }
     uint32_t next = fat_next_cluster(cluster);
     if (next >= 0x0FFFFFF8) {
@@ -0,0 +1,270 @@
+#include "heap.h"
+#include "cpu.h"
+#include "pmm.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#define HEAP_SLAB_MAGIC 0x534C4142u // "SLAB"
+
+// Lives at the start of each slab page, so objects are never page aligned
+// and kfree() can tell them from large allocations.
+typedef struct HeapSlab {
+  struct HeapSlab *next;
+  struct HeapSlab *prev;
+  void *free; // singly linked through the free objects
+  uint32_t magic;
+  uint32_t cls;
+  uint32_t used; // objects out of this slab (with callers or magazines)
+  uint32_t capacity;
+} __attribute__((aligned(64))) HeapSlab;
+
+typedef struct {
+  Spinlock lock;
+  HeapSlab *partial; // slabs with at least one free object
+  uint32_t size;
+  uint32_t per_slab;
+  uint64_t slabs;
+  uint64_t out; // objects taken out of slabs
+} HeapClass;
+
+// Touched only by the owning CPU, with interrupts off so that a preempting
+// thread cannot interleave.
+typedef struct {
+  uint32_t count;
+  void *objs[HEAP_MAGAZINE_SIZE];
+  uint64_t hits;
+  uint64_t misses;
+} __attribute__((aligned(64))) HeapMagazine;
+
+static HeapClass g_classes[HEAP_CLASSES];
+static HeapMagazine g_magazines[SMP_MAX_CPUS][HEAP_CLASSES];
+static volatile uint64_t g_large_bytes = 0;
+
+static uint32_t size_class(size_t size) {
+  uint32_t cls = 0;
+  while ((16u << cls) < size) {
+    cls++;
+  }
+  return cls;
+}
+
+static void partial_add(HeapClass *c, HeapSlab *s) {
+  s->prev = 0;
+  s->next = c->partial;
+  if (s->next) {
+    s->next->prev = s;
+  }
+  c->partial = s;
+}
+
+static void partial_remove(HeapClass *c, HeapSlab *s) {
+  if (s->prev) {
+    s->prev->next = s->next;
+  } else {
+    c->partial = s->next;
+  }
+  if (s->next) {
+    s->next->prev = s->prev;
+  }
+  s->next = 0;
+  s->prev = 0;
+}
+
+static HeapSlab *slab_create(HeapClass *c, uint32_t cls) {
+  uint64_t page = pmm_alloc_page();
+  if (!page) {
+    return 0;
+  }
+  HeapSlab *s = (HeapSlab *)(uintptr_t)page;
+  s->magic = HEAP_SLAB_MAGIC;
+  s->cls = cls;
+  s->used = 0;
+  s->capacity = c->per_slab;
+  s->free = 0;
+  uint8_t *obj = (uint8_t *)s + sizeof(HeapSlab);
+  for (uint32_t i = 0; i < c->per_slab; ++i) {
+    *(void **)obj = s->free;
+    s->free = obj;
+    obj += c->size;
+  }
+  c->slabs++;
+  partial_add(c, s);
+  return s;
+}
+
+// Top the magazine up to half full from the class's slabs.
+static void magazine_refill(uint32_t cls, HeapMagazine *m) {
+  HeapClass *c = &g_classes[cls];
+  uint64_t flags = spin_lock_irqsave(&c->lock);
+  while (m->count < HEAP_MAGAZINE_SIZE / 2) {
+    HeapSlab *s = c->partial;
+    if (!s && !(s = slab_create(c, cls))) {
+      break;
+    }
+    void *obj = s->free;
+    s->free = *(void **)obj;
+    s->used++;
+    c->out++;
+    if (!s->free) {
+      partial_remove(c, s);
+    }
+    m->objs[m->count++] = obj;
+  }
+  spin_unlock_irqrestore(&c->lock, flags);
+}
+
+// Hand the older half of a full magazine back to the slabs, releasing
+// slabs that become empty.
+static void magazine_flush(uint32_t cls, HeapMagazine *m) {
+  HeapClass *c = &g_classes[cls];
+  uint32_t n = HEAP_MAGAZINE_SIZE / 2;
+  uint64_t flags = spin_lock_irqsave(&c->lock);
+  for (uint32_t i = 0; i < n; ++i) {
+    void *obj = m->objs[i];
+    HeapSlab *s = (HeapSlab *)((uintptr_t)obj & ~(uintptr_t)(PMM_PAGE_SIZE - 1));
+    if (!s->free) {
+      partial_add(c, s);
+    }
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->used--;
+    c->out--;
+    if (s->used == 0) {
+      partial_remove(c, s);
+      s->magic = 0;
+      c->slabs--;
+      pmm_free_page((uint64_t)(uintptr_t)s);
+    }
+  }
+  spin_unlock_irqrestore(&c->lock, flags);
+  for (uint32_t i = n; i < m->count; ++i) {
+    m->objs[i - n] = m->objs[i];
+  }
+  m->count -= n;
+}
+
+int heap_init(void) {
+  for (uint32_t i = 0; i < HEAP_CLASSES; ++i) {
+    HeapClass *c = &g_classes[i];
+    spin_init(&c->lock);
+    c->partial = 0;
+    c->size = 16u << i;
+    c->per_slab = (PMM_PAGE_SIZE - sizeof(HeapSlab)) / c->size;
+    c->slabs = 0;
+    c->out = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+      HeapMagazine *m = &g_magazines[cpu][i];
+      m->count = 0;
+      m->hits = 0;
+      m->misses = 0;
+    }
+  }
+  g_large_bytes = 0;
+  return 1;
+}
+
+static void *large_alloc(size_t size) {
+  uint32_t order = 0;
+  while (((uint64_t)PMM_PAGE_SIZE << order) < size) {
+    if (++order > PMM_MAX_ORDER) {
+      return 0;
+    }
+  }
+  uint64_t addr = pmm_alloc_pages(order);
+  if (!addr) {
+    return 0;
+  }
+  __atomic_fetch_add(&g_large_bytes, (uint64_t)PMM_PAGE_SIZE << order,
+                     __ATOMIC_RELAXED);
+  return (void *)(uintptr_t)addr;
+}
+
+void *kmalloc(size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  if (size > HEAP_MAX_SMALL) {
+    return large_alloc(size);
+  }
+  uint32_t cls = size_class(size);
+  uint64_t flags = irq_save();
+  HeapMagazine *m = &g_magazines[this_cpu()->index][cls];
+  if (m->count == 0) {
+    m->misses++;
+    magazine_refill(cls, m);
+    if (m->count == 0) {
+      irq_restore(flags);
+      return 0;
+    }
+  } else {
+    m->hits++;
+  }
+  void *obj = m->objs[--m->count];
+  irq_restore(flags);
+  return obj;
+}
+
+void *kzalloc(size_t size) {
+  uint8_t *p = (uint8_t *)kmalloc(size);
+  if (p) {
+    for (size_t i = 0; i < size; ++i) {
+      p[i] = 0;
+    }
+  }
+  return p;
+}
+
+void kfree(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  uintptr_t addr = (uintptr_t)ptr;
+  if ((addr & (PMM_PAGE_SIZE - 1)) == 0) {
+    int order = pmm_block_order(addr);
+    if (order < 0) {
+      return;
+    }
+    __atomic_fetch_sub(&g_large_bytes, (uint64_t)PMM_PAGE_SIZE << order,
+                       __ATOMIC_RELAXED);
+    pmm_free_pages(addr, (uint32_t)order);
+    return;
+  }
+  HeapSlab *s = (HeapSlab *)(addr & ~(uintptr_t)(PMM_PAGE_SIZE - 1));
+  if (s->magic != HEAP_SLAB_MAGIC) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  HeapMagazine *m = &g_magazines[this_cpu()->index][s->cls];
+  if (m->count == HEAP_MAGAZINE_SIZE) {
+    magazine_flush(s->cls, m);
+  }
+  m->objs[m->count++] = ptr;
+  irq_restore(flags);
+}
+
+void heap_get_stats(HeapStats *out) {
+  out->small_bytes = 0;
+  out->slab_bytes = 0;
+  out->large_bytes = g_large_bytes;
+  for (uint32_t i = 0; i < HEAP_CLASSES; ++i) {
+    HeapClass *c = &g_classes[i];
+    HeapClassStats *cs = &out->classes[i];
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    cs->size = c->size;
+    cs->slabs = c->slabs;
+    uint64_t taken = c->out;
+    spin_unlock_irqrestore(&c->lock, flags);
+    cs->cached = 0;
+    cs->hits = 0;
+    cs->misses = 0;
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; ++cpu) {
+      const HeapMagazine *m = &g_magazines[cpu][i];
+      cs->cached += m->count;
+      cs->hits += m->hits;
+      cs->misses += m->misses;
+    }
+    cs->in_use = taken > cs->cached ? taken - cs->cached : 0;
+    out->small_bytes += cs->in_use * c->size;
+    out->slab_bytes += cs->slabs * PMM_PAGE_SIZE;
+  }
+}
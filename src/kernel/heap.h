@@ -0,0 +1,41 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size classes 16, 32, ... HEAP_MAX_SMALL bytes come from one-page slabs;
+// anything larger is a run of whole pages from the page allocator.
+#define HEAP_CLASSES 7
+#define HEAP_MAX_SMALL 1024
+// Objects each CPU keeps per class before going to the shared slabs.
+#define HEAP_MAGAZINE_SIZE 32
+
+typedef struct {
+  uint32_t size;
+  uint64_t slabs;
+  uint64_t in_use; // held by callers
+  uint64_t cached; // sitting in per-CPU magazines
+  uint64_t hits;   // served from a magazine
+  uint64_t misses; // needed a refill from the slabs
+} HeapClassStats;
+
+typedef struct {
+  uint64_t small_bytes; // class-size bytes held by callers
+  uint64_t slab_bytes;  // pages backing the slabs
+  uint64_t large_bytes; // pages handed out directly
+  HeapClassStats classes[HEAP_CLASSES];
+} HeapStats;
+
+// Needs pmm_init() and, before the first allocation, smp_init().
+int heap_init(void);
+
+// 16-byte aligned for small sizes, page aligned above HEAP_MAX_SMALL.
+// Returns 0 when out of memory.
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+void heap_get_stats(HeapStats *out);
+
+#endif
@@ -0,0 +1,138 @@
+#include "idt.h"
+#include "apic.h"
+#include "console.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "thread.h"
+
+#define ISR_STUB_SIZE 16
+
+typedef struct {
+  uint16_t offset_lo;
+  uint16_t selector;
+  uint8_t ist;
+  uint8_t type_attr;
+  uint16_t offset_mid;
+  uint32_t offset_hi;
+  uint32_t reserved;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+  uint16_t limit;
+  uint64_t base;
+} __attribute__((packed)) IdtPointer;
+
+static IdtEntry g_idt[256] __attribute__((aligned(16)));
+static IrqHandler g_irq_handlers[256];
+static void *g_irq_ctx[256];
+
+extern uint8_t isr_stub_table[];
+
+static const char *g_exception_names[32] = {
+  "divide error", "debug", "NMI", "breakpoint", "overflow",
+  "bound range", "invalid opcode", "device not available", "double fault",
+  "coprocessor overrun", "invalid TSS", "segment not present",
+  "stack fault", "general protection", "page fault", "reserved",
+  "x87 error", "alignment check", "machine check", "SIMD error",
+  "virtualization", "control protection", "reserved", "reserved",
+  "reserved", "reserved", "reserved", "reserved", "hypervisor injection",
+  "VMM communication", "security", "reserved"
+};
+
+void interrupt_dispatch(InterruptFrame *frame);
+
+static void idt_set_gate(uint32_t vector, uint64_t handler, uint16_t cs) {
+  IdtEntry *e = &g_idt[vector];
+  e->offset_lo = (uint16_t)(handler & 0xFFFF);
+  e->selector = cs;
+  e->ist = 0;
+  e->type_attr = 0x8E; // present, DPL 0, 64-bit interrupt gate
+  e->offset_mid = (uint16_t)((handler >> 16) & 0xFFFF);
+  e->offset_hi = (uint32_t)(handler >> 32);
+  e->reserved = 0;
+}
+
+void idt_init(void) {
+  uint16_t cs;
+  __asm__ __volatile__("mov %%cs, %0" : "=r"(cs));
+  for (uint32_t v = 0; v < 256; ++v) {
+    g_irq_handlers[v] = 0;
+    g_irq_ctx[v] = 0;
+    idt_set_gate(v, (uint64_t)(uintptr_t)(isr_stub_table + v * ISR_STUB_SIZE),
+                 cs);
+  }
+  idt_load();
+}
+
+void idt_load(void) {
+  IdtPointer ptr;
+  ptr.limit = sizeof(g_idt) - 1;
+  ptr.base = (uint64_t)(uintptr_t)g_idt;
+  __asm__ __volatile__("lidt %0" : : "m"(ptr));
+}
+
+void idt_set_ist(uint8_t vector, uint8_t ist) {
+  g_idt[vector].ist = ist & 0x7;
+}
+
+int irq_register(uint8_t vector, IrqHandler handler, void *ctx) {
+  if (g_irq_handlers[vector] && handler) {
+    return 0;
+  }
+  g_irq_ctx[vector] = ctx;
+  g_irq_handlers[vector] = handler;
+  return 1;
+}
+
+int irq_alloc_vector(IrqHandler handler, void *ctx) {
+  if (!handler) {
+    return -1;
+  }
+  for (uint32_t v = IRQ_VECTOR_FIRST; v <= IRQ_VECTOR_LAST; ++v) {
+    if (!g_irq_handlers[v]) {
+      irq_register((uint8_t)v, handler, ctx);
+      return (int)v;
+    }
+  }
+  return -1;
+}
+
+void irq_free_vector(int vector) {
+  if (vector >= IRQ_VECTOR_FIRST && vector <= IRQ_VECTOR_LAST) {
+    g_irq_handlers[vector] = 0;
+    g_irq_ctx[vector] = 0;
+  }
+}
+
+// Unhandled CPU exception: report where it happened and stop this CPU.
+static void exception_panic(const InterruptFrame *frame) {
+  uint64_t cr2;
+  __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+  console_write("\nexception: ");
+  console_write_line(g_exception_names[frame->vector & 31]);
+  kprintf("vec=%016lX err=%016lX\n", frame->vector, frame->error);
+  kprintf("rip=%016lX rsp=%016lX\n", frame->rip, frame->rsp);
+  kprintf("cr2=%016lX rflags=%016lX\n", cr2, frame->rflags);
+  console_flush();
+  for (;;) {
+    irq_disable();
+    __asm__ __volatile__("hlt");
+  }
+}
+
+void interrupt_dispatch(InterruptFrame *frame) {
+  uint32_t vector = (uint32_t)(frame->vector & 0xFF);
+  if (vector == IRQ_VECTOR_SPURIOUS) {
+    return;
+  }
+  IrqHandler handler = g_irq_handlers[vector];
+  if (handler) {
+    handler(frame, g_irq_ctx[vector]);
+  } else if (vector < 32) {
+    exception_panic(frame);
+  }
+  if (vector >= 32) {
+    lapic_eoi();
+    thread_preempt();
+  }
+}
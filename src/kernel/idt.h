@@ -0,0 +1,34 @@
+#ifndef IDT_H
+#define IDT_H
+
+#include <stdint.h>
+
+// Register state pushed by the entry stubs in isr.S, lowest address first.
+typedef struct {
+  uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+  uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+  uint64_t vector;
+  uint64_t error;
+  uint64_t rip, cs, rflags, rsp, ss;
+} InterruptFrame;
+
+typedef void (*IrqHandler)(InterruptFrame *frame, void *ctx);
+
+// Vectors 0-31 are CPU exceptions. Device interrupts are handed out from
+// IRQ_VECTOR_FIRST..IRQ_VECTOR_LAST.
+#define IRQ_VECTOR_FIRST 0x30
+#define IRQ_VECTOR_LAST 0xEF
+#define IRQ_VECTOR_SPURIOUS 0xFF
+
+void idt_init(void);
+// Load the shared IDT on the calling CPU (idt_init() does this for the BSP).
+void idt_load(void);
+// Run `vector` on interrupt stack table entry `ist` (1-7, 0 = current stack).
+void idt_set_ist(uint8_t vector, uint8_t ist);
+int irq_register(uint8_t vector, IrqHandler handler, void *ctx);
+// Reserve a free device vector and route it to handler. Returns the vector
+// or -1 if none is left.
+int irq_alloc_vector(IrqHandler handler, void *ctx);
+void irq_free_vector(int vector);
+
+#endif
@@ -2,6 +2,18 @@
 #include "console.h"
 #include "keyboard.h"
 #include "shell.h"
+#include "acpi.h"
+#include "apic.h"
+#include "cpu.h"
+#include "idt.h"
+#include "pmm.h"
+#include "paging.h"
+#include "heap.h"
+#include "smp.h"
+#include "task.h"
+#include "thread.h"
+#include "time.h"
+#include "drivers/pci.h"
 #include "drivers/xhci.h"
 #include "drivers/block.h"
 
@@ -9,11 +21,29 @@ BootInfo g_boot_info;
 
 void kernel_main(struct BootInfo *info) {
   g_boot_info = *info;
+  pmm_init(&g_boot_info.memory_map);
   console_init(&g_boot_info.fb);
+  heap_init();
+  smp_init();
+  idt_init();
+  paging_init(&g_boot_info.memory_map);
+  paging_map((uint64_t)(uintptr_t)g_boot_info.fb.base,
+             (uint64_t)(uintptr_t)g_boot_info.fb.base, g_boot_info.fb.size,
+             PAGING_WRITE | PAGING_CACHE_WC);
+  acpi_init(g_boot_info.acpi_rsdp);
+  time_init();
+  lapic_init();
+  apic_madt_init();
+  lapic_timer_init(100);
   keyboard_init();
+  irq_enable();
+  smp_start_aps(g_boot_info.ap_trampoline);
+  task_init();
+  thread_init();
 
   console_write_line("TestOS shell");
   console_write_line("type help for commands");
+  pci_enumerate();
   xhci_init();
   block_init();
   shell_run();
@@ -13,8 +13,59 @@ typedef struct {
   uint32_t pixel_format;
 } FrameBuffer;
 
+// The loader reserves KERNEL_IMAGE_MAX bytes at KERNEL_LOAD_ADDR and zeroes
+// everything past the file, so .bss is backed and starts out clear
+// (linker.ld checks that the image fits).
+#define KERNEL_LOAD_ADDR 0x100000
+#define KERNEL_IMAGE_MAX (8 * 1024 * 1024)
+
+// The final UEFI memory map: `size` bytes of EFI_MEMORY_DESCRIPTORs,
+// `desc_size` apart, at physical address `base` (LoaderData).
+typedef struct {
+  uint64_t base;
+  uint64_t size;
+  uint64_t desc_size;
+  uint32_t desc_version;
+} MemoryMap;
+
+#define EFI_RESERVED_MEMORY 0
+#define EFI_LOADER_CODE 1
+#define EFI_LOADER_DATA 2
+#define EFI_BOOT_SERVICES_CODE 3
+#define EFI_BOOT_SERVICES_DATA 4
+#define EFI_RUNTIME_SERVICES_CODE 5
+#define EFI_RUNTIME_SERVICES_DATA 6
+#define EFI_CONVENTIONAL_MEMORY 7
+#define EFI_UNUSABLE_MEMORY 8
+#define EFI_ACPI_RECLAIM_MEMORY 9
+#define EFI_ACPI_NVS_MEMORY 10
+#define EFI_MEMORY_MAPPED_IO 11
+#define EFI_MEMORY_MAPPED_IO_PORT_SPACE 12
+#define EFI_PAL_CODE 13
+#define EFI_PERSISTENT_MEMORY 14
+
+typedef struct {
+  uint32_t type;
+  uint32_t pad;
+  uint64_t phys_start;
+  uint64_t virt_start;
+  uint64_t pages;
+  uint64_t attr;
+} EfiMemoryDescriptor;
+
+static inline const EfiMemoryDescriptor *memory_map_entry(const MemoryMap *map,
+                                                          uint64_t i) {
+  return (const EfiMemoryDescriptor *)(uintptr_t)(map->base +
+                                                  i * map->desc_size);
+}
+
 typedef struct BootInfo {
   FrameBuffer fb;
+  uint64_t acpi_rsdp; // physical address of the RSDP, 0 if none
+  // Four pages below 1 MiB reserved for starting application processors
+  // (real-mode code plus temporary page tables), 0 if none.
+  uint64_t ap_trampoline;
+  MemoryMap memory_map;
 } BootInfo;
 
 void kernel_main(struct BootInfo *info);
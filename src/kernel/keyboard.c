@@ -1,6 +1,21 @@
 #include "keyboard.h"
+#include "apic.h"
+#include "cpu.h"
+#include "idt.h"
+#include "thread.h"
+#include "time.h"
 #include <stdint.h>
 
+// Scancodes collected by the IRQ1 handler (or by polling when IRQ1 could
+// not be routed) until keyboard_getchar() decodes them.
+#define KEYBOARD_BUFFER 64
+
+static volatile uint8_t g_kbd_buf[KEYBOARD_BUFFER];
+static volatile uint32_t g_kbd_head = 0;
+static volatile uint32_t g_kbd_tail = 0;
+static int g_kbd_irq = 0;
+static WaitQueue g_kbd_wait;
+
 static inline void outb(uint16_t port, uint8_t val) {
   __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
 }
@@ -26,25 +41,126 @@ static const char scancode_set1[128] = {
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
+// Move whatever the controller holds into the ring. Runs with interrupts
+// off (in the IRQ handler or with them disabled by the caller).
+static void keyboard_drain(void) {
+  while (inb(0x64) & 0x01) {
+    uint8_t sc = inb(0x60);
+    uint32_t next = (g_kbd_head + 1) % KEYBOARD_BUFFER;
+    if (next != g_kbd_tail) {
+      g_kbd_buf[g_kbd_head] = sc;
+      g_kbd_head = next;
+    }
+  }
+}
+
+static void keyboard_irq(InterruptFrame *frame, void *ctx) {
+  keyboard_drain();
+  waitq_wake_all(&g_kbd_wait);
+}
+
+static int kbc_wait_input_empty(void) {
+  uint64_t deadline = ktime_deadline(10 * KTIME_MS);
+  while (inb(0x64) & 0x02) {
+    if (ktime_expired(deadline)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int kbc_wait_output_full(void) {
+  uint64_t deadline = ktime_deadline(10 * KTIME_MS);
+  while (!(inb(0x64) & 0x01)) {
+    if (ktime_expired(deadline)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Set bit 0 (first port interrupt) in the 8042 configuration byte, which
+// firmware that polls the controller may have left clear.
+static int kbc_enable_irq(void) {
+  if (!kbc_wait_input_empty()) {
+    return 0;
+  }
+  outb(0x64, 0x20);
+  if (!kbc_wait_output_full()) {
+    return 0;
+  }
+  uint8_t config = inb(0x60);
+  if (!kbc_wait_input_empty()) {
+    return 0;
+  }
+  outb(0x64, 0x60);
+  if (!kbc_wait_input_empty()) {
+    return 0;
+  }
+  outb(0x60, config | 0x01);
+  return 1;
+}
+
 void keyboard_init(void) {
+  g_kbd_head = 0;
+  g_kbd_tail = 0;
+  g_kbd_irq = 0;
+  waitq_init(&g_kbd_wait);
   // Drain output buffer.
   while (inb(0x64) & 0x01) {
     (void)inb(0x60);
     io_wait();
   }
+  if (!kbc_enable_irq()) {
+    return;
+  }
+  int vector = irq_alloc_vector(keyboard_irq, 0);
+  if (vector < 0) {
+    return;
+  }
+  if (!ioapic_route_isa(1, (uint8_t)vector, lapic_id())) {
+    irq_free_vector(vector);
+    return;
+  }
+  g_kbd_irq = 1;
 }
 
+// Sleeps between keystrokes: blocked on IRQ1 when it is routed (other
+// threads run meanwhile), otherwise on the timer tick, polling the
+// controller after each wakeup.
 char keyboard_getchar(void) {
   for (;;) {
-    if (inb(0x64) & 0x01) {
-      uint8_t sc = inb(0x60);
-      if (sc & 0x80) {
-        continue; // key release
-      }
-      char c = scancode_set1[sc];
-      if (c) {
-        return c;
+    irq_disable();
+    if (!g_kbd_irq) {
+      keyboard_drain();
+    }
+    if (g_kbd_head == g_kbd_tail) {
+      if (g_kbd_irq) {
+        waitq_wait(&g_kbd_wait);
+      } else if (lapic_timer_hz() != 0) {
+        irq_wait();
+      } else {
+        irq_enable();
       }
+      continue;
+    }
+    uint8_t sc = g_kbd_buf[g_kbd_tail];
+    g_kbd_tail = (g_kbd_tail + 1) % KEYBOARD_BUFFER;
+    irq_enable();
+    if (sc & 0x80) {
+      continue; // key release
+    }
+    // Page Up/Down arrive as E0 49/51 (the E0 prefix is skipped above as
+    // a release) or as keypad 9/3 with num lock off.
+    if (sc == 0x49) {
+      return KEY_PAGE_UP;
+    }
+    if (sc == 0x51) {
+      return KEY_PAGE_DOWN;
+    }
+    char c = scancode_set1[sc];
+    if (c) {
+      return c;
     }
   }
 }
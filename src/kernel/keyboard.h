@@ -1,6 +1,10 @@
 #ifndef KEYBOARD_H
 #define KEYBOARD_H
 
+// keyboard_getchar() returns these for keys without an ASCII code.
+#define KEY_PAGE_UP '\x0E'
+#define KEY_PAGE_DOWN '\x0F'
+
 void keyboard_init(void);
 char keyboard_getchar(void);
 
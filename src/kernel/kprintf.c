@@ -0,0 +1,259 @@
+#include "kprintf.h"
+#include "console.h"
+#include <stdint.h>
+
+static const char g_digits_lower[] = "0123456789abcdef";
+static const char g_digits_upper[] = "0123456789ABCDEF";
+
+// "00" "01" ... "99": decimal conversion emits two digits per division.
+static const char g_dec_pairs[200] = {
+  '0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+  '1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+  '2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+  '3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+  '4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+  '5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+  '6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+  '7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+  '8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+  '9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9',
+};
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len; // characters produced, including any that did not fit
+} KOut;
+
+static void out_char(KOut *o, char c) {
+  if (o->len + 1 < o->size) {
+    o->buf[o->len] = c;
+  }
+  o->len++;
+}
+
+static void out_repeat(KOut *o, char c, int n) {
+  for (int i = 0; i < n; ++i) {
+    out_char(o, c);
+  }
+}
+
+// Digits of v in base 10 or 16, written backwards from the end of tmp.
+// Returns a pointer to the first digit.
+static char *convert(uint64_t v, uint32_t base, int upper, char *end) {
+  char *p = end;
+  if (base == 16) {
+    const char *digits = upper ? g_digits_upper : g_digits_lower;
+    do {
+      *--p = digits[v & 0xF];
+      v >>= 4;
+    } while (v != 0);
+    return p;
+  }
+  while (v >= 100) {
+    uint32_t pair = (uint32_t)(v % 100) * 2;
+    v /= 100;
+    *--p = g_dec_pairs[pair + 1];
+    *--p = g_dec_pairs[pair];
+  }
+  if (v >= 10) {
+    uint32_t pair = (uint32_t)v * 2;
+    *--p = g_dec_pairs[pair + 1];
+    *--p = g_dec_pairs[pair];
+  } else {
+    *--p = (char)('0' + v);
+  }
+  return p;
+}
+
+static void out_field(KOut *o, const char *s, int len, int width, int left,
+                      char pad, int negative) {
+  int total = len + (negative ? 1 : 0);
+  int fill = width > total ? width - total : 0;
+  if (!left && pad == ' ') {
+    out_repeat(o, ' ', fill);
+  }
+  if (negative) {
+    out_char(o, '-');
+  }
+  if (!left && pad == '0') {
+    out_repeat(o, '0', fill);
+  }
+  for (int i = 0; i < len; ++i) {
+    out_char(o, s[i]);
+  }
+  if (left) {
+    out_repeat(o, ' ', fill);
+  }
+}
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
+  KOut o = {buf, size, 0};
+  char tmp[24];
+  while (*fmt) {
+    if (*fmt != '%') {
+      out_char(&o, *fmt++);
+      continue;
+    }
+    fmt++;
+    int left = 0;
+    char pad = ' ';
+    for (;; fmt++) {
+      if (*fmt == '-') {
+        left = 1;
+      } else if (*fmt == '0') {
+        pad = '0';
+      } else {
+        break;
+      }
+    }
+    int width = 0;
+    if (*fmt == '*') {
+      width = va_arg(ap, int);
+      if (width < 0) {
+        left = 1;
+        width = -width;
+      }
+      fmt++;
+    }
+    while (*fmt >= '0' && *fmt <= '9') {
+      width = width * 10 + (*fmt++ - '0');
+    }
+    int precision = -1;
+    if (*fmt == '.') {
+      fmt++;
+      precision = 0;
+      if (*fmt == '*') {
+        precision = va_arg(ap, int);
+        fmt++;
+      }
+      while (*fmt >= '0' && *fmt <= '9') {
+        precision = precision * 10 + (*fmt++ - '0');
+      }
+    }
+    // 0 = int, 1 = long, 2 = long long, 3 = size_t, -1 = short, -2 = char
+    int length = 0;
+    if (*fmt == 'h') {
+      length = -1;
+      if (*++fmt == 'h') {
+        length = -2;
+        fmt++;
+      }
+    } else if (*fmt == 'l') {
+      length = 1;
+      if (*++fmt == 'l') {
+        length = 2;
+        fmt++;
+      }
+    } else if (*fmt == 'z') {
+      length = 3;
+      fmt++;
+    }
+    if (left) {
+      pad = ' ';
+    }
+
+    char conv = *fmt;
+    if (conv == 0) {
+      break;
+    }
+    fmt++;
+    switch (conv) {
+    case 'd':
+    case 'i': {
+      int64_t v;
+      if (length == 1) {
+        v = va_arg(ap, long);
+      } else if (length == 2) {
+        v = va_arg(ap, long long);
+      } else if (length == 3) {
+        v = (int64_t)va_arg(ap, size_t);
+      } else {
+        v = va_arg(ap, int);
+        if (length == -1) {
+          v = (short)v;
+        } else if (length == -2) {
+          v = (signed char)v;
+        }
+      }
+      uint64_t mag = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+      char *p = convert(mag, 10, 0, tmp + sizeof(tmp));
+      out_field(&o, p, (int)(tmp + sizeof(tmp) - p), width, left, pad, v < 0);
+      break;
+    }
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'p': {
+      uint64_t v;
+      if (conv == 'p') {
+        v = (uint64_t)(uintptr_t)va_arg(ap, void *);
+        out_char(&o, '0');
+        out_char(&o, 'x');
+        width = 16;
+        left = 0;
+        pad = '0';
+      } else if (length == 1) {
+        v = va_arg(ap, unsigned long);
+      } else if (length == 2) {
+        v = va_arg(ap, unsigned long long);
+      } else if (length == 3) {
+        v = va_arg(ap, size_t);
+      } else {
+        v = va_arg(ap, unsigned int);
+        if (length == -1) {
+          v = (unsigned short)v;
+        } else if (length == -2) {
+          v = (unsigned char)v;
+        }
+      }
+      char *p = convert(v, conv == 'u' ? 10 : 16, conv == 'X',
+                        tmp + sizeof(tmp));
+      out_field(&o, p, (int)(tmp + sizeof(tmp) - p), width, left, pad, 0);
+      break;
+    }
+    case 's': {
+      const char *s = va_arg(ap, const char *);
+      if (!s) {
+        s = "(null)";
+      }
+      int len = 0;
+      while (s[len] && (precision < 0 || len < precision)) {
+        len++;
+      }
+      out_field(&o, s, len, width, left, ' ', 0);
+      break;
+    }
+    case 'c':
+      tmp[0] = (char)va_arg(ap, int);
+      out_field(&o, tmp, 1, width, left, ' ', 0);
+      break;
+    default:
+      // %% and anything unknown come out as written.
+      out_char(&o, conv);
+      break;
+    }
+  }
+  if (size > 0) {
+    buf[o.len < size ? o.len : size - 1] = 0;
+  }
+  return (int)o.len;
+}
+
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = kvsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+int kprintf(const char *fmt, ...) {
+  char buf[KPRINTF_MAX];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = kvsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  console_write(buf);
+  return n;
+}
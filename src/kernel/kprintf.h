@@ -0,0 +1,23 @@
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// printf-style formatting without libc. Conversions: %d %i %u %x %X %s %c
+// %% and %p (always 0x plus 16 digits), with the flags '-' (left align) and
+// '0' (zero pad), a width (digits or *), a precision for %s, and the length
+// modifiers hh h l ll z.
+//
+// Writes at most size bytes including the terminating NUL (when size > 0)
+// and returns the length the whole output would have had.
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+int ksnprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Format into a stack buffer and hand it to the console as one string.
+// Output beyond KPRINTF_MAX bytes is dropped.
+#define KPRINTF_MAX 256
+int kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
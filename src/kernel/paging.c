@@ -0,0 +1,525 @@
+#include "paging.h"
+#include "apic.h"
+#include "cpu.h"
+#include "console.h"
+#include "idt.h"
+#include "kprintf.h"
+#include "pmm.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "time.h"
+
+#define PTE_PRESENT 0x001ull
+#define PTE_WRITE 0x002ull
+#define PTE_LARGE 0x080ull
+#define PTE_GLOBAL 0x100ull
+#define PTE_ADDR 0x000FFFFFFFFFF000ull
+// Bits a leaf passes on to the smaller pages it is split into.
+#define PTE_ATTR (PTE_WRITE | PAGING_CACHE_MASK | PTE_GLOBAL)
+
+#define MSR_PAT 0x277
+// WB, WC, UC-, UC in entries 0-3 and again in 4-7: the power-on layout
+// with entry 1 turned from write-through into write-combining.
+#define PAT_VALUE 0x0007010600070106ull
+
+#define CR4_PGE (1ull << 7)
+#define CR4_PCIDE (1ull << 17)
+
+#define PAGE_2M 0x200000ull
+#define PAGE_1G 0x40000000ull
+#define LOW_4G 0x100000000ull
+
+// How long flush_all_cpus() waits for an ack before sending the IPI again,
+// and how many times it tries before giving up on the machine.
+#define FLUSH_RETRY_NS (10 * KTIME_MS)
+#define FLUSH_RETRIES 100
+
+// Page-table pages unhooked by update_range(). Other CPUs may still walk
+// them through stale paging-structure caches, so they are only returned to
+// the PMM once every CPU has flushed. The list lives in pages of its own:
+// writing a link into a retired table would be just as unsafe as freeing it.
+#define RETIRED_PER_PAGE 511
+typedef struct RetiredTables {
+  struct RetiredTables *next;
+  uint64_t pages[RETIRED_PER_PAGE];
+} RetiredTables;
+
+static uint64_t *g_pml4 = 0;
+static uint32_t g_features = 0;
+static uint64_t g_global = 0; // PTE_GLOBAL once CR4.PGE is on
+static int g_live = 0;
+static Spinlock g_paging_lock;
+static int g_flush_vector = -1;
+static volatile uint64_t g_flush_gen = 0;
+static volatile uint64_t g_flush_ack[SMP_MAX_CPUS];
+static RetiredTables *g_retired = 0;
+static uint32_t g_retired_count = 0; // entries used in g_retired
+
+static uint64_t read_cr3(void) {
+  uint64_t v;
+  __asm__ __volatile__("mov %%cr3, %0" : "=r"(v));
+  return v;
+}
+
+static void write_cr3(uint64_t v) {
+  __asm__ __volatile__("mov %0, %%cr3" : : "r"(v) : "memory");
+}
+
+static uint64_t read_cr4(void) {
+  uint64_t v;
+  __asm__ __volatile__("mov %%cr4, %0" : "=r"(v));
+  return v;
+}
+
+static void write_cr4(uint64_t v) {
+  __asm__ __volatile__("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+// Level 4 is the PML4, level 1 the 4 KiB page tables.
+static uint32_t level_shift(uint32_t level) {
+  return 3 + 9 * level;
+}
+
+static int leaf_allowed(uint32_t level) {
+  return level <= 2 || (level == 3 && (g_features & PAGING_HUGE_1G));
+}
+
+static uint64_t leaf_base(uint64_t entry, uint64_t span) {
+  return entry & PTE_ADDR & ~(span - 1);
+}
+
+static uint64_t *alloc_table(void) {
+  uint64_t *t = (uint64_t *)(uintptr_t)pmm_alloc_page();
+  if (t) {
+    for (uint32_t i = 0; i < 512; ++i) {
+      t[i] = 0;
+    }
+  }
+  return t;
+}
+
+// Queue a table page for release after the next flush. Before paging is
+// live nothing walks the new tables, so they go straight back. If no page
+// is left to extend the list the table is leaked rather than freed early.
+static void retire_table(uint64_t page) {
+  if (!g_live) {
+    pmm_free_page(page);
+    return;
+  }
+  if (!g_retired || g_retired_count == RETIRED_PER_PAGE) {
+    RetiredTables *r = (RetiredTables *)(uintptr_t)pmm_alloc_page();
+    if (!r) {
+      return;
+    }
+    r->next = g_retired;
+    g_retired = r;
+    g_retired_count = 0;
+  }
+  g_retired->pages[g_retired_count++] = page;
+}
+
+// Take the retired list; call with g_paging_lock held.
+static RetiredTables *take_retired(uint32_t *count) {
+  RetiredTables *r = g_retired;
+  *count = g_retired_count;
+  g_retired = 0;
+  g_retired_count = 0;
+  return r;
+}
+
+// Free a list from take_retired() once flush_all_cpus() has returned. Only
+// the newest page is partly used.
+static void free_retired(RetiredTables *r, uint32_t count) {
+  while (r) {
+    RetiredTables *next = r->next;
+    for (uint32_t i = 0; i < count; ++i) {
+      pmm_free_page(r->pages[i]);
+    }
+    pmm_free_page((uint64_t)(uintptr_t)r);
+    r = next;
+    count = RETIRED_PER_PAGE;
+  }
+}
+
+// Give back the tables below a non-leaf entry that is being replaced.
+static void free_tables(uint64_t entry, uint32_t level) {
+  if (!(entry & PTE_PRESENT) || (entry & PTE_LARGE) || level == 1) {
+    return;
+  }
+  uint64_t *t = (uint64_t *)(uintptr_t)(entry & PTE_ADDR);
+  for (uint32_t i = 0; i < 512 && level > 2; ++i) {
+    free_tables(t[i], level - 1);
+  }
+  retire_table((uint64_t)(uintptr_t)t);
+}
+
+// Turn a huge leaf into a table of 512 next-size leaves with the same
+// physical range and attributes.
+static int split(uint64_t *e, uint32_t level) {
+  uint64_t *t = alloc_table();
+  if (!t) {
+    return 0;
+  }
+  uint64_t span = 1ull << level_shift(level - 1);
+  uint64_t base = leaf_base(*e, span << 9);
+  uint64_t bits = (*e & PTE_ATTR) | PTE_PRESENT | (level > 2 ? PTE_LARGE : 0);
+  for (uint32_t i = 0; i < 512; ++i) {
+    t[i] = (base + i * span) | bits;
+  }
+  *e = (uint64_t)(uintptr_t)t | PTE_PRESENT | PTE_WRITE;
+  return 1;
+}
+
+// Map (or with map = 0, unmap) a page-aligned range. Each step walks down
+// until an entry covers a piece of the range that can be handled whole.
+static int update_range(uint64_t virt, uint64_t phys, uint64_t size,
+                        uint64_t attr, int map) {
+  while (size > 0) {
+    uint64_t *table = g_pml4;
+    uint64_t step = 0;
+    for (uint32_t level = 4; step == 0; --level) {
+      uint64_t span = 1ull << level_shift(level);
+      uint64_t off = virt & (span - 1);
+      uint64_t *e = &table[(virt >> level_shift(level)) & 511];
+      int whole = off == 0 && size >= span;
+      if (whole && (!map || (leaf_allowed(level) && (phys & (span - 1)) == 0))) {
+        free_tables(*e, level);
+        *e = map ? phys | attr | PTE_PRESENT | (level > 1 ? PTE_LARGE : 0) : 0;
+        step = span;
+      } else if (!(*e & PTE_PRESENT)) {
+        if (!map) {
+          step = span - off;
+          break;
+        }
+        uint64_t *t = alloc_table();
+        if (!t) {
+          return 0;
+        }
+        *e = (uint64_t)(uintptr_t)t | PTE_PRESENT | PTE_WRITE;
+      } else if (level > 1 && (*e & PTE_LARGE)) {
+        if (map && leaf_base(*e, span) + off == phys &&
+            (*e & PTE_ATTR) == attr) {
+          step = span - off; // already mapped this way
+          break;
+        }
+        if (!split(e, level)) {
+          return 0;
+        }
+      }
+      if (step == 0) {
+        table = (uint64_t *)(uintptr_t)(*e & PTE_ADDR);
+      }
+    }
+    if (step > size) {
+      step = size;
+    }
+    virt += step;
+    phys += step;
+    size -= step;
+  }
+  return 1;
+}
+
+// Toggling CR4.PGE drops every translation, global ones and all PCIDs
+// included.
+static void flush_local(void) {
+  uint64_t flags = irq_save();
+  uint64_t cr4 = read_cr4();
+  if (cr4 & CR4_PGE) {
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else {
+    write_cr3(read_cr3());
+  }
+  irq_restore(flags);
+}
+
+static void flush_irq(InterruptFrame *frame, void *ctx) {
+  uint64_t gen = __atomic_load_n(&g_flush_gen, __ATOMIC_ACQUIRE);
+  flush_local();
+  volatile uint64_t *ack = &g_flush_ack[this_cpu()->index];
+  if (*ack < gen) {
+    *ack = gen;
+  }
+}
+
+// Mappings only change during setup, so every change flushes the whole TLB
+// here and on every other online CPU rather than tracking pages. Returns
+// only once every CPU has acked: callers free retired tables after it. A
+// CPU that stays silent is sent the IPI again, and after FLUSH_RETRIES
+// rounds the machine is stopped, since its TLB can no longer be trusted.
+static void flush_all_cpus(void) {
+  flush_local();
+  if (g_flush_vector < 0 || smp_cpu_count() < 2) {
+    return;
+  }
+  uint64_t gen = __atomic_add_fetch(&g_flush_gen, 1, __ATOMIC_ACQ_REL);
+  PerCpu *self = this_cpu();
+  for (uint32_t i = 0; i < smp_cpu_count(); ++i) {
+    PerCpu *c = smp_cpu(i);
+    if (c != self && c->online) {
+      lapic_send_ipi(c->apic_id, (uint32_t)g_flush_vector);
+    }
+  }
+  for (uint32_t i = 0; i < smp_cpu_count(); ++i) {
+    PerCpu *c = smp_cpu(i);
+    if (c == self || !c->online) {
+      continue;
+    }
+    uint32_t tries = 0;
+    uint64_t deadline = ktime_deadline(FLUSH_RETRY_NS);
+    while (g_flush_ack[i] < gen) {
+      if (!ktime_expired(deadline)) {
+        cpu_relax();
+        continue;
+      }
+      if (++tries == FLUSH_RETRIES) {
+        kprintf("\npaging: cpu %u did not ack a TLB flush\n", i);
+        console_flush();
+        for (;;) {
+          irq_disable();
+          __asm__ __volatile__("hlt");
+        }
+      }
+      lapic_send_ipi(c->apic_id, (uint32_t)g_flush_vector);
+      deadline = ktime_deadline(FLUSH_RETRY_NS);
+    }
+  }
+}
+
+static int ram_type(uint32_t type) {
+  return (type >= EFI_LOADER_CODE && type <= EFI_CONVENTIONAL_MEMORY) ||
+         type == EFI_ACPI_RECLAIM_MEMORY || type == EFI_ACPI_NVS_MEMORY ||
+         type == EFI_PERSISTENT_MEMORY;
+}
+
+static int mmio_type(uint32_t type) {
+  return type == EFI_MEMORY_MAPPED_IO ||
+         type == EFI_MEMORY_MAPPED_IO_PORT_SPACE;
+}
+
+static int has_ram(const MemoryMap *map, uint64_t count, uint64_t start,
+                   uint64_t end) {
+  for (uint64_t i = 0; i < count; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    uint64_t s = d->phys_start;
+    uint64_t e = s + d->pages * PMM_PAGE_SIZE;
+    if (ram_type(d->type) && s < end && e > start) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void detect_features(void) {
+  uint32_t a, b, c, d;
+  cpuid(1, 0, &a, &b, &c, &d);
+  if (d & (1u << 13)) {
+    g_features |= PAGING_GLOBAL;
+  }
+  if (c & (1u << 17)) {
+    g_features |= PAGING_PCID;
+  }
+  if (d & (1u << 16)) {
+    g_features |= PAGING_PAT;
+  }
+  cpuid(0x80000000u, 0, &a, &b, &c, &d);
+  if (a >= 0x80000001u) {
+    cpuid(0x80000001u, 0, &a, &b, &c, &d);
+    if (d & (1u << 26)) {
+      g_features |= PAGING_HUGE_1G;
+    }
+  }
+}
+
+int paging_init(const MemoryMap *map) {
+  g_pml4 = 0;
+  g_features = 0;
+  g_global = 0;
+  g_live = 0;
+  g_flush_vector = -1;
+  g_flush_gen = 0;
+  for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+    g_flush_ack[i] = 0;
+  }
+  g_retired = 0;
+  g_retired_count = 0;
+  spin_init(&g_paging_lock);
+  if (!map || map->base == 0 || map->desc_size < sizeof(EfiMemoryDescriptor)) {
+    return 0;
+  }
+  detect_features();
+  if (g_features & PAGING_GLOBAL) {
+    g_global = PTE_GLOBAL;
+  }
+  paging_load_pat();
+  g_pml4 = alloc_table();
+  if (!g_pml4) {
+    return 0;
+  }
+
+  // Everything up to the end of the map (and at least the 32-bit space,
+  // where the local APIC, IOAPIC and most BARs live). Devices beyond that
+  // are added later with paging_map_mmio().
+  uint64_t count = map->size / map->desc_size;
+  uint64_t top = LOW_4G;
+  for (uint64_t i = 0; i < count; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    uint64_t end = d->phys_start + d->pages * PMM_PAGE_SIZE;
+    if (end > top) {
+      top = end;
+    }
+  }
+  top = (top + PAGE_1G - 1) & ~(PAGE_1G - 1);
+  uint64_t wb = PTE_WRITE | PAGING_CACHE_WB | g_global;
+  uint64_t uc = PTE_WRITE | PAGING_CACHE_UC | g_global;
+  if (!update_range(0, 0, top, wb, 1)) {
+    return 0;
+  }
+  uint64_t hole = 0;
+  for (uint64_t at = 0; at <= LOW_4G; at += PAGE_2M) {
+    int ram = at == LOW_4G || has_ram(map, count, at, at + PAGE_2M);
+    if (ram && hole < at) {
+      if (!update_range(hole, hole, at - hole, uc, 1)) {
+        return 0;
+      }
+    }
+    if (ram) {
+      hole = at + PAGE_2M;
+    }
+  }
+  for (uint64_t i = 0; i < count; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    if (mmio_type(d->type) && d->pages != 0 &&
+        !update_range(d->phys_start, d->phys_start,
+                      d->pages * PMM_PAGE_SIZE, uc, 1)) {
+      return 0;
+    }
+  }
+
+  // PCID 0 is the kernel's; CR3's low bits must be clear when PCIDE is set.
+  write_cr3((uint64_t)(uintptr_t)g_pml4);
+  uint64_t cr4 = read_cr4();
+  if (g_features & PAGING_GLOBAL) {
+    cr4 |= CR4_PGE;
+  }
+  if (g_features & PAGING_PCID) {
+    cr4 |= CR4_PCIDE;
+  }
+  write_cr4(cr4);
+  g_live = 1;
+  g_flush_vector = irq_alloc_vector(flush_irq, 0);
+  return 1;
+}
+
+uint32_t paging_features(void) {
+  return g_features;
+}
+
+void paging_load_pat(void) {
+  if (!(g_features & PAGING_PAT)) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  __asm__ __volatile__("wbinvd" : : : "memory");
+  wrmsr(MSR_PAT, PAT_VALUE);
+  flush_local();
+  irq_restore(flags);
+}
+
+int paging_map(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+  if (!g_live || ((virt ^ phys) & (PMM_PAGE_SIZE - 1)) || size == 0) {
+    return 0;
+  }
+  uint64_t off = virt & (PMM_PAGE_SIZE - 1);
+  virt -= off;
+  phys -= off;
+  size = (size + off + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+  if ((flags & PAGING_CACHE_MASK) == PAGING_CACHE_WC &&
+      !(g_features & PAGING_PAT)) {
+    flags |= PAGING_CACHE_UC;
+  }
+  uint64_t attr = (flags & (PAGING_WRITE | PAGING_CACHE_MASK)) | g_global;
+  uint64_t irq = spin_lock_irqsave(&g_paging_lock);
+  int ok = update_range(virt, phys, size, attr, 1);
+  uint32_t retired = 0;
+  RetiredTables *r = take_retired(&retired);
+  spin_unlock_irqrestore(&g_paging_lock, irq);
+  flush_all_cpus();
+  free_retired(r, retired);
+  return ok;
+}
+
+int paging_unmap(uint64_t virt, uint64_t size) {
+  if (!g_live || size == 0) {
+    return 0;
+  }
+  uint64_t off = virt & (PMM_PAGE_SIZE - 1);
+  virt -= off;
+  size = (size + off + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+  uint64_t irq = spin_lock_irqsave(&g_paging_lock);
+  int ok = update_range(virt, 0, size, 0, 0);
+  uint32_t retired = 0;
+  RetiredTables *r = take_retired(&retired);
+  spin_unlock_irqrestore(&g_paging_lock, irq);
+  flush_all_cpus();
+  free_retired(r, retired);
+  return ok;
+}
+
+uint64_t paging_translate(uint64_t virt) {
+  if (!g_live) {
+    return virt;
+  }
+  const uint64_t *table = g_pml4;
+  for (uint32_t level = 4; level >= 1; --level) {
+    uint64_t span = 1ull << level_shift(level);
+    uint64_t e = table[(virt >> level_shift(level)) & 511];
+    if (!(e & PTE_PRESENT)) {
+      break;
+    }
+    if (level == 1 || (e & PTE_LARGE)) {
+      return leaf_base(e, span) + (virt & (span - 1));
+    }
+    table = (const uint64_t *)(uintptr_t)(e & PTE_ADDR);
+  }
+  return ~0ull;
+}
+
+static void count_tables(const uint64_t *table, uint32_t level,
+                         PagingStats *out) {
+  out->table_pages++;
+  for (uint32_t i = 0; i < 512; ++i) {
+    uint64_t e = table[i];
+    if (!(e & PTE_PRESENT)) {
+      continue;
+    }
+    if (level == 1 || (e & PTE_LARGE)) {
+      if (level == 3) {
+        out->pages_1g++;
+      } else if (level == 2) {
+        out->pages_2m++;
+      } else {
+        out->pages_4k++;
+      }
+      out->mapped_bytes += 1ull << level_shift(level);
+      continue;
+    }
+    count_tables((const uint64_t *)(uintptr_t)(e & PTE_ADDR), level - 1, out);
+  }
+}
+
+void paging_get_stats(PagingStats *out) {
+  out->pages_1g = 0;
+  out->pages_2m = 0;
+  out->pages_4k = 0;
+  out->table_pages = 0;
+  out->mapped_bytes = 0;
+  out->features = g_features;
+  if (!g_live) {
+    return;
+  }
+  uint64_t irq = spin_lock_irqsave(&g_paging_lock);
+  count_tables(g_pml4, 4, out);
+  spin_unlock_irqrestore(&g_paging_lock, irq);
+}
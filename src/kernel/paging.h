@@ -0,0 +1,59 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+// Mapping flags. Every mapping is present, supervisor-only and global (when
+// the CPU has global pages); the cache type picks the PCD/PWT bits, which
+// index the PAT. Entry 1 (PWT alone) is reprogrammed from write-through to
+// write-combining; without a PAT, WC falls back to UC.
+#define PAGING_WRITE 0x002ull
+#define PAGING_CACHE_WB 0x000ull
+#define PAGING_CACHE_WC 0x008ull
+#define PAGING_CACHE_UC 0x018ull
+#define PAGING_CACHE_MASK 0x018ull
+
+// paging_features() bits.
+#define PAGING_HUGE_1G 0x1u
+#define PAGING_GLOBAL 0x2u
+#define PAGING_PCID 0x4u
+#define PAGING_PAT 0x8u
+
+typedef struct {
+  uint64_t pages_1g;
+  uint64_t pages_2m;
+  uint64_t pages_4k;
+  uint64_t table_pages;
+  uint64_t mapped_bytes;
+  uint32_t features;
+} PagingStats;
+
+// Replace the firmware's page tables with kernel-owned ones: RAM and
+// everything else the memory map describes is identity mapped write-back
+// with the largest pages the CPU supports, while MMIO descriptors and the
+// RAM-free 2 MiB regions below 4 GiB (the PCI hole) are uncached. Turns on
+// global pages and PCID where available. Runs on the BSP after idt_init()
+// and before smp_start_aps(), whose trampoline copies CR3 and CR4.
+int paging_init(const MemoryMap *map);
+uint32_t paging_features(void);
+// Program this CPU's PAT (paging_init() does the BSP's). Every CPU must use
+// the same one, so APs call this before touching WC memory.
+void paging_load_pat(void);
+
+// Map [virt, virt + size) to phys (both rounded out to 4 KiB pages, with the
+// same offset) using the largest pages alignment allows, splitting any huge
+// page the range only partly covers. Existing mappings are replaced. Every
+// CPU's TLB is flushed before returning.
+int paging_map(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+int paging_unmap(uint64_t virt, uint64_t size);
+// Identity map a device register range uncached.
+static inline int paging_map_mmio(uint64_t phys, uint64_t size) {
+  return paging_map(phys, phys, size, PAGING_WRITE | PAGING_CACHE_UC);
+}
+// Physical address virt maps to, or ~0 when it is not mapped.
+uint64_t paging_translate(uint64_t virt);
+
+void paging_get_stats(PagingStats *out);
+
+#endif
@@ -0,0 +1,40 @@
+#include "pit.h"
+
+static uint8_t g_pit_saved_gate = 0;
+
+static inline void outb(uint16_t port, uint8_t val) {
+  __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+  uint8_t ret;
+  __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+  return ret;
+}
+
+void pit_oneshot_start(uint32_t us) {
+  uint32_t count = (uint32_t)(((uint64_t)PIT_HZ * us) / 1000000u);
+  if (count == 0) {
+    count = 1;
+  }
+  if (count > 0xFFFF) {
+    count = 0xFFFF;
+  }
+  g_pit_saved_gate = inb(0x61);
+  // Gate low and speaker off while programming channel 2 for mode 0
+  // (OUT2 goes high at terminal count).
+  uint8_t gate = g_pit_saved_gate & ~0x03u;
+  outb(0x61, gate);
+  outb(0x43, 0xB0);
+  outb(0x42, (uint8_t)(count & 0xFF));
+  outb(0x42, (uint8_t)(count >> 8));
+  outb(0x61, gate | 0x01u); // rising gate edge starts the count
+}
+
+int pit_oneshot_done(void) {
+  return (inb(0x61) & 0x20u) != 0;
+}
+
+void pit_oneshot_stop(void) {
+  outb(0x61, g_pit_saved_gate);
+}
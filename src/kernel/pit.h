@@ -0,0 +1,15 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+
+#define PIT_HZ 1193182u
+
+// One-shot countdown on PIT channel 2 (gated through port 0x61, so no IRQ
+// is involved). Used as a known time base to calibrate faster clocks.
+// `us` is at most 54925 (a 16-bit count).
+void pit_oneshot_start(uint32_t us);
+int pit_oneshot_done(void);
+void pit_oneshot_stop(void);
+
+#endif
@@ -0,0 +1,332 @@
+#include "pmm.h"
+#include "spinlock.h"
+
+// Per-page state byte: a free block's head carries PMM_FREE | order and an
+// allocated block's head PMM_USED | order; every other page of a block, free
+// or allocated, is PMM_TAIL.
+#define PMM_FREE 0x80
+#define PMM_USED 0x40
+#define PMM_TAIL 0x20
+#define PMM_RESERVED 0xFF
+#define PMM_USABLE 0xFE // only while pmm_init() runs
+
+#define PMM_LOW_LIMIT 0x100000
+
+// Free blocks are linked through their own first page.
+typedef struct PmmBlock {
+  struct PmmBlock *next;
+  struct PmmBlock *prev;
+} PmmBlock;
+
+static uint8_t *g_page_state = 0;
+static uint64_t g_page_count = 0;
+static PmmBlock *g_free_lists[PMM_MAX_ORDER + 1];
+static uint64_t g_free_blocks[PMM_MAX_ORDER + 1];
+static uint64_t g_total_pages = 0;
+static uint64_t g_free_pages = 0;
+static uint64_t g_reclaimed_pages = 0;
+static Spinlock g_pmm_lock;
+
+static int usable_type(uint32_t type) {
+  return type == EFI_CONVENTIONAL_MEMORY || type == EFI_BOOT_SERVICES_CODE ||
+         type == EFI_BOOT_SERVICES_DATA || type == EFI_LOADER_CODE;
+}
+
+static void list_add(uint64_t pfn, uint32_t order) {
+  PmmBlock *b = (PmmBlock *)(uintptr_t)(pfn * PMM_PAGE_SIZE);
+  b->prev = 0;
+  b->next = g_free_lists[order];
+  if (b->next) {
+    b->next->prev = b;
+  }
+  g_free_lists[order] = b;
+  g_free_blocks[order]++;
+  g_page_state[pfn] = PMM_FREE | order;
+}
+
+static void list_remove(uint64_t pfn, uint32_t order) {
+  PmmBlock *b = (PmmBlock *)(uintptr_t)(pfn * PMM_PAGE_SIZE);
+  if (b->prev) {
+    b->prev->next = b->next;
+  } else {
+    g_free_lists[order] = b->next;
+  }
+  if (b->next) {
+    b->next->prev = b->prev;
+  }
+  g_free_blocks[order]--;
+  g_page_state[pfn] = PMM_TAIL;
+}
+
+// Return a block, merging it with its buddy for as long as that is free.
+static void free_block(uint64_t pfn, uint32_t order) {
+  g_free_pages += 1ull << order;
+  g_page_state[pfn] = PMM_TAIL;
+  while (order < PMM_MAX_ORDER) {
+    uint64_t buddy = pfn ^ (1ull << order);
+    if (buddy + (1ull << order) > g_page_count ||
+        g_page_state[buddy] != (PMM_FREE | order)) {
+      break;
+    }
+    list_remove(buddy, order);
+    if (buddy < pfn) {
+      pfn = buddy;
+    }
+    order++;
+  }
+  list_add(pfn, order);
+}
+
+static void reserve_range(uint64_t start, uint64_t end) {
+  uint64_t first = start / PMM_PAGE_SIZE;
+  uint64_t last = (end + PMM_PAGE_SIZE - 1) / PMM_PAGE_SIZE;
+  for (uint64_t pfn = first; pfn < last && pfn < g_page_count; ++pfn) {
+    g_page_state[pfn] = PMM_RESERVED;
+  }
+}
+
+// The firmware's page tables stay live after ExitBootServices() and often
+// sit in boot services data, so every table page reachable from CR3 is
+// kept out of the allocator.
+static void reserve_page_tables(void) {
+  uint64_t cr3;
+  __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+  uint64_t pml4 = cr3 & 0x000FFFFFFFFFF000ull;
+  reserve_range(pml4, pml4 + PMM_PAGE_SIZE);
+  const uint64_t *l4 = (const uint64_t *)(uintptr_t)pml4;
+  for (uint32_t i = 0; i < 512; ++i) {
+    if (!(l4[i] & 1)) {
+      continue;
+    }
+    uint64_t pdpt = l4[i] & 0x000FFFFFFFFFF000ull;
+    reserve_range(pdpt, pdpt + PMM_PAGE_SIZE);
+    const uint64_t *l3 = (const uint64_t *)(uintptr_t)pdpt;
+    for (uint32_t j = 0; j < 512; ++j) {
+      if (!(l3[j] & 1) || (l3[j] & 0x80)) {
+        continue;
+      }
+      uint64_t pd = l3[j] & 0x000FFFFFFFFFF000ull;
+      reserve_range(pd, pd + PMM_PAGE_SIZE);
+      const uint64_t *l2 = (const uint64_t *)(uintptr_t)pd;
+      for (uint32_t k = 0; k < 512; ++k) {
+        if (!(l2[k] & 1) || (l2[k] & 0x80)) {
+          continue;
+        }
+        uint64_t pt = l2[k] & 0x000FFFFFFFFFF000ull;
+        reserve_range(pt, pt + PMM_PAGE_SIZE);
+      }
+    }
+  }
+}
+
+// The firmware's GDT and IDT usually sit in boot services data too, and
+// stay loaded until smp_init() and idt_init() install the kernel's own.
+// Freeing them would let list links (and the console's back buffer) land
+// in live descriptor tables, so their pages are kept; they are a page or
+// two and are never handed out.
+static void reserve_descriptor_tables(void) {
+  struct {
+    uint16_t limit;
+    uint64_t base;
+  } __attribute__((packed)) gdtr, idtr;
+  __asm__ __volatile__("sgdt %0" : "=m"(gdtr));
+  __asm__ __volatile__("sidt %0" : "=m"(idtr));
+  reserve_range(gdtr.base, gdtr.base + gdtr.limit + 1);
+  reserve_range(idtr.base, idtr.base + idtr.limit + 1);
+}
+
+// Free a run of usable pages as the largest naturally aligned blocks.
+static void free_run(uint64_t pfn, uint64_t count) {
+  while (count > 0) {
+    uint32_t order = PMM_MAX_ORDER;
+    while (order > 0 &&
+           ((pfn & ((1ull << order) - 1)) != 0 || (1ull << order) > count)) {
+      order--;
+    }
+    for (uint64_t i = 0; i < (1ull << order); ++i) {
+      g_page_state[pfn + i] = PMM_TAIL;
+    }
+    free_block(pfn, order);
+    pfn += 1ull << order;
+    count -= 1ull << order;
+  }
+}
+
+int pmm_init(const MemoryMap *map) {
+  spin_init(&g_pmm_lock);
+  for (uint32_t i = 0; i <= PMM_MAX_ORDER; ++i) {
+    g_free_lists[i] = 0;
+    g_free_blocks[i] = 0;
+  }
+  g_page_state = 0;
+  g_page_count = 0;
+  g_total_pages = 0;
+  g_free_pages = 0;
+  g_reclaimed_pages = 0;
+  if (!map || map->base == 0 || map->desc_size < sizeof(EfiMemoryDescriptor)) {
+    return 0;
+  }
+  uint64_t entries = map->size / map->desc_size;
+
+  uint64_t top = 0;
+  for (uint64_t i = 0; i < entries; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    uint64_t end = d->phys_start + d->pages * PMM_PAGE_SIZE;
+    if (usable_type(d->type) && end > top) {
+      top = end;
+    }
+  }
+  g_page_count = top / PMM_PAGE_SIZE;
+
+  // The state array comes out of the first conventional range above 1 MiB
+  // that can hold it.
+  uint64_t array_bytes =
+      (g_page_count + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+  uint64_t array_base = 0;
+  for (uint64_t i = 0; i < entries && !array_base; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    uint64_t start = d->phys_start;
+    uint64_t end = start + d->pages * PMM_PAGE_SIZE;
+    if (start < PMM_LOW_LIMIT) {
+      start = PMM_LOW_LIMIT;
+    }
+    if (d->type == EFI_CONVENTIONAL_MEMORY && end > start &&
+        end - start >= array_bytes) {
+      array_base = start;
+    }
+  }
+  if (!array_base) {
+    g_page_count = 0;
+    return 0;
+  }
+  g_page_state = (uint8_t *)(uintptr_t)array_base;
+  for (uint64_t pfn = 0; pfn < g_page_count; ++pfn) {
+    g_page_state[pfn] = PMM_RESERVED;
+  }
+  for (uint64_t i = 0; i < entries; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    if (!usable_type(d->type)) {
+      continue;
+    }
+    uint64_t first = d->phys_start / PMM_PAGE_SIZE;
+    for (uint64_t p = 0; p < d->pages; ++p) {
+      g_page_state[first + p] = PMM_USABLE;
+    }
+  }
+  reserve_range(0, PMM_LOW_LIMIT);
+  reserve_range(array_base, array_base + array_bytes);
+  reserve_page_tables();
+  reserve_descriptor_tables();
+
+  for (uint64_t i = 0; i < entries; ++i) {
+    const EfiMemoryDescriptor *d = memory_map_entry(map, i);
+    if (!usable_type(d->type) || d->type == EFI_CONVENTIONAL_MEMORY) {
+      continue;
+    }
+    uint64_t first = d->phys_start / PMM_PAGE_SIZE;
+    for (uint64_t p = 0; p < d->pages; ++p) {
+      if (g_page_state[first + p] == PMM_USABLE) {
+        g_reclaimed_pages++;
+      }
+    }
+  }
+
+  uint64_t pfn = 0;
+  while (pfn < g_page_count) {
+    if (g_page_state[pfn] != PMM_USABLE) {
+      pfn++;
+      continue;
+    }
+    uint64_t run = pfn;
+    while (run < g_page_count && g_page_state[run] == PMM_USABLE) {
+      run++;
+    }
+    g_total_pages += run - pfn;
+    free_run(pfn, run - pfn);
+    pfn = run;
+  }
+  return g_total_pages != 0;
+}
+
+// First free block of at least `order` that ends at or below `limit`.
+static PmmBlock *find_block(uint32_t order, uint64_t limit, uint32_t *out) {
+  for (uint32_t o = order; o <= PMM_MAX_ORDER; ++o) {
+    for (PmmBlock *b = g_free_lists[o]; b; b = b->next) {
+      if ((uint64_t)(uintptr_t)b + ((uint64_t)PMM_PAGE_SIZE << o) <= limit) {
+        *out = o;
+        return b;
+      }
+    }
+  }
+  return 0;
+}
+
+uint64_t pmm_alloc_pages(uint32_t order) {
+  return pmm_alloc_pages_below(order, ~0ull);
+}
+
+uint64_t pmm_alloc_pages_below(uint32_t order, uint64_t limit) {
+  if (order > PMM_MAX_ORDER) {
+    return 0;
+  }
+  uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+  uint32_t o = 0;
+  PmmBlock *b = find_block(order, limit, &o);
+  if (!b) {
+    spin_unlock_irqrestore(&g_pmm_lock, flags);
+    return 0;
+  }
+  uint64_t pfn = (uint64_t)(uintptr_t)b / PMM_PAGE_SIZE;
+  list_remove(pfn, o);
+  // Split down to the requested size, keeping the lower half each time.
+  while (o > order) {
+    o--;
+    list_add(pfn + (1ull << o), o);
+  }
+  g_page_state[pfn] = PMM_USED | order;
+  g_free_pages -= 1ull << order;
+  spin_unlock_irqrestore(&g_pmm_lock, flags);
+  return pfn * PMM_PAGE_SIZE;
+}
+
+void pmm_free_pages(uint64_t addr, uint32_t order) {
+  uint64_t pfn = addr / PMM_PAGE_SIZE;
+  if (addr == 0 || order > PMM_MAX_ORDER || pfn + (1ull << order) > g_page_count) {
+    return;
+  }
+  uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+  free_block(pfn, order);
+  spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+int pmm_block_order(uint64_t addr) {
+  uint64_t pfn = addr / PMM_PAGE_SIZE;
+  if ((addr & (PMM_PAGE_SIZE - 1)) != 0 || pfn >= g_page_count) {
+    return -1;
+  }
+  uint8_t state = g_page_state[pfn];
+  if (state == PMM_RESERVED || state == PMM_USABLE || (state & PMM_FREE) ||
+      !(state & PMM_USED)) {
+    return -1;
+  }
+  return state & 0x0F;
+}
+
+uint64_t pmm_free_count(void) {
+  return g_free_pages;
+}
+
+uint64_t pmm_total_count(void) {
+  return g_total_pages;
+}
+
+void pmm_get_stats(PmmStats *out) {
+  uint64_t flags = spin_lock_irqsave(&g_pmm_lock);
+  out->total_pages = g_total_pages;
+  out->free_pages = g_free_pages;
+  out->reclaimed_pages = g_reclaimed_pages;
+  for (uint32_t i = 0; i <= PMM_MAX_ORDER; ++i) {
+    out->free_blocks[i] = g_free_blocks[i];
+  }
+  spin_unlock_irqrestore(&g_pmm_lock, flags);
+}
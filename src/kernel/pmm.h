@@ -0,0 +1,49 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include "kernel.h"
+
+#define PMM_PAGE_SIZE 4096
+// Largest block is 2^PMM_MAX_ORDER pages (4 MiB).
+#define PMM_MAX_ORDER 10
+
+typedef struct {
+  uint64_t total_pages; // pages handed to the allocator
+  uint64_t free_pages;
+  uint64_t reclaimed_pages; // of those, boot services and loader code
+  uint64_t free_blocks[PMM_MAX_ORDER + 1];
+} PmmStats;
+
+// Build the buddy allocator from the loader's memory map. Conventional
+// memory, boot services code/data and the loader's code become free pages;
+// loader data (kernel image, stacks, trampoline, this map), the first MiB,
+// the live page tables, the loaded GDT and IDT, and anything firmware-owned
+// stay reserved.
+int pmm_init(const MemoryMap *map);
+
+// 2^order physically contiguous pages, aligned to their size. Returns the
+// physical (= virtual) address, or 0 when no block is large enough.
+uint64_t pmm_alloc_pages(uint32_t order);
+// Same, but the whole block lies below `limit` (for devices that only
+// address part of memory).
+uint64_t pmm_alloc_pages_below(uint32_t order, uint64_t limit);
+void pmm_free_pages(uint64_t addr, uint32_t order);
+
+static inline uint64_t pmm_alloc_page(void) {
+  return pmm_alloc_pages(0);
+}
+
+static inline void pmm_free_page(uint64_t addr) {
+  pmm_free_pages(addr, 0);
+}
+
+// Order of the allocated block starting at addr, or -1 if addr is not the
+// start of one.
+int pmm_block_order(uint64_t addr);
+
+uint64_t pmm_free_count(void);
+uint64_t pmm_total_count(void);
+void pmm_get_stats(PmmStats *out);
+
+#endif
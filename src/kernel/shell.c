@@ -1,8 +1,18 @@
 #include "shell.h"
 #include "console.h"
 #include "keyboard.h"
+#include "kprintf.h"
 #include "kernel.h"
 #include "font.h"
+#include "time.h"
+#include "smp.h"
+#include "task.h"
+#include "thread.h"
+#include "pmm.h"
+#include "paging.h"
+#include "heap.h"
+#include "dma.h"
+#include "drivers/pci.h"
 #include "drivers/xhci.h"
 #include "drivers/ahci.h"
 #include "drivers/nvme.h"
@@ -10,28 +20,8 @@
 #include "fs/fat32.h"
 #include <stdint.h>
 
-static void u32_to_str(uint32_t v, char *out)
-{
-  char buf[11];
-  int i = 0;
-  if (v == 0)
-  {
-    out[0] = '0';
-    out[1] = 0;
-    return;
-  }
-  while (v > 0 && i < 10)
-  {
-    buf[i++] = (char)('0' + (v % 10));
-    v /= 10;
-  }
-  int j = 0;
-  while (i > 0)
-  {
-    out[j++] = buf[--i];
-  }
-  out[j] = 0;
-}
+// Largest part of a file that cat prints.
+#define SHELL_CAT_MAX (64 * 1024)
 
 static int streq(const char *a, const char *b)
 {
@@ -47,16 +37,298 @@ static int streq(const char *a, const char *b)
   return *a == *b;
 }
 
+static int str_to_u32(const char *s, uint32_t *out)
+{
+  uint32_t v = 0;
+  if (*s == 0)
+  {
+    return 0;
+  }
+  while (*s)
+  {
+    if (*s < '0' || *s > '9')
+    {
+      return 0;
+    }
+    v = v * 10 + (uint32_t)(*s - '0');
+    s++;
+  }
+  *out = v;
+  return 1;
+}
+
 static void print_info(void)
 {
-  char num[12];
-  console_write("fb: ");
-  u32_to_str(g_boot_info.fb.width, num);
-  console_write(num);
-  console_write("x");
-  u32_to_str(g_boot_info.fb.height, num);
-  console_write(num);
+  kprintf("fb: %ux%u\n", g_boot_info.fb.width, g_boot_info.fb.height);
+  kprintf("pci: %u functions, config via %s\n", pci_device_count(),
+          pci_ecam_enabled() ? "ECAM" : "port I/O");
+  kprintf("clock: TSC %lu MHz, uptime %llu ms\n", time_tsc_hz() / 1000000,
+          ktime_now() / KTIME_MS);
+}
+
+static void print_cache_stats(void)
+{
+  BlockCacheStats st;
+  block_cache_get_stats(&st);
+  kprintf("cache: %u/%u sectors, pinned %u\n", st.used, st.capacity,
+          st.pinned);
+  kprintf("hits %lu misses %lu evictions %lu\n", st.hits, st.misses,
+          st.evictions);
+}
+
+static volatile uint32_t g_cpu_reply[SMP_MAX_CPUS];
+
+static void cpu_reply(void *arg)
+{
+  PerCpu *cpu = this_cpu();
+  g_cpu_reply[cpu->index] = cpu->apic_id + 1;
+}
+
+// Ask every CPU to report its APIC id through smp_call().
+static void print_cpus(void)
+{
+  uint32_t count = smp_cpu_count();
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    g_cpu_reply[i] = 0;
+    smp_call(i, cpu_reply, 0);
+  }
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    smp_wait(i);
+    PerCpu *cpu = smp_cpu(i);
+    kprintf("cpu %u: apic %u, calls %lu%s\n", i, cpu->apic_id, cpu->calls,
+            g_cpu_reply[i] == cpu->apic_id + 1 ? "" : ", no reply");
+  }
+}
+
+#define BENCH_ITEMS 4096
+
+static uint64_t g_bench_sums[BENCH_ITEMS];
+
+// Fixed integer work per item, so the timing does not depend on memory
+// bandwidth.
+static void bench_body(uint32_t begin, uint32_t end, void *arg)
+{
+  for (uint32_t i = begin; i < end; ++i)
+  {
+    uint64_t h = 0xCBF29CE484222325ull ^ i;
+    for (uint32_t k = 0; k < 4096; ++k)
+    {
+      h ^= k;
+      h *= 0x100000001B3ull;
+    }
+    g_bench_sums[i] = h;
+  }
+}
+
+// Time the same task_parallel_for() with 1, 2, 4, ... CPUs in the pool.
+static void run_task_bench(void)
+{
+  uint32_t online = smp_cpu_count();
+  uint64_t base_ns = 0;
+  for (uint32_t n = 1;; n *= 2)
+  {
+    if (n > online)
+    {
+      n = online;
+    }
+    task_set_workers(n);
+    uint64_t start = ktime_now();
+    task_parallel_for(0, BENCH_ITEMS, 16, bench_body, 0);
+    uint64_t ns = ktime_now() - start;
+    if (ns == 0)
+    {
+      ns = 1;
+    }
+    if (n == 1)
+    {
+      base_ns = ns;
+    }
+    uint64_t speedup = base_ns * 100 / ns;
+    kprintf("%u cpus: %llu us, speedup %lu.%02lux\n", n, ns / KTIME_US,
+            speedup / 100, speedup % 100);
+    if (n == online)
+    {
+      break;
+    }
+  }
+  task_set_workers(online);
+}
+
+#define FB_BENCH_FILLS 16
+#define FB_BENCH_SCROLLS 4
+#define FB_BENCH_LINE 16
+
+typedef struct
+{
+  uint64_t fill_ns;
+  uint64_t scroll_ns;
+} FbBenchResult;
+
+// Full-screen fills (stores only) and console-style scrolls (each row read
+// back and written FB_BENCH_LINE rows higher) straight to the framebuffer.
+static void fb_bench_run(FbBenchResult *out)
+{
+  FrameBuffer *fb = &g_boot_info.fb;
+  uint32_t *pixels = (uint32_t *)fb->base;
+  uint32_t stride = fb->pixels_per_scanline;
+  uint64_t start = ktime_now();
+  for (uint32_t f = 0; f < FB_BENCH_FILLS; ++f)
+  {
+    uint32_t color = (f & 1) ? 0x00202040u : 0x00402020u;
+    for (uint32_t y = 0; y < fb->height; ++y)
+    {
+      uint32_t *row = pixels + (uint64_t)y * stride;
+      for (uint32_t x = 0; x < fb->width; ++x)
+      {
+        row[x] = color;
+      }
+    }
+  }
+  out->fill_ns = ktime_now() - start;
+  start = ktime_now();
+  for (uint32_t f = 0; f < FB_BENCH_SCROLLS; ++f)
+  {
+    for (uint32_t y = 0; y + FB_BENCH_LINE < fb->height; ++y)
+    {
+      uint32_t *dst = pixels + (uint64_t)y * stride;
+      const uint32_t *src = dst + (uint64_t)FB_BENCH_LINE * stride;
+      for (uint32_t x = 0; x < fb->width; ++x)
+      {
+        dst[x] = src[x];
+      }
+    }
+  }
+  out->scroll_ns = ktime_now() - start;
+}
+
+static void print_fb_rate(const char *label, uint64_t bytes, uint64_t ns)
+{
+  if (ns == 0)
+  {
+    ns = 1;
+  }
+  kprintf("%s%lu MB/s (%llu us)", label, bytes * 1000 / ns, ns / KTIME_US);
+}
+
+// Run the framebuffer benchmark with the write-combining mapping and again
+// with the range remapped uncached, as it was before PAT was programmed.
+static void run_fb_bench(void)
+{
+  FrameBuffer *fb = &g_boot_info.fb;
+  uint64_t base = (uint64_t)(uintptr_t)fb->base;
+  FbBenchResult wc, uc;
+  console_suspend();
+  fb_bench_run(&wc);
+  paging_map(base, base, fb->size, PAGING_WRITE | PAGING_CACHE_UC);
+  fb_bench_run(&uc);
+  paging_map(base, base, fb->size, PAGING_WRITE | PAGING_CACHE_WC);
+  console_clear();
+  console_resume();
+
+  uint64_t fill_bytes = (uint64_t)fb->width * fb->height * 4 * FB_BENCH_FILLS;
+  uint64_t scroll_bytes = (uint64_t)fb->width * (fb->height - FB_BENCH_LINE) *
+                          4 * FB_BENCH_SCROLLS;
+  print_fb_rate("fill:   wc ", fill_bytes, wc.fill_ns);
+  print_fb_rate(", uc ", fill_bytes, uc.fill_ns);
   console_write_line("");
+  print_fb_rate("scroll: wc ", scroll_bytes, wc.scroll_ns);
+  print_fb_rate(", uc ", scroll_bytes, uc.scroll_ns);
+  console_write_line("");
+  if (!(paging_features() & PAGING_PAT))
+  {
+    console_write_line("no PAT: the wc run was uncached too");
+  }
+}
+
+#define GLYPH_BENCH_COUNT 200000
+
+static void run_glyph_bench(void)
+{
+  uint64_t ns = console_glyph_bench(GLYPH_BENCH_COUNT);
+  if (ns == 0)
+  {
+    ns = 1;
+  }
+  kprintf("%u glyphs in %llu us: %llu glyphs/s\n", GLYPH_BENCH_COUNT,
+          ns / KTIME_US, GLYPH_BENCH_COUNT * KTIME_SEC / ns);
+}
+
+static void print_memory(void)
+{
+  PmmStats st;
+  pmm_get_stats(&st);
+  kprintf("pages: %lu free, %lu used, %lu MiB managed\n", st.free_pages,
+          st.total_pages - st.free_pages,
+          st.total_pages * PMM_PAGE_SIZE / (1024 * 1024));
+  kprintf("reclaimed from boot services: %lu pages\n", st.reclaimed_pages);
+  kprintf("dma: %lu bytes\n", dma_bytes_in_use());
+  console_write("free blocks by order:");
+  for (uint32_t i = 0; i <= PMM_MAX_ORDER; ++i)
+  {
+    kprintf(" %lu", st.free_blocks[i]);
+  }
+  console_write_line("");
+  PagingStats ps;
+  paging_get_stats(&ps);
+  kprintf("page tables: %lu x 1G, %lu x 2M, %lu x 4K in %lu tables;",
+          ps.pages_1g, ps.pages_2m, ps.pages_4k, ps.table_pages);
+  if (ps.features & PAGING_GLOBAL)
+  {
+    console_write(" global");
+  }
+  if (ps.features & PAGING_PCID)
+  {
+    console_write(" pcid");
+  }
+  if (ps.features & PAGING_PAT)
+  {
+    console_write(" pat");
+  }
+  console_write_line("");
+}
+
+static void print_heap(void)
+{
+  HeapStats st;
+  heap_get_stats(&st);
+  uint64_t waste = 0;
+  if (st.slab_bytes)
+  {
+    waste = (st.slab_bytes - st.small_bytes) * 100 / st.slab_bytes;
+  }
+  kprintf("heap: %lu bytes in use (%lu in page runs), slabs %lu bytes, "
+          "%lu%% unused\n",
+          st.small_bytes + st.large_bytes, st.large_bytes, st.slab_bytes,
+          waste);
+  for (uint32_t i = 0; i < HEAP_CLASSES; ++i)
+  {
+    const HeapClassStats *c = &st.classes[i];
+    if (c->hits + c->misses == 0)
+    {
+      continue;
+    }
+    kprintf("%u: in use %lu, cached %lu, slabs %lu, hit rate %lu%%\n",
+            c->size, c->in_use, c->cached, c->slabs,
+            c->hits * 100 / (c->hits + c->misses));
+  }
+}
+
+static void print_threads(void)
+{
+  static const char *states[] = {"ready", "running", "blocked", "sleeping"};
+  Thread t;
+  for (uint32_t i = 0; i < THREAD_MAX; ++i)
+  {
+    if (!thread_get(i, &t))
+    {
+      continue;
+    }
+    kprintf("%u %s %s run %llu ms, switches %lu, preempted %lu\n", t.id,
+            t.name, states[t.state], t.run_ns / KTIME_MS, t.switches,
+            t.preemptions);
+  }
 }
 
 static void reboot(void)
@@ -232,51 +504,60 @@ static void project_point(float x, float y, float z,
   *depth = 1.0f / pz;
 }
 
-static void render_heart_3d(void)
+// One projected point of the heart surface; x < 0 if it fell off screen.
+typedef struct
 {
-  FrameBuffer *fb = &g_boot_info.fb;
-  if (!fb || !fb->base)
-  {
-    console_write_line("no framebuffer");
-    return;
-  }
+  int16_t x;
+  int16_t y;
+  float depth;
+  uint32_t color;
+} HeartSample;
 
-  const int W = 320;
-  const int H = 200;
-  static float zbuf[W * H];
-  static uint32_t cbuf[W * H];
+typedef struct
+{
+  FrameBuffer *fb;
+  float *zbuf;
+  uint32_t *cbuf;
+  uint32_t bg;
+  HeartSample *samples; // nt * nu, t-major
+  uint32_t nt;
+  uint32_t nu;
+  float t_step;
+  float u_step;
+  float lx, ly, lz;
+  float cx, sx, cy, sy;
+} HeartBuffers;
 
-  uint32_t bg = make_pixel(0x0D, 0x0A, 0x12, fb->pixel_format);
-  for (int i = 0; i < W * H; ++i)
+// Rows of the 320x200 scene buffers to reset; runs on any CPU in the pool.
+static void heart_clear_rows(uint32_t begin, uint32_t end, void *arg)
+{
+  const HeartBuffers *b = (const HeartBuffers *)arg;
+  const uint32_t W = 320;
+  for (uint32_t i = begin * W; i < end * W; ++i)
   {
-    zbuf[i] = -1e9f;
-    cbuf[i] = bg;
+    b->zbuf[i] = -1e9f;
+    b->cbuf[i] = b->bg;
   }
+}
 
-  // Lighting
-  float lx = -0.3f, ly = 0.5f, lz = 0.8f;
-  float l_len2 = lx * lx + ly * ly + lz * lz;
-  float l_inv = fast_inv_sqrt(l_len2);
-  lx *= l_inv;
-  ly *= l_inv;
-  lz *= l_inv;
-
-  // Rotation (front-facing for a clearer heart silhouette)
-  float ay = 0.25f;
-  float ax = -0.15f;
-  float cy = fast_cos(ay), sy = fast_sin(ay);
-  float cx = fast_cos(ax), sx = fast_sin(ax);
-
-  const float PI = 3.14159265f;
-  float t_step = 0.05f;
-  float u_step = 0.12f;
+// Sample, light and project the surface for t steps [begin, end).
+static void heart_sample_cols(uint32_t begin, uint32_t end, void *arg)
+{
+  const HeartBuffers *b = (const HeartBuffers *)arg;
+  const int W = 320;
+  const int H = 200;
   float dt = 0.01f;
   float du = 0.01f;
 
-  for (float t = 0.0f; t < PI * 2.0f; t += t_step)
+  for (uint32_t i = begin; i < end; ++i)
   {
-    for (float u = 0.0f; u < PI; u += u_step)
+    float t = (float)i * b->t_step;
+    for (uint32_t j = 0; j < b->nu; ++j)
     {
+      float u = (float)j * b->u_step;
+      HeartSample *out = &b->samples[i * b->nu + j];
+      out->x = -1;
+
       float x, y, z;
       heart_point(t, u, &x, &y, &z);
 
@@ -299,19 +580,19 @@ static void render_heart_3d(void)
       }
 
       // Rotate point and normal
-      float xr = x * cy + z * sy;
-      float zr = -x * sy + z * cy;
+      float xr = x * b->cy + z * b->sy;
+      float zr = -x * b->sy + z * b->cy;
       float yr = y;
 
-      float y2r = yr * cx - zr * sx;
-      float z2r = yr * sx + zr * cx;
+      float y2r = yr * b->cx - zr * b->sx;
+      float z2r = yr * b->sx + zr * b->cx;
       float x2r = xr;
 
-      float nxr = nx * cy + nz * sy;
-      float nzr = -nx * sy + nz * cy;
+      float nxr = nx * b->cy + nz * b->sy;
+      float nzr = -nx * b->sy + nz * b->cy;
       float nyr = ny;
-      float ny2r = nyr * cx - nzr * sx;
-      float nz2r = nyr * sx + nzr * cx;
+      float ny2r = nyr * b->cx - nzr * b->sx;
+      float nz2r = nyr * b->sx + nzr * b->cx;
       float nx2r = nxr;
 
       // Perspective projection
@@ -332,37 +613,130 @@ static void render_heart_3d(void)
         continue;
       }
 
-      float depth = 1.0f / pz;
-      int idx = syp * W + sxp;
-      if (depth <= zbuf[idx])
-      {
-        continue;
-      }
-      zbuf[idx] = depth;
-
-      float diff = nx2r * lx + ny2r * ly + nz2r * lz;
+      float diff = nx2r * b->lx + ny2r * b->ly + nz2r * b->lz;
       if (diff < 0.0f)
         diff = 0.0f;
       float shade = 0.25f + 0.75f * diff;
 
       uint8_t r = (uint8_t)(210.0f * shade + 25.0f);
       uint8_t g = (uint8_t)(20.0f * shade + 5.0f);
-      uint8_t b = (uint8_t)(60.0f * shade + 10.0f);
-      cbuf[idx] = make_pixel(r, g, b, fb->pixel_format);
+      uint8_t bl = (uint8_t)(60.0f * shade + 10.0f);
+      out->x = (int16_t)sxp;
+      out->y = (int16_t)syp;
+      out->depth = 1.0f / pz;
+      out->color = make_pixel(r, g, bl, b->fb->pixel_format);
     }
   }
+}
 
-  // Blit to framebuffer (nearest neighbor scaling)
-  for (uint32_t y = 0; y < fb->height; ++y)
+// Depth-test the samples that land in scene rows [begin, end). Each band
+// owns those rows of zbuf and cbuf, and walks the samples in order, so the
+// result matches a serial pass.
+static void heart_shade_rows(uint32_t begin, uint32_t end, void *arg)
+{
+  const HeartBuffers *b = (const HeartBuffers *)arg;
+  const uint32_t W = 320;
+  uint32_t count = b->nt * b->nu;
+  for (uint32_t i = 0; i < count; ++i)
   {
-    uint32_t sy = (uint32_t)((y * (uint32_t)H) / fb->height);
+    const HeartSample *s = &b->samples[i];
+    if (s->x < 0 || (uint32_t)s->y < begin || (uint32_t)s->y >= end)
+    {
+      continue;
+    }
+    uint32_t idx = (uint32_t)s->y * W + (uint32_t)s->x;
+    if (s->depth <= b->zbuf[idx])
+    {
+      continue;
+    }
+    b->zbuf[idx] = s->depth;
+    b->cbuf[idx] = s->color;
+  }
+}
+
+// Framebuffer rows to fill from the scene buffer.
+static void heart_blit_rows(uint32_t begin, uint32_t end, void *arg)
+{
+  const HeartBuffers *b = (const HeartBuffers *)arg;
+  FrameBuffer *fb = b->fb;
+  const uint32_t W = 320;
+  const uint32_t H = 200;
+  for (uint32_t y = begin; y < end; ++y)
+  {
+    uint32_t sy = (y * H) / fb->height;
     uint32_t row = y * fb->pixels_per_scanline;
     for (uint32_t x = 0; x < fb->width; ++x)
     {
-      uint32_t sx = (uint32_t)((x * (uint32_t)W) / fb->width);
-      ((uint32_t *)fb->base)[row + x] = cbuf[sy * W + sx];
+      uint32_t sx = (x * W) / fb->width;
+      ((uint32_t *)fb->base)[row + x] = b->cbuf[sy * W + sx];
     }
   }
+}
+
+static void render_heart_3d(void)
+{
+  FrameBuffer *fb = &g_boot_info.fb;
+  if (!fb || !fb->base)
+  {
+    console_write_line("no framebuffer");
+    return;
+  }
+
+  const int W = 320;
+  const int H = 200;
+  const float PI = 3.14159265f;
+  HeartBuffers bufs;
+  bufs.fb = fb;
+  bufs.t_step = 0.05f;
+  bufs.u_step = 0.12f;
+  bufs.nt = 0;
+  while ((float)bufs.nt * bufs.t_step < PI * 2.0f)
+    ++bufs.nt;
+  bufs.nu = 0;
+  while ((float)bufs.nu * bufs.u_step < PI)
+    ++bufs.nu;
+
+  float *zbuf = (float *)kmalloc(W * H * sizeof(float));
+  uint32_t *cbuf = (uint32_t *)kmalloc(W * H * sizeof(uint32_t));
+  HeartSample *samples =
+      (HeartSample *)kmalloc(bufs.nt * bufs.nu * sizeof(HeartSample));
+  if (!zbuf || !cbuf || !samples)
+  {
+    kfree(zbuf);
+    kfree(cbuf);
+    kfree(samples);
+    console_write_line("out of memory");
+    return;
+  }
+
+  uint32_t bg = make_pixel(0x0D, 0x0A, 0x12, fb->pixel_format);
+  bufs.zbuf = zbuf;
+  bufs.cbuf = cbuf;
+  bufs.bg = bg;
+  bufs.samples = samples;
+  task_parallel_for(0, H, 8, heart_clear_rows, &bufs);
+
+  // Lighting
+  float lx = -0.3f, ly = 0.5f, lz = 0.8f;
+  float l_len2 = lx * lx + ly * ly + lz * lz;
+  float l_inv = fast_inv_sqrt(l_len2);
+  bufs.lx = lx * l_inv;
+  bufs.ly = ly * l_inv;
+  bufs.lz = lz * l_inv;
+
+  // Rotation (front-facing for a clearer heart silhouette)
+  float ay = 0.25f;
+  float ax = -0.15f;
+  bufs.cy = fast_cos(ay);
+  bufs.sy = fast_sin(ay);
+  bufs.cx = fast_cos(ax);
+  bufs.sx = fast_sin(ax);
+
+  task_parallel_for(0, bufs.nt, 4, heart_sample_cols, &bufs);
+  task_parallel_for(0, H, 8, heart_shade_rows, &bufs);
+
+  // Blit to framebuffer (nearest neighbor scaling)
+  task_parallel_for(0, fb->height, 32, heart_blit_rows, &bufs);
 
   const char *left = "I";
   const char *right = "YOU";
@@ -380,14 +754,19 @@ static void render_heart_3d(void)
     draw_text_at(fb, tx_left, ty, left, red, bg);
     draw_text_at(fb, tx_right, ty, right, red, bg);
   }
+  kfree(zbuf);
+  kfree(cbuf);
+  kfree(samples);
 }
 
 static void draw_heart_scene(void)
 {
+  console_suspend();
   render_heart_3d();
+  console_resume();
 }
 
-static void exec_command(char *line)
+static void run_command(char *line)
 {
   if (line[0] == 0)
   {
@@ -395,7 +774,8 @@ static void exec_command(char *line)
   }
   if (streq(line, "help"))
   {
-    console_write_line("commands: help clear echo info reboot mount ls cat");
+    console_write_line("commands: help clear echo info mem heap cpus bench fbbench glyphbench ps reboot mount ls cat cache");
+    console_write_line("end a command with & to run it in the background");
     return;
   }
   if (streq(line, "clear"))
@@ -422,6 +802,41 @@ static void exec_command(char *line)
     fat32_print_info();
     return;
   }
+  if (streq(line, "cpus"))
+  {
+    print_cpus();
+    return;
+  }
+  if (streq(line, "mem"))
+  {
+    print_memory();
+    return;
+  }
+  if (streq(line, "heap"))
+  {
+    print_heap();
+    return;
+  }
+  if (streq(line, "ps"))
+  {
+    print_threads();
+    return;
+  }
+  if (streq(line, "bench"))
+  {
+    run_task_bench();
+    return;
+  }
+  if (streq(line, "fbbench"))
+  {
+    run_fb_bench();
+    return;
+  }
+  if (streq(line, "glyphbench"))
+  {
+    run_glyph_bench();
+    return;
+  }
   if (streq(line, "mount"))
   {
     if (fat32_mount())
@@ -460,14 +875,20 @@ static void exec_command(char *line)
       console_write_line("FAT32 mount failed");
       return;
     }
-    static uint8_t buf[4096];
+    uint8_t *buf = (uint8_t *)kmalloc(SHELL_CAT_MAX);
+    if (!buf)
+    {
+      console_write_line("out of memory");
+      return;
+    }
     uint32_t out_size = 0;
-    if (!fat32_read_file(&line[4], buf, sizeof(buf), &out_size))
+    if (!fat32_read_file(&line[4], buf, SHELL_CAT_MAX, &out_size))
     {
+      kfree(buf);
       console_write_line("cat failed");
       return;
     }
-    for (uint32_t i = 0; i < out_size && i < sizeof(buf); ++i)
+    for (uint32_t i = 0; i < out_size && i < SHELL_CAT_MAX; ++i)
     {
       char c = (char)buf[i];
       if (c == 0)
@@ -475,6 +896,22 @@ static void exec_command(char *line)
       console_putc(c);
     }
     console_putc('\n');
+    kfree(buf);
+    return;
+  }
+  if (line[0] == 'c' && line[1] == 'a' && line[2] == 'c' && line[3] == 'h' &&
+      line[4] == 'e' && (line[5] == ' ' || line[5] == 0))
+  {
+    if (line[5] == ' ')
+    {
+      uint32_t entries = 0;
+      if (!str_to_u32(&line[6], &entries) || !block_cache_set_size(entries))
+      {
+        console_write_line("usage: cache [ENTRIES]");
+        return;
+      }
+    }
+    print_cache_stats();
     return;
   }
   if (streq(line, "reboot"))
@@ -504,16 +941,94 @@ static void exec_command(char *line)
   console_write_line(line);
 }
 
+#define SHELL_JOBS 4
+
+// The block layer and FAT32 driver expect one caller at a time.
+static Mutex g_disk_lock;
+static char g_job_lines[SHELL_JOBS][128];
+static volatile uint32_t g_job_busy[SHELL_JOBS];
+
+static int is_word(const char *line, const char *word)
+{
+  while (*word)
+  {
+    if (*line++ != *word++)
+    {
+      return 0;
+    }
+  }
+  return *line == 0 || *line == ' ';
+}
+
+static void exec_command(char *line)
+{
+  if (is_word(line, "mount") || is_word(line, "ls") || is_word(line, "cat") ||
+      is_word(line, "cache"))
+  {
+    mutex_lock(&g_disk_lock);
+    run_command(line);
+    mutex_unlock(&g_disk_lock);
+    return;
+  }
+  run_command(line);
+}
+
+static void job_main(void *arg)
+{
+  uint32_t slot = (uint32_t)(uintptr_t)arg;
+  exec_command(g_job_lines[slot]);
+  g_job_busy[slot] = 0;
+}
+
+// Run `line` (with its trailing " &" already cut off) on its own thread.
+static void start_job(const char *line)
+{
+  for (uint32_t i = 0; i < SHELL_JOBS; ++i)
+  {
+    if (g_job_busy[i])
+    {
+      continue;
+    }
+    uint32_t n = 0;
+    while (line[n] && n + 1 < sizeof(g_job_lines[i]))
+    {
+      g_job_lines[i][n] = line[n];
+      n++;
+    }
+    g_job_lines[i][n] = 0;
+    g_job_busy[i] = 1;
+    if (!thread_create(g_job_lines[i], job_main, (void *)(uintptr_t)i))
+    {
+      g_job_busy[i] = 0;
+      break;
+    }
+    kprintf("started job %u\n", i);
+    return;
+  }
+  console_write_line("no free job slot");
+}
+
 void shell_run(void)
 {
   char line[128];
+  mutex_init(&g_disk_lock);
+  for (uint32_t i = 0; i < SHELL_JOBS; ++i)
+  {
+    g_job_busy[i] = 0;
+  }
   for (;;)
   {
     console_write("> ");
     uint32_t idx = 0;
     for (;;)
     {
+      console_flush();
       char c = keyboard_getchar();
+      if (c == KEY_PAGE_UP || c == KEY_PAGE_DOWN)
+      {
+        console_scroll_view(c == KEY_PAGE_UP ? 10 : -10);
+        continue;
+      }
       if (c == '\n')
       {
         console_putc('\n');
@@ -537,6 +1052,12 @@ void shell_run(void)
         console_putc(c);
       }
     }
+    if (idx >= 2 && line[idx - 1] == '&' && line[idx - 2] == ' ')
+    {
+      line[idx - 2] = 0;
+      start_job(line);
+      continue;
+    }
     exec_command(line);
   }
 }
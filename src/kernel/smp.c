@@ -0,0 +1,298 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "idt.h"
+#include "paging.h"
+#include "time.h"
+
+#define MSR_EFER 0xC0000080
+#define MSR_GS_BASE 0xC0000101
+#define EFER_SCE (1u << 0)
+#define EFER_LME (1u << 8)
+#define EFER_NXE (1u << 11)
+
+// Double faults run on their own stack so a blown kernel stack still
+// reaches exception_panic().
+#define SMP_DOUBLE_FAULT_IST 1
+
+// Patched copy of the data block at the end of smp_trampoline.S.
+typedef struct {
+  uint64_t gdt[4];
+  uint16_t gdt_limit;
+  uint32_t gdt_base;
+  uint32_t pm_offset;
+  uint16_t pm_selector;
+  uint32_t lm_offset;
+  uint16_t lm_selector;
+  uint32_t pml4;
+  uint32_t efer;
+  uint64_t cr3;
+  uint64_t cr4;
+  uint64_t cr0;
+  uint64_t stack;
+  uint64_t arg;
+  uint64_t entry;
+} __attribute__((packed)) SmpTrampolineData;
+
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_end[];
+extern uint8_t smp_trampoline_pm[];
+extern uint8_t smp_trampoline_lm[];
+extern uint8_t smp_trampoline_data[];
+
+static PerCpu g_cpus[SMP_MAX_CPUS];
+static uint32_t g_cpu_count = 0;
+static int g_call_vector = -1;
+// The BSP keeps the stack it was booted on.
+static uint8_t g_stacks[SMP_MAX_CPUS - 1][SMP_STACK_SIZE]
+    __attribute__((aligned(16)));
+static uint8_t g_ist_stacks[SMP_MAX_CPUS][SMP_IST_STACK_SIZE]
+    __attribute__((aligned(16)));
+
+static uint64_t read_cr0(void) {
+  uint64_t v;
+  __asm__ __volatile__("mov %%cr0, %0" : "=r"(v));
+  return v;
+}
+
+static uint64_t read_cr3(void) {
+  uint64_t v;
+  __asm__ __volatile__("mov %%cr3, %0" : "=r"(v));
+  return v;
+}
+
+static uint64_t read_cr4(void) {
+  uint64_t v;
+  __asm__ __volatile__("mov %%cr4, %0" : "=r"(v));
+  return v;
+}
+
+static void percpu_setup(PerCpu *c, uint32_t index, uint32_t apic_id) {
+  c->self = c;
+  c->index = index;
+  c->apic_id = apic_id;
+  c->online = 0;
+  c->call_busy = 0;
+  c->call_fn = 0;
+  c->call_arg = 0;
+  c->calls = 0;
+
+  uint8_t *t = (uint8_t *)&c->tss;
+  for (uint32_t i = 0; i < sizeof(Tss); ++i) {
+    t[i] = 0;
+  }
+  c->tss.iomap_base = sizeof(Tss);
+  c->tss.ist[SMP_DOUBLE_FAULT_IST - 1] =
+      (uint64_t)(uintptr_t)(g_ist_stacks[index] + SMP_IST_STACK_SIZE);
+
+  uint64_t base = (uint64_t)(uintptr_t)&c->tss;
+  uint64_t limit = sizeof(Tss) - 1;
+  c->gdt[0] = 0;
+  c->gdt[1] = 0x00AF9A000000FFFFull; // 64-bit code
+  c->gdt[2] = 0x00CF92000000FFFFull; // data
+  c->gdt[3] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) |
+              (0x89ull << 40) | (((limit >> 16) & 0xF) << 48) |
+              (((base >> 24) & 0xFF) << 56); // available 64-bit TSS
+  c->gdt[4] = base >> 32;
+}
+
+// Switch the calling CPU to c's GDT and TSS and point GS at c.
+static void percpu_load(PerCpu *c) {
+  struct {
+    uint16_t limit;
+    uint64_t base;
+  } __attribute__((packed)) ptr;
+  ptr.limit = sizeof(c->gdt) - 1;
+  ptr.base = (uint64_t)(uintptr_t)c->gdt;
+  __asm__ __volatile__("lgdt %0\n"
+                       "pushq %1\n"
+                       "leaq 1f(%%rip), %%rax\n"
+                       "pushq %%rax\n"
+                       "lretq\n"
+                       "1:\n"
+                       "mov %w2, %%ds\n"
+                       "mov %w2, %%es\n"
+                       "mov %w2, %%ss\n"
+                       "mov %w2, %%fs\n"
+                       "mov %w2, %%gs\n"
+                       "ltr %w3\n"
+                       :
+                       : "m"(ptr), "i"(SMP_KERNEL_CS), "r"(SMP_KERNEL_DS),
+                         "r"(SMP_TSS_SEL)
+                       : "rax", "memory");
+  // Loading %gs cleared the base, so this has to come last.
+  wrmsr(MSR_GS_BASE, (uint64_t)(uintptr_t)c);
+}
+
+int smp_init(void) {
+  g_cpu_count = 1;
+  g_call_vector = -1;
+  percpu_setup(&g_cpus[0], 0, 0);
+  percpu_load(&g_cpus[0]);
+  return 1;
+}
+
+// Nothing to do: the IPI only has to wake the target out of hlt.
+static void smp_call_irq(InterruptFrame *frame, void *ctx) {
+}
+
+static void ap_entry(PerCpu *c) {
+  percpu_load(c);
+  paging_load_pat();
+  idt_load();
+  lapic_enable();
+  __atomic_store_n(&c->online, 1, __ATOMIC_RELEASE);
+  for (;;) {
+    irq_disable();
+    SmpFn fn = __atomic_load_n(&c->call_fn, __ATOMIC_ACQUIRE);
+    if (!fn) {
+      irq_wait();
+      continue;
+    }
+    irq_enable();
+    void *arg = c->call_arg;
+    c->call_fn = 0;
+    fn(arg);
+    c->calls++;
+    __atomic_store_n(&c->call_busy, 0, __ATOMIC_RELEASE);
+  }
+}
+
+// INIT-SIPI-SIPI. The second SIPI is only sent if the AP has not come up
+// after the first one.
+static int ap_start(PerCpu *c, uint64_t trampoline) {
+  uint32_t sipi = LAPIC_IPI_STARTUP | (uint32_t)(trampoline >> 12);
+  if (!lapic_send_ipi(c->apic_id, LAPIC_IPI_INIT)) {
+    return 0;
+  }
+  ktime_delay(10 * KTIME_MS);
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    if (!lapic_send_ipi(c->apic_id, sipi)) {
+      return 0;
+    }
+    uint64_t deadline =
+        ktime_deadline(attempt == 0 ? 1 * KTIME_MS : 100 * KTIME_MS);
+    while (!__atomic_load_n(&c->online, __ATOMIC_ACQUIRE)) {
+      if (ktime_expired(deadline)) {
+        break;
+      }
+      cpu_relax();
+    }
+    if (c->online) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+uint32_t smp_start_aps(uint64_t trampoline) {
+  PerCpu *bsp = &g_cpus[0];
+  bsp->apic_id = lapic_id();
+  bsp->online = 1;
+  idt_set_ist(8, SMP_DOUBLE_FAULT_IST);
+
+  uint32_t size = (uint32_t)(smp_trampoline_end - smp_trampoline_start);
+  if (trampoline == 0 || size > 0x1000) {
+    return g_cpu_count;
+  }
+  if (g_call_vector < 0) {
+    g_call_vector = irq_alloc_vector(smp_call_irq, 0);
+    if (g_call_vector < 0) {
+      return g_cpu_count;
+    }
+  }
+
+  uint8_t *page = (uint8_t *)(uintptr_t)trampoline;
+  for (uint32_t i = 0; i < size; ++i) {
+    page[i] = smp_trampoline_start[i];
+  }
+  uint32_t base = (uint32_t)trampoline;
+  SmpTrampolineData *d =
+      (SmpTrampolineData *)(page + (smp_trampoline_data - smp_trampoline_start));
+  d->gdt_base = base + (uint32_t)((uint8_t *)d->gdt - page);
+  d->pm_offset = base + (uint32_t)(smp_trampoline_pm - smp_trampoline_start);
+  d->lm_offset = base + (uint32_t)(smp_trampoline_lm - smp_trampoline_start);
+
+  // Pages 1-3 map the first 2 MiB so the trampoline survives enabling
+  // paging; it moves to the BSP's tables right after the jump to 64-bit.
+  uint64_t *pml4 = (uint64_t *)(page + 0x1000);
+  uint64_t *pdpt = (uint64_t *)(page + 0x2000);
+  uint64_t *pd = (uint64_t *)(page + 0x3000);
+  for (uint32_t i = 0; i < 512; ++i) {
+    pml4[i] = 0;
+    pdpt[i] = 0;
+    pd[i] = 0;
+  }
+  pml4[0] = (trampoline + 0x2000) | 0x3;
+  pdpt[0] = (trampoline + 0x3000) | 0x3;
+  pd[0] = 0x83; // present, writable, 2 MiB
+  d->pml4 = base + 0x1000;
+  d->efer = (uint32_t)(rdmsr(MSR_EFER) & (EFER_SCE | EFER_LME | EFER_NXE));
+  d->cr3 = read_cr3();
+  d->cr4 = read_cr4();
+  d->cr0 = read_cr0();
+  d->entry = (uint64_t)(uintptr_t)ap_entry;
+
+  // One AP at a time: they all share the trampoline's stack and argument
+  // slots.
+  for (uint32_t i = 0; i < apic_cpu_count() && g_cpu_count < SMP_MAX_CPUS;
+       ++i) {
+    uint32_t id = apic_cpu_id(i);
+    if (id == bsp->apic_id) {
+      continue;
+    }
+    PerCpu *c = &g_cpus[g_cpu_count];
+    percpu_setup(c, g_cpu_count, id);
+    d->stack = (uint64_t)(uintptr_t)(g_stacks[g_cpu_count - 1] + SMP_STACK_SIZE);
+    d->arg = (uint64_t)(uintptr_t)c;
+    if (!ap_start(c, trampoline)) {
+      break;
+    }
+    g_cpu_count++;
+  }
+  return g_cpu_count;
+}
+
+uint32_t smp_cpu_count(void) {
+  return g_cpu_count;
+}
+
+PerCpu *smp_cpu(uint32_t index) {
+  return index < g_cpu_count ? &g_cpus[index] : 0;
+}
+
+int smp_call(uint32_t index, SmpFn fn, void *arg) {
+  if (index >= g_cpu_count || !fn) {
+    return 0;
+  }
+  PerCpu *c = &g_cpus[index];
+  // The BSP never waits in the mailbox loop.
+  if (index == 0 && c != this_cpu()) {
+    return 0;
+  }
+  uint32_t idle = 0;
+  if (!c->online ||
+      !__atomic_compare_exchange_n(&c->call_busy, &idle, 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  if (c == this_cpu()) {
+    fn(arg);
+    c->calls++;
+    __atomic_store_n(&c->call_busy, 0, __ATOMIC_RELEASE);
+    return 1;
+  }
+  c->call_arg = arg;
+  __atomic_store_n(&c->call_fn, fn, __ATOMIC_RELEASE);
+  lapic_send_ipi(c->apic_id, (uint32_t)g_call_vector);
+  return 1;
+}
+
+void smp_wait(uint32_t index) {
+  if (index >= g_cpu_count) {
+    return;
+  }
+  while (__atomic_load_n(&g_cpus[index].call_busy, __ATOMIC_ACQUIRE)) {
+    cpu_relax();
+  }
+}
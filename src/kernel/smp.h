@@ -0,0 +1,67 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+#define SMP_MAX_CPUS 32
+#define SMP_STACK_SIZE 16384
+#define SMP_IST_STACK_SIZE 4096
+
+// Segment selectors of the per-CPU GDT.
+#define SMP_KERNEL_CS 0x08
+#define SMP_KERNEL_DS 0x10
+#define SMP_TSS_SEL 0x18
+
+typedef void (*SmpFn)(void *arg);
+
+typedef struct {
+  uint32_t reserved0;
+  uint64_t rsp[3];
+  uint64_t reserved1;
+  uint64_t ist[7];
+  uint64_t reserved2;
+  uint16_t reserved3;
+  uint16_t iomap_base;
+} __attribute__((packed)) Tss;
+
+// One per CPU, reached through the GS base. `self` must stay first so that
+// this_cpu() is a single %gs:0 load.
+typedef struct PerCpu {
+  struct PerCpu *self;
+  uint32_t index;
+  uint32_t apic_id;
+  volatile uint32_t online;
+  // smp_call() mailbox: call_busy is claimed by the caller and released by
+  // the target once call_fn has returned.
+  volatile uint32_t call_busy;
+  SmpFn volatile call_fn;
+  void *volatile call_arg;
+  uint64_t calls;
+  uint64_t gdt[5]; // null, code, data, 16-byte TSS descriptor
+  Tss tss;
+} __attribute__((aligned(64))) PerCpu;
+
+static inline PerCpu *this_cpu(void) {
+  PerCpu *cpu;
+  __asm__ __volatile__("mov %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+// Give the BSP its per-CPU block, GDT and TSS. Call before idt_init() so
+// the IDT picks up the new code selector.
+int smp_init(void);
+// Start every enabled processor in the MADT through the real-mode page
+// `trampoline` (see BootInfo). Needs the LAPIC and TSC clock. Returns the
+// number of CPUs online, BSP included.
+uint32_t smp_start_aps(uint64_t trampoline);
+uint32_t smp_cpu_count(void);
+PerCpu *smp_cpu(uint32_t index);
+
+// Run fn(arg) on CPU `index` (directly if that is the caller). Returns 0
+// if that CPU is offline or still running an earlier call, or if it is the
+// BSP and the caller is not.
+int smp_call(uint32_t index, SmpFn fn, void *arg);
+// Wait until CPU `index` has finished its current smp_call().
+void smp_wait(uint32_t index);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+typedef struct {
+  volatile uint32_t locked;
+} Spinlock;
+
+static inline void spin_init(Spinlock *l) {
+  l->locked = 0;
+}
+
+// Interrupts stay off while the lock is held, so neither an interrupt
+// handler nor a preempting thread on this CPU can spin on it forever.
+static inline uint64_t spin_lock_irqsave(Spinlock *l) {
+  uint64_t flags = irq_save();
+  while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) {
+      cpu_relax();
+    }
+  }
+  return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock *l, uint64_t flags) {
+  __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+  irq_restore(flags);
+}
+
+#endif
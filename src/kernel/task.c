@@ -0,0 +1,238 @@
+#include "task.h"
+#include "cpu.h"
+#include "smp.h"
+#include "thread.h"
+
+// Per-CPU Chase-Lev deque: the owner pushes and pops at bottom, thieves
+// take from top. Must be a power of two. Several threads can share the
+// BSP's deque, so owner operations run with interrupts off to keep a
+// preemption from splitting them.
+#define TASK_DEQUE_SIZE 1024
+
+typedef struct {
+  volatile int64_t top;
+  uint8_t pad0[56];
+  volatile int64_t bottom;
+  uint8_t pad1[56];
+  Task *volatile slots[TASK_DEQUE_SIZE];
+} __attribute__((aligned(64))) TaskDeque;
+
+static TaskDeque g_deques[SMP_MAX_CPUS];
+static uint32_t g_workers = 1;
+// Tasks pushed but not yet taken by anyone; workers go back to sleep once
+// it reaches zero.
+static volatile uint32_t g_queued = 0;
+// Set while a CPU runs worker_loop() (so it only gets woken once).
+static volatile uint32_t g_active[SMP_MAX_CPUS];
+
+static int deque_push(TaskDeque *d, Task *t) {
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  if (b - top >= TASK_DEQUE_SIZE) {
+    return 0;
+  }
+  __atomic_store_n(&d->slots[b & (TASK_DEQUE_SIZE - 1)], t, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static Task *deque_pop(TaskDeque *d) {
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  if (top > b) {
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  Task *t = __atomic_load_n(&d->slots[b & (TASK_DEQUE_SIZE - 1)],
+                            __ATOMIC_RELAXED);
+  if (top == b) {
+    // Last entry: race any thief for it.
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      t = 0;
+    }
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return t;
+}
+
+static Task *deque_steal(TaskDeque *d) {
+  int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (top >= b) {
+    return 0;
+  }
+  Task *t = __atomic_load_n(&d->slots[top & (TASK_DEQUE_SIZE - 1)],
+                            __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  return t;
+}
+
+// Take one task: our own newest first, otherwise the oldest of another CPU,
+// starting with our neighbour so thieves spread out.
+static Task *task_take(uint32_t self) {
+  uint64_t flags = irq_save();
+  Task *t = deque_pop(&g_deques[self]);
+  irq_restore(flags);
+  for (uint32_t i = 1; !t && i < g_workers; ++i) {
+    t = deque_steal(&g_deques[(self + i) % g_workers]);
+  }
+  if (t) {
+    __atomic_fetch_sub(&g_queued, 1, __ATOMIC_RELAXED);
+  }
+  return t;
+}
+
+static void task_run(Task *t) {
+  t->fn(t->arg);
+  __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+}
+
+// Runs on an AP through smp_call() while there is anything to steal.
+static void worker_loop(void *arg) {
+  uint32_t self = this_cpu()->index;
+  for (;;) {
+    while (__atomic_load_n(&g_queued, __ATOMIC_ACQUIRE) != 0) {
+      Task *t = task_take(self);
+      if (t) {
+        task_run(t);
+      } else {
+        cpu_relax();
+      }
+    }
+    __atomic_store_n(&g_active[self], 0, __ATOMIC_SEQ_CST);
+    // A spawner that saw us active did not wake us; look once more.
+    uint32_t idle = 0;
+    if (__atomic_load_n(&g_queued, __ATOMIC_SEQ_CST) == 0 ||
+        !__atomic_compare_exchange_n(&g_active[self], &idle, 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+}
+
+// The BSP is never woken: it only takes part from inside task_join().
+static void wake_workers(uint32_t self) {
+  for (uint32_t i = 1; i < g_workers; ++i) {
+    if (i == self || __atomic_load_n(&g_active[i], __ATOMIC_RELAXED)) {
+      continue;
+    }
+    uint32_t idle = 0;
+    if (!__atomic_compare_exchange_n(&g_active[i], &idle, 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      continue;
+    }
+    if (!smp_call(i, worker_loop, 0)) {
+      __atomic_store_n(&g_active[i], 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+int task_init(void) {
+  for (uint32_t i = 0; i < SMP_MAX_CPUS; ++i) {
+    g_deques[i].top = 0;
+    g_deques[i].bottom = 0;
+    g_active[i] = 0;
+  }
+  g_queued = 0;
+  g_workers = 1;
+  task_set_workers(smp_cpu_count());
+  return 1;
+}
+
+void task_set_workers(uint32_t workers) {
+  uint32_t online = smp_cpu_count();
+  if (workers == 0) {
+    workers = 1;
+  }
+  g_workers = workers < online ? workers : online;
+}
+
+uint32_t task_workers(void) {
+  return g_workers;
+}
+
+void task_spawn(Task *t, TaskFn fn, void *arg) {
+  t->fn = fn;
+  t->arg = arg;
+  t->done = 0;
+  uint32_t self = this_cpu()->index;
+  if (g_workers < 2 || self >= g_workers) {
+    task_run(t);
+    return;
+  }
+  // Count it before it becomes visible so g_queued never underflows.
+  __atomic_fetch_add(&g_queued, 1, __ATOMIC_SEQ_CST);
+  uint64_t flags = irq_save();
+  int pushed = deque_push(&g_deques[self], t);
+  irq_restore(flags);
+  if (!pushed) {
+    __atomic_fetch_sub(&g_queued, 1, __ATOMIC_RELAXED);
+    task_run(t);
+    return;
+  }
+  wake_workers(self);
+}
+
+void task_join(Task *t) {
+  uint32_t self = this_cpu()->index;
+  while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+    Task *other = self < g_workers ? task_take(self) : 0;
+    if (other) {
+      task_run(other);
+    } else if (self == 0) {
+      // Threads only run on the BSP; let them in while the workers finish.
+      thread_yield();
+    } else {
+      cpu_relax();
+    }
+  }
+}
+
+typedef struct {
+  uint32_t begin;
+  uint32_t end;
+  uint32_t grain;
+  TaskRangeFn body;
+  void *arg;
+} TaskRange;
+
+// Split in halves: the upper half goes to the deque where an idle CPU can
+// steal it, the lower half is handled here.
+static void parallel_range(void *p) {
+  TaskRange *r = (TaskRange *)p;
+  if (r->end - r->begin <= r->grain) {
+    r->body(r->begin, r->end, r->arg);
+    return;
+  }
+  uint32_t mid = r->begin + (r->end - r->begin) / 2;
+  TaskRange hi = *r;
+  hi.begin = mid;
+  TaskRange lo = *r;
+  lo.end = mid;
+  Task t;
+  task_spawn(&t, parallel_range, &hi);
+  parallel_range(&lo);
+  task_join(&t);
+}
+
+void task_parallel_for(uint32_t begin, uint32_t end, uint32_t grain,
+                       TaskRangeFn body, void *arg) {
+  if (begin >= end) {
+    return;
+  }
+  TaskRange r;
+  r.begin = begin;
+  r.end = end;
+  r.grain = grain ? grain : 1;
+  r.body = body;
+  r.arg = arg;
+  parallel_range(&r);
+}
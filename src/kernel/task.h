@@ -0,0 +1,36 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <stdint.h>
+
+typedef void (*TaskFn)(void *arg);
+
+// A unit of work. The caller owns the storage and must keep it alive until
+// task_join() returns.
+typedef struct {
+  TaskFn fn;
+  void *arg;
+  volatile uint32_t done;
+} Task;
+
+// Set up one work-stealing deque per online CPU (after smp_start_aps()).
+int task_init(void);
+// Limit the pool to CPUs 0..workers-1 (clamped to the CPUs online). Only
+// change this while no tasks are queued.
+void task_set_workers(uint32_t workers);
+uint32_t task_workers(void);
+
+// Queue t on the calling CPU; idle CPUs are woken to steal it. If the
+// deque is full the task runs right away instead.
+void task_spawn(Task *t, TaskFn fn, void *arg);
+// Run queued tasks (ours first, then stolen ones) until t has finished. On
+// the BSP this yields to other threads when there is nothing to take.
+void task_join(Task *t);
+
+// Call body on disjoint subranges of [begin, end), each at most `grain`
+// long, spread over the pool. Returns when all of them have finished.
+typedef void (*TaskRangeFn)(uint32_t begin, uint32_t end, void *arg);
+void task_parallel_for(uint32_t begin, uint32_t end, uint32_t grain,
+                       TaskRangeFn body, void *arg);
+
+#endif
@@ -0,0 +1,318 @@
+#include "thread.h"
+#include "apic.h"
+#include "console.h"
+#include "cpu.h"
+#include "smp.h"
+#include "time.h"
+
+// Threads only run on the BSP; APs serve the task pool. Every scheduler
+// structure is touched with interrupts disabled.
+
+static Thread g_threads[THREAD_MAX];
+static uint8_t g_thread_stacks[THREAD_MAX][THREAD_STACK_SIZE]
+    __attribute__((aligned(16)));
+static uint8_t g_fx_template[512] __attribute__((aligned(16)));
+static Thread *g_current = 0;
+static Thread *g_idle = 0;
+static WaitQueue g_runq;
+static uint32_t g_next_id = 0;
+static uint64_t g_last_tick = 0;
+static volatile uint32_t g_resched = 0;
+static int g_started = 0;
+
+void thread_switch(uint64_t *save_rsp, uint64_t rsp, void *save_fx,
+                   const void *fx);
+
+static void queue_push(WaitQueue *q, Thread *t) {
+  t->next = 0;
+  if (q->tail) {
+    q->tail->next = t;
+  } else {
+    q->head = t;
+  }
+  q->tail = t;
+}
+
+static Thread *queue_pop(WaitQueue *q) {
+  Thread *t = q->head;
+  if (t) {
+    q->head = t->next;
+    if (!q->head) {
+      q->tail = 0;
+    }
+    t->next = 0;
+  }
+  return t;
+}
+
+static void make_ready(Thread *t) {
+  t->state = THREAD_READY;
+  queue_push(&g_runq, t);
+  g_resched = 1;
+}
+
+// Round robin: the current thread goes to the back of the run queue unless
+// it is blocking, and the idle thread only runs when nothing else can.
+static void schedule(void) {
+  Thread *prev = g_current;
+  if (prev->state == THREAD_RUNNING) {
+    if (!g_runq.head) {
+      return;
+    }
+    prev->state = THREAD_READY;
+    if (prev != g_idle) {
+      queue_push(&g_runq, prev);
+    }
+  }
+  Thread *next = queue_pop(&g_runq);
+  if (!next) {
+    next = g_idle;
+  }
+  next->state = THREAD_RUNNING;
+  if (next == prev) {
+    return;
+  }
+  uint64_t now = ktime_now();
+  prev->run_ns += now - prev->last_start;
+  next->last_start = now;
+  next->switches++;
+  g_current = next;
+  thread_switch(&prev->rsp, next->rsp, prev->fx, next->fx);
+}
+
+static void wake_sleepers(void) {
+  uint64_t now = ktime_now();
+  for (uint32_t i = 0; i < THREAD_MAX; ++i) {
+    Thread *t = &g_threads[i];
+    if (t->state == THREAD_SLEEPING && now >= t->wake_at) {
+      make_ready(t);
+    }
+  }
+}
+
+// First code a new thread runs: thread_switch() returns here with
+// interrupts still disabled by whoever switched to it.
+static void thread_entry(void) {
+  irq_enable();
+  Thread *t = g_current;
+  t->fn(t->arg);
+  thread_exit();
+}
+
+static void idle_loop(void *arg) {
+  for (;;) {
+    irq_disable();
+    if (g_runq.head) {
+      schedule();
+      irq_enable();
+    } else {
+      // Nothing else wants the CPU: put any buffered output on screen.
+      console_flush();
+      irq_wait();
+    }
+  }
+}
+
+static Thread *thread_alloc(const char *name) {
+  for (uint32_t i = 0; i < THREAD_MAX; ++i) {
+    Thread *t = &g_threads[i];
+    if (t->state == THREAD_DEAD && t != g_current) {
+      t->id = g_next_id++;
+      t->name = name;
+      t->next = 0;
+      t->wake_at = 0;
+      t->stack = g_thread_stacks[i];
+      t->switches = 0;
+      t->preemptions = 0;
+      t->run_ns = 0;
+      t->last_start = ktime_now();
+      return t;
+    }
+  }
+  return 0;
+}
+
+int thread_init(void) {
+  for (uint32_t i = 0; i < THREAD_MAX; ++i) {
+    g_threads[i].state = THREAD_DEAD;
+  }
+  g_runq.head = 0;
+  g_runq.tail = 0;
+  g_next_id = 0;
+  g_resched = 0;
+  g_started = 0;
+  g_current = 0;
+  __asm__ __volatile__("fxsave %0" : "=m"(g_fx_template));
+
+  // The caller keeps its own stack; slot 0's stack is never used.
+  Thread *boot = thread_alloc("main");
+  boot->state = THREAD_RUNNING;
+  g_current = boot;
+  g_idle = thread_create("idle", idle_loop, 0);
+  if (!g_idle) {
+    return 0;
+  }
+  // The idle thread is picked by schedule() directly, never queued.
+  uint64_t flags = irq_save();
+  g_runq.head = 0;
+  g_runq.tail = 0;
+  g_idle->state = THREAD_READY;
+  g_last_tick = lapic_timer_ticks();
+  g_started = 1;
+  irq_restore(flags);
+  return 1;
+}
+
+Thread *thread_create(const char *name, ThreadFn fn, void *arg) {
+  uint64_t flags = irq_save();
+  Thread *t = thread_alloc(name);
+  if (!t) {
+    irq_restore(flags);
+    return 0;
+  }
+  t->fn = fn;
+  t->arg = arg;
+  for (uint32_t i = 0; i < sizeof(t->fx); ++i) {
+    t->fx[i] = g_fx_template[i];
+  }
+  // Frame popped by thread_switch(): six callee-saved registers, then the
+  // return into thread_entry with a fake caller address above it so the
+  // entry sees the usual call alignment.
+  uint64_t *sp = (uint64_t *)(t->stack + THREAD_STACK_SIZE);
+  *--sp = 0;
+  *--sp = (uint64_t)(uintptr_t)thread_entry;
+  for (int i = 0; i < 6; ++i) {
+    *--sp = 0;
+  }
+  t->rsp = (uint64_t)(uintptr_t)sp;
+  make_ready(t);
+  irq_restore(flags);
+  return t;
+}
+
+Thread *thread_current(void) {
+  return g_current;
+}
+
+void thread_yield(void) {
+  if (!g_started) {
+    return;
+  }
+  uint64_t flags = irq_save();
+  schedule();
+  irq_restore(flags);
+}
+
+void thread_sleep(uint64_t ns) {
+  if (!g_started || this_cpu()->index != 0) {
+    ktime_delay(ns);
+    return;
+  }
+  uint64_t flags = irq_save();
+  g_current->wake_at = ktime_deadline(ns);
+  g_current->state = THREAD_SLEEPING;
+  schedule();
+  irq_restore(flags);
+}
+
+void thread_exit(void) {
+  irq_disable();
+  g_current->state = THREAD_DEAD;
+  schedule();
+  for (;;) {
+    __asm__ __volatile__("hlt");
+  }
+}
+
+void thread_preempt(void) {
+  if (!g_started || this_cpu()->index != 0) {
+    return;
+  }
+  uint64_t tick = lapic_timer_ticks();
+  if (tick != g_last_tick) {
+    g_last_tick = tick;
+    wake_sleepers();
+  } else if (!g_resched) {
+    return;
+  }
+  g_resched = 0;
+  Thread *prev = g_current;
+  schedule();
+  if (g_current != prev) {
+    prev->preemptions++;
+  }
+}
+
+int thread_get(uint32_t index, Thread *out) {
+  if (index >= THREAD_MAX) {
+    return 0;
+  }
+  uint64_t flags = irq_save();
+  const Thread *t = &g_threads[index];
+  int used = t->state != THREAD_DEAD;
+  if (used) {
+    out->id = t->id;
+    out->state = t->state;
+    out->name = t->name;
+    out->switches = t->switches;
+    out->preemptions = t->preemptions;
+    out->run_ns = t->run_ns;
+    if (t == g_current) {
+      out->run_ns += ktime_now() - t->last_start;
+    }
+  }
+  irq_restore(flags);
+  return used;
+}
+
+void waitq_init(WaitQueue *q) {
+  q->head = 0;
+  q->tail = 0;
+}
+
+void waitq_wait(WaitQueue *q) {
+  if (!g_started || this_cpu()->index != 0) {
+    irq_wait();
+    return;
+  }
+  g_current->state = THREAD_BLOCKED;
+  queue_push(q, g_current);
+  schedule();
+  irq_enable();
+}
+
+void waitq_wake_all(WaitQueue *q) {
+  uint64_t flags = irq_save();
+  Thread *t;
+  while ((t = queue_pop(q)) != 0) {
+    make_ready(t);
+  }
+  irq_restore(flags);
+}
+
+void mutex_init(Mutex *m) {
+  m->locked = 0;
+  m->owner = 0;
+  waitq_init(&m->waiters);
+}
+
+void mutex_lock(Mutex *m) {
+  for (;;) {
+    irq_disable();
+    if (!m->locked) {
+      m->locked = 1;
+      m->owner = g_current;
+      irq_enable();
+      return;
+    }
+    waitq_wait(&m->waiters);
+  }
+}
+
+void mutex_unlock(Mutex *m) {
+  uint64_t flags = irq_save();
+  m->locked = 0;
+  m->owner = 0;
+  waitq_wake_all(&m->waiters);
+  irq_restore(flags);
+}
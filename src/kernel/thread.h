@@ -0,0 +1,77 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdint.h>
+
+#define THREAD_MAX 16
+#define THREAD_STACK_SIZE 32768
+
+#define THREAD_READY 0
+#define THREAD_RUNNING 1
+#define THREAD_BLOCKED 2
+#define THREAD_SLEEPING 3
+#define THREAD_DEAD 4
+
+typedef void (*ThreadFn)(void *arg);
+
+// A kernel thread on the BSP. rsp and fx are the context saved by
+// thread_switch(); a thread preempted by an interrupt also has the full
+// interrupt frame (general and SSE registers) on its own stack.
+typedef struct Thread {
+  uint8_t fx[512] __attribute__((aligned(16)));
+  uint64_t rsp;
+  uint32_t id;
+  volatile uint32_t state;
+  const char *name;
+  ThreadFn fn;
+  void *arg;
+  struct Thread *next; // run queue or wait queue link
+  uint64_t wake_at;    // ktime_now() deadline while THREAD_SLEEPING
+  uint8_t *stack;
+  // Stats.
+  uint64_t switches;
+  uint64_t preemptions;
+  uint64_t run_ns;
+  uint64_t last_start;
+} Thread;
+
+typedef struct {
+  Thread *head;
+  Thread *tail;
+} WaitQueue;
+
+typedef struct {
+  volatile uint32_t locked;
+  Thread *owner;
+  WaitQueue waiters;
+} Mutex;
+
+// Turn the running boot code into thread 0 and start preempting it on the
+// LAPIC timer tick. Needs lapic_timer_init().
+int thread_init(void);
+// Returns 0 if every thread slot is in use.
+Thread *thread_create(const char *name, ThreadFn fn, void *arg);
+Thread *thread_current(void);
+void thread_yield(void);
+void thread_sleep(uint64_t ns);
+void thread_exit(void) __attribute__((noreturn));
+// Called by the interrupt dispatcher after the EOI; switches threads when a
+// timer tick has passed or a sleeper was woken.
+void thread_preempt(void);
+
+// Copy of slot `index` for stats; returns 0 for an unused slot.
+int thread_get(uint32_t index, Thread *out);
+
+void waitq_init(WaitQueue *q);
+// Block until waitq_wake_all(q). Call with interrupts disabled, after
+// checking the condition being waited for; returns with them enabled.
+// Before thread_init() this halts until the next interrupt instead.
+void waitq_wait(WaitQueue *q);
+// Make every waiter runnable. Safe from interrupt handlers.
+void waitq_wake_all(WaitQueue *q);
+
+void mutex_init(Mutex *m);
+void mutex_lock(Mutex *m);
+void mutex_unlock(Mutex *m);
+
+#endif
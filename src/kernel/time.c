@@ -0,0 +1,74 @@
+#include "time.h"
+#include "cpu.h"
+#include "pit.h"
+
+#define TIME_CALIBRATE_US 50000u
+#define TIME_DEFAULT_TSC_HZ 2000000000ull
+
+static uint64_t g_tsc_base = 0;
+static uint64_t g_tsc_hz = TIME_DEFAULT_TSC_HZ;
+// Nanoseconds per TSC tick as a 32.32 fixed-point factor.
+static uint64_t g_ns_per_tick = (KTIME_SEC << 32) / TIME_DEFAULT_TSC_HZ;
+
+static void time_set_hz(uint64_t hz) {
+  g_tsc_hz = hz;
+  g_ns_per_tick = (KTIME_SEC << 32) / hz;
+}
+
+// Count TSC ticks across a 50 ms PIT one-shot. The spin bound only guards
+// against a missing PIT; nothing else can time this loop yet.
+static uint64_t time_calibrate_pit(void) {
+  pit_oneshot_start(TIME_CALIBRATE_US);
+  uint64_t start = rdtsc();
+  uint32_t spins = 100000000;
+  while (!pit_oneshot_done() && spins) {
+    spins--;
+  }
+  uint64_t end = rdtsc();
+  pit_oneshot_stop();
+  if (spins == 0 || end <= start) {
+    return 0;
+  }
+  return (end - start) * (1000000u / TIME_CALIBRATE_US);
+}
+
+// CPUID leaf 0x16 reports the nominal core frequency in MHz.
+static uint64_t time_cpuid_hz(void) {
+  uint32_t a, b, c, d;
+  cpuid(0, 0, &a, &b, &c, &d);
+  if (a < 0x16) {
+    return 0;
+  }
+  cpuid(0x16, 0, &a, &b, &c, &d);
+  return (uint64_t)(a & 0xFFFF) * 1000000ull;
+}
+
+int time_init(void) {
+  g_tsc_base = rdtsc();
+  uint64_t hz = time_calibrate_pit();
+  int ok = hz != 0;
+  if (!ok) {
+    hz = time_cpuid_hz();
+  }
+  if (hz == 0) {
+    hz = TIME_DEFAULT_TSC_HZ;
+  }
+  time_set_hz(hz);
+  return ok;
+}
+
+uint64_t time_tsc_hz(void) {
+  return g_tsc_hz;
+}
+
+uint64_t ktime_now(void) {
+  uint64_t ticks = rdtsc() - g_tsc_base;
+  return (uint64_t)(((unsigned __int128)ticks * g_ns_per_tick) >> 32);
+}
+
+void ktime_delay(uint64_t ns) {
+  uint64_t deadline = ktime_deadline(ns);
+  while (!ktime_expired(deadline)) {
+    cpu_relax();
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef TIME_H
+#define TIME_H
+
+#include <stdint.h>
+
+#define KTIME_US 1000ull
+#define KTIME_MS 1000000ull
+#define KTIME_SEC 1000000000ull
+
+// Calibrate the TSC against the PIT. Until this has run, ktime_now()
+// assumes a 2 GHz TSC.
+int time_init(void);
+uint64_t time_tsc_hz(void);
+
+// Monotonic nanoseconds since time_init().
+uint64_t ktime_now(void);
+
+// Deadlines are absolute ktime_now() values:
+//   uint64_t deadline = ktime_deadline(500 * KTIME_MS);
+//   while (!ready() && !ktime_expired(deadline)) { cpu_relax(); }
+static inline uint64_t ktime_deadline(uint64_t timeout_ns) {
+  return ktime_now() + timeout_ns;
+}
+
+static inline int ktime_expired(uint64_t deadline) {
+  return ktime_now() >= deadline;
+}
+
+void ktime_delay(uint64_t ns);
+
+#endif
@@ -259,6 +259,32 @@ file_opened:
   return EFI_SUCCESS;
 }
 
+static int guid_equal(const EFI_GUID *a, const EFI_GUID *b) {
+  const UINT8 *x = (const UINT8 *)a;
+  const UINT8 *y = (const UINT8 *)b;
+  for (UINTN i = 0; i < sizeof(EFI_GUID); ++i) {
+    if (x[i] != y[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Prefer the ACPI 2.0+ RSDP (it carries the XSDT pointer).
+static UINT64 find_acpi_rsdp(EFI_SYSTEM_TABLE *st) {
+  UINT64 rsdp = 0;
+  for (UINTN i = 0; i < st->NumberOfTableEntries; ++i) {
+    EFI_CONFIGURATION_TABLE *t = &st->ConfigurationTable[i];
+    if (guid_equal(&t->VendorGuid, &EFI_ACPI_20_TABLE_GUID)) {
+      return (UINT64)(UINTN)t->VendorTable;
+    }
+    if (guid_equal(&t->VendorGuid, &EFI_ACPI_10_TABLE_GUID)) {
+      rsdp = (UINT64)(UINTN)t->VendorTable;
+    }
+  }
+  return rsdp;
+}
+
 extern void jump_to_kernel(void *entry, void *stack_top, struct BootInfo *info);
 extern const unsigned char kernel_blob[];
 extern const unsigned int kernel_blob_len;
@@ -278,8 +304,13 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
     kernel_size = (UINTN)kernel_blob_len;
   }
 
-  UINTN pages = (kernel_size + 0xFFF) / 0x1000;
-  UINT64 kernel_addr = 0x100000;
+  if (kernel_size > KERNEL_IMAGE_MAX) {
+    print16(st, u"Kernel image too large\r\n");
+    return EFI_LOAD_ERROR;
+  }
+  // Reserve room for .bss as well; the kernel file ends with .data.
+  UINTN pages = KERNEL_IMAGE_MAX / 0x1000;
+  UINT64 kernel_addr = KERNEL_LOAD_ADDR;
   status = st->BootServices->AllocatePages(EFI_ALLOCATE_ADDRESS,
                                            EFI_MEMORY_TYPE_LOADER_DATA, pages,
                                            &kernel_addr);
@@ -294,6 +325,9 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
   for (UINTN i = 0; i < kernel_size; ++i) {
     dst[i] = src[i];
   }
+  for (UINTN i = kernel_size; i < KERNEL_IMAGE_MAX; ++i) {
+    dst[i] = 0;
+  }
 
   // Get GOP framebuffer
   EFI_GRAPHICS_OUTPUT_PROTOCOL *gop = NULL;
@@ -311,8 +345,9 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
   info.fb.height = gop->Mode->Info->VerticalResolution;
   info.fb.pixels_per_scanline = gop->Mode->Info->PixelsPerScanLine;
   info.fb.pixel_format = gop->Mode->Info->PixelFormat;
+  info.acpi_rsdp = find_acpi_rsdp(st);
 
-  // Memory map for ExitBootServices
+  // Memory map for ExitBootServices and the kernel's page allocator
   UINTN map_size = 0;
   UINTN map_key = 0;
   UINTN desc_size = 0;
@@ -341,12 +376,24 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
   }
   void *stack_top = (void *)(UINTN)(stack_addr + stack_pages * 0x1000);
 
+  // Application processors start in real mode, so their entry code has to
+  // live below 1 MiB.
+  UINT64 trampoline_addr = 0x9FFFF;
+  status = st->BootServices->AllocatePages(EFI_ALLOCATE_MAX_ADDRESS,
+                                           EFI_MEMORY_TYPE_LOADER_DATA, 4,
+                                           &trampoline_addr);
+  info.ap_trampoline = (status == EFI_SUCCESS) ? trampoline_addr : 0;
+
   status = st->BootServices->GetMemoryMap(&map_size, map, &map_key, &desc_size,
                                           &desc_ver);
   if (status != EFI_SUCCESS) {
     print16(st, u"Failed to get memory map\r\n");
     return status;
   }
+  info.memory_map.base = (UINT64)(UINTN)map;
+  info.memory_map.size = map_size;
+  info.memory_map.desc_size = desc_size;
+  info.memory_map.desc_version = desc_ver;
 
   status = st->BootServices->ExitBootServices(image, map_key);
   if (status != EFI_SUCCESS) {
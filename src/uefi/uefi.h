@@ -58,6 +58,11 @@ struct EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL {
 
 typedef struct EFI_BOOT_SERVICES EFI_BOOT_SERVICES;
 
+typedef struct {
+  EFI_GUID VendorGuid;
+  void *VendorTable;
+} EFI_CONFIGURATION_TABLE;
+
 typedef struct {
   EFI_TABLE_HEADER Hdr;
   CHAR16 *FirmwareVendor;
@@ -70,8 +75,8 @@ typedef struct {
   EFI_SIMPLE_TEXT_OUTPUT_PROTOCOL *StdErr;
   void *RuntimeServices;
   EFI_BOOT_SERVICES *BootServices;
-  void *NumberOfTableEntries;
-  void *ConfigurationTable;
+  UINTN NumberOfTableEntries;
+  EFI_CONFIGURATION_TABLE *ConfigurationTable;
 } EFI_SYSTEM_TABLE;
 
 // Loaded Image Protocol
@@ -319,6 +324,14 @@ static const EFI_GUID EFI_LOADED_IMAGE_PROTOCOL_GUID = {
     0x5b1b31a1, 0x9562, 0x11d2,
     {0x8e, 0x3f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
 
+static const EFI_GUID EFI_ACPI_20_TABLE_GUID = {
+    0x8868e871, 0xe4f1, 0x11d3,
+    {0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81}};
+
+static const EFI_GUID EFI_ACPI_10_TABLE_GUID = {
+    0xeb9d2d30, 0x2d88, 0x11d3,
+    {0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d}};
+
 #endif
 #define EFI_ALLOCATE_ANY_PAGES 0
 #define EFI_ALLOCATE_MAX_ADDRESS 1